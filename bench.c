@@ -0,0 +1,646 @@
+/* bench.c
+ *
+ * Description
+ *  load generator for server.c
+ * Specification
+ *  Opens --conns connections spread over --threads threads and keeps them
+ *  busy with a weighted mix of requests for --duration seconds. Closed loop
+ *  (the default) sends the next request as soon as the last reply is in;
+ *  with --rate the requests are sent on a fixed schedule instead and latency
+ *  is measured from when each request was due, so a slow server can't hide
+ *  its queueing. Latencies go into log-linear (HDR-style) histograms.
+ *  Connect and request framing come from client.c.
+ * Example
+ *  gcc -Wall bench.c -o bench -lpthread -lm
+ *  gcc -Wall -DHAVE_TLS bench.c -o bench -lpthread -lm -lssl -lcrypto
+ *  ./server --epoll 4440
+ *  ./bench --threads 2 --conns 32 --mix "index:1,log:1,hello:8" \
+ *      127.0.0.1:4440
+ *  ./bench --framed --rate 20000 --duration 30 127.0.0.1:4440
+ *  ./bench --framed --tune none --tune nodelay --tune rcvbuf=4194304 \
+ *      --mix hello 127.0.0.1:4440  (a round per client socket profile,
+ *      same load; the server's own --tune needs a restart per profile)
+ *  ./bench --mix bigfile 127.0.0.1:4440 then, against a --tls-cert server,
+ *  ./bench --tls --ca cert.pem --mix bigfile 127.0.0.1:4443  (legacy
+ *      connections are one request each, so "connect" is the handshake's
+ *      cost over plaintext and MB/s the records')
+ */
+
+#define CLIENT_NO_MAIN
+#include "client.c"
+
+#include <math.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+
+#define HIST_SUB_BITS 7 // 64 buckets per power of two, under 1% error
+#define HIST_HALF (1 << (HIST_SUB_BITS - 1))
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 2) * HIST_HALF)
+#define MIX_MAX 32
+#define BENCH_EVENTS 64
+#define TUNE_MAX 16 // --tune profiles, one round each
+
+/* hist -- nanosecond latencies; a bucket covers [value, value * 1.016) */
+typedef struct hist {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total, max;
+} hist;
+
+typedef struct mix_entry {
+    char cmd[256];
+    int weight;
+} mix_entry;
+
+typedef struct bench_conn {
+    int fd;
+    int busy;
+    uint32_t id;
+    uint64_t start_ns;     // when the request in flight was due
+    uint64_t next_ns;      // open loop: when the next one is due
+    char hdr[FRAME_RESP_LEN];
+    size_t hdr_len;
+    uint64_t body_left;
+    uint64_t body_len;
+} bench_conn;
+
+typedef struct bench_thread {
+    pthread_t thread;
+    int first, nconns;     // global index of our first connection, count
+    unsigned int seed;
+    hist lat;
+    hist connect;          // connect_to(), with --tls the handshake too
+    uint64_t requests, errors, bytes;
+    uint64_t statuses[ST_COUNT]; // framed replies by status, NOT_FOUND and
+                                 // BUSY are answers too, not errors
+} bench_thread;
+
+char *ipaddr, *port, *hostport;
+int framed = 0, nthreads = 1, nconns = 1, nmix = 0, mix_total = 0;
+double rate = 0, duration = 10;
+uint64_t bench_start, bench_end;
+mix_entry mix[MIX_MAX];
+char *profiles[TUNE_MAX];
+int nprofiles = 0;
+
+void bench_usage();
+int parse_mix(char*);
+int bench_round(char*);
+void *bench_main(void*);
+int bench_send(bench_thread*, bench_conn*, int, uint64_t);
+int bench_recv(bench_thread*, bench_conn*);
+void bench_done(bench_thread*, bench_conn*, int, uint64_t);
+uint64_t now_ns();
+int hist_index(uint64_t);
+uint64_t hist_value(int);
+void hist_record(hist*, uint64_t);
+void hist_merge(hist*, hist*);
+uint64_t hist_percentile(hist*, double);
+
+void bench_usage()
+{
+    fprintf(stderr, "Usage: bench [--threads T] [--conns M] [--duration S] "
+        "[--rate R] [--mix cmd:w,...] [--framed] [--tune opt,...]... "
+        "[--tls [--ca file]] ipaddr:port\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    int opt, i, rv = 0;
+    char *mix_spec = "index:1,log:1", *ca = NULL;
+    static struct option long_opts[] = {
+        {"threads", required_argument, NULL, 't'},
+        {"conns", required_argument, NULL, 'c'},
+        {"duration", required_argument, NULL, 'd'},
+        {"rate", required_argument, NULL, 'r'},
+        {"mix", required_argument, NULL, 'm'},
+        {"framed", no_argument, NULL, 'f'},
+        {"tune", required_argument, NULL, 'T'},
+        {"tls", no_argument, NULL, 'S'},
+        {"ca", required_argument, NULL, 'A'},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "t:c:d:r:m:fT:SA:", long_opts, NULL))
+        != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'c':
+            nconns = atoi(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'm':
+            mix_spec = optarg;
+            break;
+        case 'f':
+            framed = 1;
+            break;
+        case 'T':
+            if (nprofiles == TUNE_MAX || tune_parse(optarg, &tune) == -1)
+            {
+                bench_usage();
+            }
+            profiles[nprofiles++] = optarg;
+            break;
+        case 'A':
+            ca = optarg;
+            // fall through
+        case 'S':
+#ifndef HAVE_TLS
+            fprintf(stderr, "bench: built without TLS, no --tls\n");
+            exit(EXIT_FAILURE);
+#endif
+            use_tls = 1;
+            break;
+        default:
+            bench_usage();
+        }
+    }
+    if (optind + 1 != argc || nthreads < 1 || nconns < nthreads ||
+        duration <= 0 || rate < 0 || parse_mix(mix_spec) == -1)
+    {
+        bench_usage();
+    }
+    hostport = argv[optind];
+    if ((ipaddr = strdup(hostport)) == NULL)
+    {
+        fprintf(stderr, "strdup() failed in line %d\n", __LINE__);
+        exit(EXIT_FAILURE);
+    }
+    ipaddr = strtok(ipaddr, ":");
+    port = strtok(NULL, " ");
+    if (ipaddr == NULL || port == NULL)
+    {
+        bench_usage();
+    }
+    if (use_tls)
+    {
+        tls_client_init(ca);
+    }
+
+    if (nprofiles == 0)
+    {
+        return (bench_round(NULL));
+    }
+    for (i = 0; i < nprofiles; i++)
+    {
+        tune_parse(profiles[i], &tune);
+        rv |= bench_round(profiles[i]);
+    }
+
+    return (rv);
+}
+
+/* bench_round -- run the load once, with the socket options in tune, and
+ * print what came of it; profile names them, NULL for no --tune */
+int bench_round(char *profile)
+{
+    bench_thread *threads;
+    hist lat, connect;
+    uint64_t requests = 0, errors = 0, bytes = 0, statuses[ST_COUNT];
+    int i, j;
+    double secs;
+
+    if ((threads = calloc(nthreads, sizeof(bench_thread))) == NULL)
+    {
+        fprintf(stderr, "calloc() failed in line %d\n", __LINE__);
+        exit(EXIT_FAILURE);
+    }
+    bench_start = now_ns();
+    bench_end = bench_start + (uint64_t)(duration * 1e9);
+    for (i = 0, j = 0; i < nthreads; i++)
+    {
+        threads[i].first = j;
+        threads[i].nconns = nconns / nthreads + (i < nconns % nthreads);
+        threads[i].seed = i + 1;
+        j += threads[i].nconns;
+        if (pthread_create(&threads[i].thread, NULL, bench_main, &threads[i])
+            != 0)
+        {
+            fprintf(stderr, "pthread_create() failed in line %d\n", __LINE__);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    memset(&lat, 0, sizeof lat);
+    memset(&connect, 0, sizeof connect);
+    memset(statuses, 0, sizeof statuses);
+    for (i = 0; i < nthreads; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+        hist_merge(&lat, &threads[i].lat);
+        hist_merge(&connect, &threads[i].connect);
+        requests += threads[i].requests;
+        errors += threads[i].errors;
+        for (j = 0; j < ST_COUNT; j++)
+        {
+            statuses[j] += threads[i].statuses[j];
+        }
+        bytes += threads[i].bytes;
+    }
+    secs = (now_ns() - bench_start) / 1e9;
+
+    printf("%s%s, %d threads, %d connections, %s loop", framed ? "framed" :
+        "legacy", use_tls ? " over TLS" : "", nthreads, nconns, 
+        rate > 0 ? "open" : "closed");
+    if (rate > 0)
+    {
+        printf(" at %.0f req/s", rate);
+    }
+    if (profile != NULL)
+    {
+        printf(", --tune %s", profile);
+    }
+    printf("\nrequests    %llu (%llu errors) in %.2f s\n",
+        (unsigned long long)requests, (unsigned long long)errors, secs);
+    if (framed)
+    {
+        printf("statuses   ");
+        for (j = 0; j < ST_COUNT; j++)
+        {
+            if (statuses[j] > 0)
+            {
+                printf(" %s %llu", status_names[j], 
+                    (unsigned long long)statuses[j]);
+            }
+        }
+        printf("\n");
+    }
+    printf("throughput  %.1f req/s  %.2f MB/s\n", requests / secs,
+        bytes / secs / 1e6);
+    printf("latency us  p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+        hist_percentile(&lat, 50) / 1e3, hist_percentile(&lat, 99) / 1e3,
+        hist_percentile(&lat, 99.9) / 1e3, lat.max / 1e3);
+    printf("connect us  p50 %.1f  p99 %.1f  max %.1f  (%llu)\n",
+        hist_percentile(&connect, 50) / 1e3, 
+        hist_percentile(&connect, 99) / 1e3, connect.max / 1e3,
+        (unsigned long long)connect.total);
+    free(threads);
+
+    return (errors > 0);
+}
+
+/* parse_mix -- "cmd:weight,cmd:weight"; a missing weight counts as 1 */
+int parse_mix(char *spec)
+{
+    char *copy, *item, *colon, *save;
+
+    if ((copy = strdup(spec)) == NULL)
+    {
+        fprintf(stderr, "strdup() failed in line %d\n", __LINE__);
+        exit(EXIT_FAILURE);
+    }
+    for (item = strtok_r(copy, ",", &save); item != NULL;
+        item = strtok_r(NULL, ",", &save))
+    {
+        if (nmix == MIX_MAX)
+        {
+            free(copy);
+            return (-1);
+        }
+        mix[nmix].weight = 1;
+        if ((colon = strrchr(item, ':')) != NULL)
+        {
+            *colon = '\0';
+            mix[nmix].weight = atoi(colon + 1);
+        }
+        if (mix[nmix].weight <= 0 || *item == '\0' ||
+            strlen(item) >= sizeof(mix[nmix].cmd))
+        {
+            free(copy);
+            return (-1);
+        }
+        strcpy(mix[nmix].cmd, item);
+        mix_total += mix[nmix].weight;
+        nmix++;
+    }
+    free(copy);
+
+    return (nmix > 0 ? 0 : -1);
+}
+
+/* bench_main -- one thread: its share of the connections on one epoll */
+void *bench_main(void *arg)
+{
+    bench_thread *t = arg;
+    bench_conn *conns;
+    struct epoll_event events[BENCH_EVENTS];
+    uint64_t now, wake, interval = 0;
+    int ep, i, n, timeout;
+
+    if ((conns = calloc(t->nconns, sizeof(bench_conn))) == NULL)
+    {
+        fprintf(stderr, "calloc() failed in line %d\n", __LINE__);
+        exit(EXIT_FAILURE);
+    }
+    if ((ep = epoll_create1(0)) == -1)
+    {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    // open loop: each connection sends every nconns / rate seconds,
+    // staggered so the whole run sends evenly at rate
+    if (rate > 0)
+    {
+        interval = (uint64_t)(nconns * 1e9 / rate);
+    }
+    for (i = 0; i < t->nconns; i++)
+    {
+        conns[i].fd = -1;
+        conns[i].next_ns = bench_start + (uint64_t)((t->first + i) * 1e9 /
+            (rate > 0 ? rate : 1e9));
+    }
+
+    while ((now = now_ns()) < bench_end)
+    {
+        wake = bench_end;
+        for (i = 0; i < t->nconns; i++)
+        {
+            if (conns[i].busy)
+            {
+                continue;
+            }
+            if (rate == 0)
+            {
+                bench_send(t, &conns[i], ep, now);
+            }
+            else if (now >= conns[i].next_ns)
+            {
+                bench_send(t, &conns[i], ep, conns[i].next_ns);
+                conns[i].next_ns += interval;
+            }
+            if (!conns[i].busy && conns[i].next_ns < wake)
+            {
+                wake = conns[i].next_ns;
+            }
+        }
+
+        timeout = wake > now ? (wake - now + 999999) / 1000000 : 0;
+        if ((n = epoll_wait(ep, events, BENCH_EVENTS, timeout)) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < n; i++)
+        {
+            bench_recv(t, events[i].data.ptr);
+        }
+    }
+
+    for (i = 0; i < t->nconns; i++)
+    {
+        if (conns[i].fd != -1)
+        {
+            close(conns[i].fd);
+        }
+    }
+    close(ep);
+    free(conns);
+
+    return (NULL);
+}
+
+/* bench_send -- pick a command from the mix and send it on c, opening a
+ * connection first if there is none; due is when the request counts from */
+int bench_send(bench_thread *t, bench_conn *c, int ep, uint64_t due)
+{
+    char req[BUFSIZ];
+    int len, pick, i;
+    struct epoll_event ev;
+    uint64_t t0;
+
+    pick = rand_r(&t->seed) % mix_total;
+    for (i = 0; pick >= mix[i].weight; i++)
+    {
+        pick -= mix[i].weight;
+    }
+    len = snprintf(req, sizeof req, "bench %s %s", hostport, mix[i].cmd);
+
+    if (c->fd == -1)
+    {
+        t0 = now_ns();
+        if ((c->fd = connect_to(ipaddr, port)) == -1)
+        {
+            t->errors++;
+            return (-1);
+        }
+        hist_record(&t->connect, now_ns() - t0);
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev) == -1)
+        {
+            perror("epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if ((framed ? send_frame(c->fd, c->id, req, len) :
+        send_all(c->fd, req, len)) == -1)
+    {
+        bench_done(t, c, -1, 0);
+        return (-1);
+    }
+    c->busy = 1;
+    c->start_ns = due;
+    c->hdr_len = 0;
+    c->body_len = 0;
+
+    return (0);
+}
+
+/* bench_recv -- read what has arrived on c and finish the request once the
+ * reply is complete; the body is counted and thrown away */
+int bench_recv(bench_thread *t, bench_conn *c)
+{
+    char buf[BUF_READ];
+    uint32_t magic, id, hi, lo;
+    uint16_t status;
+    ssize_t n, take;
+
+    while (1)
+    {
+        if ((n = recv(c->fd, buf, sizeof buf, MSG_DONTWAIT)) == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            {
+                return (0);
+            }
+            bench_done(t, c, -1, 0);
+            return (-1);
+        }
+        if (n == 0)
+        {
+            // legacy replies end at EOF and carry one trailing byte
+            if (!framed && c->busy)
+            {
+                bench_done(t, c, 0, c->body_len ? c->body_len - 1 : 0);
+            }
+            else
+            {
+                bench_done(t, c, -1, 0);
+            }
+            return (0);
+        }
+        if (!framed)
+        {
+            c->body_len += n;
+            continue;
+        }
+
+        take = 0;
+        if (c->hdr_len < FRAME_RESP_LEN)
+        {
+            take = FRAME_RESP_LEN - c->hdr_len < (size_t)n ?
+                FRAME_RESP_LEN - c->hdr_len : (size_t)n;
+            memcpy(c->hdr + c->hdr_len, buf, take);
+            c->hdr_len += take;
+            if (c->hdr_len < FRAME_RESP_LEN)
+            {
+                continue;
+            }
+            memcpy(&magic, c->hdr, 4);
+            memcpy(&id, c->hdr + 4, 4);
+            memcpy(&status, c->hdr + 8, 2);
+            memcpy(&hi, c->hdr + 12, 4);
+            memcpy(&lo, c->hdr + 16, 4);
+            if (ntohl(magic) != FRAME_RESP_MAGIC || ntohl(id) != c->id)
+            {
+                bench_done(t, c, -1, 0);
+                return (-1);
+            }
+            c->body_len = ((uint64_t)ntohl(hi) << 32) | ntohl(lo);
+            c->body_left = c->body_len;
+            if (ntohs(status) < ST_COUNT)
+            {
+                t->statuses[ntohs(status)]++;
+            }
+        }
+        // one request in flight per connection, so nothing follows the body
+        c->body_left -= (uint64_t)(n - take) < c->body_left ? 
+            (uint64_t)(n - take) : c->body_left;
+        if (c->body_left == 0)
+        {
+            // whatever the status, the reply is complete and the
+            // connection good for the next request
+            bench_done(t, c, 0, c->body_len);
+            c->id++;
+            return (0);
+        }
+    }
+}
+
+/* bench_done -- account for the request on c; a failed or legacy
+ * connection is closed so the next request opens a fresh one */
+void bench_done(bench_thread *t, bench_conn *c, int err, uint64_t bytes)
+{
+    if (err)
+    {
+        t->errors++;
+    }
+    else
+    {
+        t->requests++;
+        t->bytes += bytes;
+        hist_record(&t->lat, now_ns() - c->start_ns);
+    }
+    c->busy = 0;
+    if (err || !framed)
+    {
+        close(c->fd);
+        c->fd = -1;
+        c->id = 0;
+    }
+}
+
+uint64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/* hist_index -- values below 2^HIST_SUB_BITS get a bucket each; above that
+ * every power of two is split into HIST_HALF equal buckets */
+int hist_index(uint64_t v)
+{
+    int shift;
+
+    if (v < (1 << HIST_SUB_BITS))
+    {
+        return (v);
+    }
+    shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS + 1;
+    return (shift * HIST_HALF + (v >> shift));
+}
+
+/* hist_value -- the smallest value that lands in bucket i */
+uint64_t hist_value(int i)
+{
+    int shift;
+
+    if (i < (1 << HIST_SUB_BITS))
+    {
+        return (i);
+    }
+    shift = i / HIST_HALF - 1;
+    return ((uint64_t)(i - shift * HIST_HALF) << shift);
+}
+
+void hist_record(hist *h, uint64_t v)
+{
+    h->counts[hist_index(v)]++;
+    h->total++;
+    if (v > h->max)
+    {
+        h->max = v;
+    }
+}
+
+/* hist_merge -- add from's counts to h */
+void hist_merge(hist *h, hist *from)
+{
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        h->counts[i] += from->counts[i];
+    }
+    h->total += from->total;
+    if (from->max > h->max)
+    {
+        h->max = from->max;
+    }
+}
+
+uint64_t hist_percentile(hist *h, double p)
+{
+    uint64_t want, seen = 0;
+    int i;
+
+    if (h->total == 0)
+    {
+        return (0);
+    }
+    want = (uint64_t)ceil(h->total * p / 100);
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        if ((seen += h->counts[i]) >= want)
+        {
+            return (hist_value(i));
+        }
+    }
+    return (h->max);
+}
@@ -1,30 +1,176 @@
 /* client.c
  * Ischanov, Mansur
- * 
+ *
  * Description
  *  client - server IPC using sockers
  * Specification
  *  The client server code makes a request and the server responds.
- * Example  
+ * Example
  *  gcc -Wall server.c -o server -lpthread
- *  gcc -Wall client.c -o client
+ *  gcc -Wall client.c -o client -lpthread
+ *  gcc -Wall -DHAVE_ZSTD client.c -o client -lpthread -lzstd  (for 
+ *      --compress)
+ *  gcc -Wall -DHAVE_TLS client.c -o client -lpthread -lssl -lcrypto  (for
+ *      --tls)
  *  ./server server _port
  *  ./client server_ip_addr:_port _command
+ *  ./client --framed server_ip_addr:_port _command
+ *  ./client --framed server_ip_addr:_port < commands  (one per line,
+ *      pipelined over one connection)
+ *  ./client server_ip_addr:_port _file _offset [_length]  (byte range)
+ *  ./client --resume _local server_ip_addr:_port _file  (append the rest of
+ *      _file to _local, starting at its current size)
+ *  ./client --output _local server_ip_addr:_port _file  (save to _local)
+ *  ./client --framed --compress server_ip_addr:_port _file  (zstd on the
+ *      wire if the server has it, the ratio is reported)
+ *  ./client --resume _local server_ip_addr:_port log  (only the records
+ *      _local doesn't have yet)
+ *  ./client server_ip_addr:_port log follow  (new records as they are
+ *      written, until interrupted)
+ *  ./client --tune nodelay,rcvbuf=4194304 server_ip_addr:_port _file
+ *      (socket options, as for the server)
+ *  ./client server_ip_addr:_port get _file _file...  (all of them in one
+ *      reply, split back into files of the same names here; with
+ *      --framed too, also as a line on stdin)
+ *  ./client server_ip_addr:_port docs/_file  (_file from the server's docs
+ *      root; index docs lists them)
+ *  ./client --framed --verify server_ip_addr:_port _file  (the body is
+ *      checked against the hash the server sends with it)
+ *  ./client --if-changed _local server_ip_addr:_port _file  (replaces
+ *      _local with _file, unless they hash the same: then NOT_MODIFIED and
+ *      nothing is sent)
+ *  ./client --tls --ca cert.pem server_ip_addr:_port _file  (TLS 1.3 to a
+ *      --tls-cert server, checked against cert.pem instead of the system's
+ *      CAs; once connected the kernel does the records)
+ *  ./client --parallel 8 --output _local server_ip_addr:_port _file  (asks
+ *      for _file's size and hash, then fetches 8 byte ranges of it over 8
+ *      connections at once, each written into place in _local; a range
+ *      that fails is asked for again from where it stopped. Every range
+ *      is pinned to that hash, so a _file rewritten meanwhile fails the
+ *      download instead of mixing versions. With --verify _local is also
+ *      hashed at the end)
+ *
+ *  Replies are streamed to stdout or the output file a chunk at a time
+ *  (spliced through a pipe when both ends allow it), so memory use does not
+ *  grow with the transfer; a byte and throughput summary goes to stderr.
  */
 
+#define _GNU_SOURCE
+#include <time.h>
 #include <stdio.h>
 #include <netdb.h>
 #include <errno.h>
+#include <stdint.h>
+#include <endian.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
 #include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <linux/tls.h>
+#endif
 
-#define BUF_READ 1024
+#include "common.c"
 
+#define BUF_READ 65536 // bytes moved per recv()/splice()
+
+/* framed protocol, see server.c */
+#define FRAME_REQ_MAGIC 0x54435051
+#define FRAME_RESP_MAGIC 0x54435052
+#define FRAME_REQ_LEN 12
+#define FRAME_RESP_LEN 20
+#define FRAME_F_ZSTD 0x0001
+#define FRAME_F_HASH 0x0002
+#define FRAME_HASH_LEN 8
+#define FRAME_ZCHUNK_MAX (256 << 10)
+#define FRAME_LEN_STREAM UINT64_MAX
+#define PIPELINE_DEPTH 32 // requests in flight before we wait for replies
+#define BATCH_PART_LEN 12 // a get's per-file header, see server.c
+#define ST_OK 0
+#define ST_BUSY 6 // the server's too loaded to answer, try again later
+#define ST_NOT_MODIFIED 7 // status of a conditional request, not an error
+#define ST_CHANGED 8 // a pinned range's file doesn't hash the same any more
+#define ST_COUNT 9 // the statuses status_names has a name for
+#define PARALLEL_MAX 64 // connections of a --parallel download
+#define PARALLEL_MIN_CHUNK (1 << 20) // smaller ranges aren't worth their own
+#define PARALLEL_RETRIES 6 // tries in a row without progress, per range
+
+/* a --parallel download: the one file, where it goes */
+typedef struct download {
+    char *ipaddr, *port;
+    char *prog, *hostport, *name; // for the requests
+    uint64_t hash; // the version every range request is pinned to
+    int out_fd;
+} download;
+
+/* one byte range of a download, fetched by a thread of its own */
+typedef struct chunk {
+    pthread_t thread;
+    download *dl;
+    long long off, len, done;
+    int retries; // all told, for the summary
+    int failed;
+} chunk;
+
+char *status_names[] = {"OK", "NOT_FOUND", "BAD_FILENAME", "NOT_ALLOWED",
+    "NOT_READABLE", "BAD_REQUEST", "BUSY", "NOT_MODIFIED", "CHANGED"};
+
+unsigned long long bytes_received = 0;
+unsigned long long zbytes_in = 0, zbytes_out = 0; // compressed, inflated
+uint16_t frame_flags = 0; // sent with every request
+int use_splice = 1;
+int pipefd[2] = {-1, -1};
+int batch_failed = 0; // files of a get that didn't come
+tcp_tune tune; // applied by connect_to()
+xxh64_state *body_hash = NULL; // fed what stream_body() and recv_zstd() 
+                               // write, when a reply carries a hash
+int hashes_ok = 0, hashes_bad = 0;
+int not_modified = 0; // replies that said our copy is current
+int use_tls = 0; // connect_to() does a handshake, see tls_client_init()
+#ifdef HAVE_TLS
+SSL_CTX *tls_ctx;
+#endif
+
+int connect_to(char*, char*);
+void tune_socket(int, tcp_tune*);
+void tls_client_init(char*);
+int tls_connect(int, char*);
+int run_legacy(int, char*, int, int);
+int run_get(int, char*);
+int run_framed(int, char*, char*, char*, int);
+int run_parallel(int, download*, int, char*);
+long long remote_size(int, download*);
+void *chunk_main(void*);
+int chunk_fetch(chunk*, char*);
+int send_frame(int, uint32_t, char*, size_t);
+int recv_frame(int, uint32_t*, int, char*);
+int recv_header(int, uint32_t, uint16_t*, uint16_t*, uint64_t*);
+char *get_names(char*);
+int recv_batch(int, char*);
+int recv_zstd(int, int);
+long long stream_body(int, int, long long, int);
+int stream_splice(int, int, long long, int, long long*);
+int write_all(int, char*, size_t);
+int pwrite_all(int, char*, size_t, off_t);
+int recv_all(int, char*, size_t);
+int send_all(int, char*, size_t);
+int hash_file(char*, uint64_t*);
 
 // get sockaddr, IPv4 or IPv6:
 void *get_in_addr(struct sockaddr *sa)
@@ -38,45 +184,270 @@ void *get_in_addr(struct sockaddr *sa)
 
 void usererr()
 {
-    fprintf(stderr, "Usage: client ipaddr:port\n");
+    fprintf(stderr, "Usage: client [--framed [--compress] [--verify]] "
+        "[--resume file | --output file | --if-changed file] "
+        "[--tune opt,...] [--tls [--ca file]] [--parallel N --output file] "
+        "ipaddr:port [command]\n");
     exit(EXIT_FAILURE);
 }
 
+// bench.c includes this file for its connect and request code
+#ifndef CLIENT_NO_MAIN
 int main(int argc, char **argv)
 {
-    char usr_inpt_buf[BUFSIZ];
-    char s[INET6_ADDRSTRLEN];
-    char *ipaddr, *port, *recv_buf;
-    int rv, sockfd, bytes_read, i = 0; 
-    unsigned long total_bytes_read = 0, recv_buf_size;
-    struct addrinfo hints, *servinfo, *p;
+    char usr_inpt_buf[BUFSIZ], hostport[BUFSIZ];
+    char *ipaddr, *port, *resume = NULL, *output = NULL, *if_changed = NULL;
+    char *ca = NULL;
+    char part[PATH_MAX];
+    int opt, sockfd, framed = 0, i, out_fd = 1, rv, follow, nconns = 0;
+    download dl;
+    uint64_t local_hash;
+    struct stat st;
+    struct timespec t0, t1;
+    double secs;
+    static struct option long_opts[] = {
+        {"framed", no_argument, NULL, 'f'},
+        {"resume", required_argument, NULL, 'r'},
+        {"output", required_argument, NULL, 'o'},
+        {"compress", no_argument, NULL, 'z'},
+        {"tune", required_argument, NULL, 't'},
+        {"verify", no_argument, NULL, 'v'},
+        {"if-changed", required_argument, NULL, 'i'},
+        {"tls", no_argument, NULL, 'S'},
+        {"ca", required_argument, NULL, 'A'},
+        {"parallel", required_argument, NULL, 'p'},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "fr:o:zt:vi:SA:p:", long_opts, 
+        NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+            framed = 1;
+            break;
+        case 'r':
+            resume = optarg;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'z':
+#ifndef HAVE_ZSTD
+            fprintf(stderr, "client: built without zstd, no --compress\n");
+            exit(EXIT_FAILURE);
+#endif
+            frame_flags |= FRAME_F_ZSTD;
+            break;
+        case 't':
+            if (tune_parse(optarg, &tune) == -1)
+            {
+                usererr();
+            }
+            break;
+        case 'v':
+            frame_flags |= FRAME_F_HASH;
+            break;
+        case 'i':
+            // NOT_MODIFIED needs a status, legacy replies have none
+            if_changed = optarg;
+            framed = 1;
+            frame_flags |= FRAME_F_HASH;
+            break;
+        case 'A':
+            ca = optarg; // a CA is only any use with TLS
+            // fall through
+        case 'S':
+#ifndef HAVE_TLS
+            fprintf(stderr, "client: built without TLS, no --tls\n");
+            exit(EXIT_FAILURE);
+#endif
+            use_tls = 1;
+            break;
+        case 'p':
+            // ranges, so framed: a BUSY has to be told from a body
+            if ((nconns = atoi(optarg)) < 1 || nconns > PARALLEL_MAX)
+            {
+                usererr();
+            }
+            framed = 1;
+            break;
+        default:
+            usererr();
+        }
+    }
+    if (optind >= argc || strlen(argv[optind]) >= sizeof(hostport) ||
+        (resume != NULL) + (output != NULL) + (if_changed != NULL) > 1 ||
+        (frame_flags && !framed))
+    {
+        usererr();
+    }
+    // one whole file into one that can be written anywhere
+    if (nconns > 0 && (output == NULL || optind + 2 != argc || 
+        frame_flags & FRAME_F_ZSTD))
+    {
+        usererr();
+    }
 
-    if (argc < 2 || argc > 3)
+    // the server skips the first word and wants "ip:port" second
+    if (snprintf(usr_inpt_buf, sizeof usr_inpt_buf, "%s %s", argv[0],
+        argv[optind]) >= (int)sizeof usr_inpt_buf)
     {
-        fprintf(stderr,"usage: client hostname\n");
-        exit(1);
+        usererr();
     }
-    while (argv[i] != NULL)
+    for (i = optind + 1; i < argc; i++)
     {
-        sprintf(usr_inpt_buf + strlen(usr_inpt_buf), argv[i++]);
-        strcat(usr_inpt_buf, " ");
+        strncat(usr_inpt_buf, " ", sizeof(usr_inpt_buf) -
+            strlen(usr_inpt_buf) - 1);
+        strncat(usr_inpt_buf, argv[i], sizeof(usr_inpt_buf) -
+            strlen(usr_inpt_buf) - 1);
     }
-    usr_inpt_buf[strlen(usr_inpt_buf) - 1] = '\0';
-    
-    ipaddr = strtok(argv[1], ":");
+
+    // ask for the part of the file we don't have yet and append it
+    if (resume != NULL)
+    {
+        if (optind + 2 != argc)
+        {
+            usererr();
+        }
+        // not O_APPEND: splice() refuses append-only files
+        if ((out_fd = open(resume, O_WRONLY | O_CREAT, 0644)) == -1 ||
+            fstat(out_fd, &st) == -1 || lseek(out_fd, 0, SEEK_END) == -1)
+        {
+            perror(resume);
+            return 1;
+        }
+        snprintf(usr_inpt_buf + strlen(usr_inpt_buf), sizeof(usr_inpt_buf) -
+            strlen(usr_inpt_buf), " %lld", (long long)st.st_size);
+    }
+
+    // the new copy goes next to the old one and replaces it once it's all
+    // there; a missing or unreadable one is just fetched
+    if (if_changed != NULL)
+    {
+        if (optind + 2 != argc || 
+            strlen(if_changed) + sizeof(".part") > sizeof(part))
+        {
+            usererr();
+        }
+        if (hash_file(if_changed, &local_hash) == 0)
+        {
+            snprintf(usr_inpt_buf + strlen(usr_inpt_buf), 
+                sizeof(usr_inpt_buf) - strlen(usr_inpt_buf), 
+                " if-none-match %016llx", (unsigned long long)local_hash);
+        }
+        sprintf(part, "%s.part", if_changed);
+        output = part;
+    }
+
+    if (output != NULL &&
+        (out_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+    {
+        perror(output);
+        return 1;
+    }
+
+    strcpy(hostport, argv[optind]);
+    ipaddr = strtok(hostport, ":");
     port = strtok(NULL, " ");
     if (ipaddr == NULL || port == NULL)
     {
         usererr();
     }
 
+    if (use_tls)
+    {
+        tls_client_init(ca);
+    }
+    if ((sockfd = connect_to(ipaddr, port)) == -1)
+    {
+        return 2;
+    }
+    if (pipe(pipefd) == -1)
+    {
+        use_splice = 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (nconns > 0)
+    {
+        dl.ipaddr = ipaddr;
+        dl.port = port;
+        dl.prog = argv[0];
+        dl.hostport = argv[optind];
+        dl.name = argv[optind + 1];
+        dl.out_fd = out_fd;
+        rv = run_parallel(sockfd, &dl, nconns, output);
+    }
+    else if (framed)
+    {
+        rv = run_framed(sockfd, argv[0], argv[optind],
+            optind + 1 < argc ? usr_inpt_buf : NULL, out_fd);
+    }
+    else
+    {
+        // a followed log never ends, so it has no trailing byte either
+        follow = optind + 2 < argc && strcmp(argv[optind + 1], "log") == 0 
+            && strcmp(argv[optind + 2], "follow") == 0;
+        rv = get_names(usr_inpt_buf) != NULL ? 
+            run_get(sockfd, usr_inpt_buf) :
+            run_legacy(sockfd, usr_inpt_buf, out_fd, !follow);
+    }
+    if (batch_failed > 0 || hashes_bad > 0)
+    {
+        rv = 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    fprintf(stderr, "%llu bytes in %.3f s (%.2f MB/s)\n", bytes_received,
+        secs, secs > 0 ? bytes_received / secs / 1e6 : 0.0);
+    if (zbytes_in > 0)
+    {
+        fprintf(stderr, "compressed %llu -> %llu bytes (ratio %.2f)\n",
+            zbytes_in, zbytes_out, (double)zbytes_out / zbytes_in);
+    }
+    if (hashes_ok + hashes_bad > 0)
+    {
+        fprintf(stderr, "hash: %d verified, %d mismatched\n", hashes_ok,
+            hashes_bad);
+    }
+    if (out_fd != 1)
+    {
+        close(out_fd);
+    }
+    if (if_changed != NULL)
+    {
+        if (rv == 0 && !not_modified && rename(part, if_changed) == -1)
+        {
+            perror(if_changed);
+            rv = 1;
+        }
+        if (rv != 0 || not_modified)
+        {
+            unlink(part);
+        }
+    }
+
+    return (rv);
+}
+#endif
+
+/* connect_to -- connect to the first address of ipaddr:port that works */
+int connect_to(char *ipaddr, char *port)
+{
+    int rv, sockfd;
+    char s[INET6_ADDRSTRLEN];
+    struct addrinfo hints, *servinfo, *p;
+
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
 
     if ( (rv = getaddrinfo(ipaddr, port, &hints, &servinfo)) != 0 ) {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-        return 1;
+        return -1;
     }
 
     // loop through all the results and connect to the first we can
@@ -87,6 +458,7 @@ int main(int argc, char **argv)
             perror("client: socket");
             continue;
         }
+        tune_socket(sockfd, &tune);
 
         if ( connect(sockfd, p->ai_addr, p->ai_addrlen) == -1 ) {
             perror("client: connect");
@@ -99,43 +471,1006 @@ int main(int argc, char **argv)
 
     if ( p == NULL ) {
         fprintf(stderr, "client: failed to connect\n");
-        return 2;
+        freeaddrinfo(servinfo);
+        return -1;
     }
 
     inet_ntop(p->ai_family, get_in_addr((struct sockaddr *)p->ai_addr),
         s, sizeof s);
-    freeaddrinfo(servinfo); 
-    send(sockfd, usr_inpt_buf, strlen(usr_inpt_buf), 0); 
-    
-    if ((recv_buf = malloc(1024 * sizeof(char))) == NULL)
+    freeaddrinfo(servinfo);
+
+    if (use_tls && tls_connect(sockfd, ipaddr) == -1)
+    {
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+/* tune_socket -- set t's options on a socket about to connect: the
+ * buffer sizes have to be there before the handshake to get a window
+ * scale to match, and with Fast Open connect() only returns, the request
+ * goes out in the SYN. Failures are reported, the connection goes ahead. */
+void tune_socket(int sockfd, tcp_tune *t)
+{
+    int one = 1; // TCP_FASTOPEN_CONNECT is on or off, there is no queue
+
+    if (t->sndbuf > 0 && setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, 
+        &t->sndbuf, sizeof(int)) == -1)
+    {
+        perror("setsockopt SO_SNDBUF");
+    }
+    if (t->rcvbuf > 0 && setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, 
+        &t->rcvbuf, sizeof(int)) == -1)
+    {
+        perror("setsockopt SO_RCVBUF");
+    }
+    if (t->nodelay && setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, 
+        &t->nodelay, sizeof(int)) == -1)
+    {
+        perror("setsockopt TCP_NODELAY");
+    }
+    if (t->fastopen > 0 && setsockopt(sockfd, IPPROTO_TCP, 
+        TCP_FASTOPEN_CONNECT, &one, sizeof(int)) == -1)
+    {
+        perror("setsockopt TCP_FASTOPEN_CONNECT");
+    }
+    if (t->notsent_lowat > 0 && setsockopt(sockfd, IPPROTO_TCP, 
+        TCP_NOTSENT_LOWAT, &t->notsent_lowat, sizeof(int)) == -1)
+    {
+        perror("setsockopt TCP_NOTSENT_LOWAT");
+    }
+    if (t->busy_poll > 0 && setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, 
+        &t->busy_poll, sizeof(int)) == -1)
+    {
+        perror("setsockopt SO_BUSY_POLL");
+    }
+}
+
+/* tls_client_init -- the context connect_to() shakes hands with: TLS 1.3,
+ * suites the kernel knows, the server's certificate checked against ca or,
+ * without one, the system's CAs */
+void tls_client_init(char *ca)
+{
+#ifdef HAVE_TLS
+    if ((tls_ctx = SSL_CTX_new(TLS_client_method())) == NULL ||
+        SSL_CTX_set_min_proto_version(tls_ctx, TLS1_3_VERSION) != 1 ||
+        SSL_CTX_set_ciphersuites(tls_ctx, TLS_SUITES) != 1 ||
+        (ca != NULL ? SSL_CTX_load_verify_locations(tls_ctx, ca, NULL) :
+            SSL_CTX_set_default_verify_paths(tls_ctx)) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        fprintf(stderr, "client: no TLS\n");
+        exit(EXIT_FAILURE);
+    }
+    SSL_CTX_set_verify(tls_ctx, SSL_VERIFY_PEER, NULL);
+    SSL_CTX_set_keylog_callback(tls_ctx, tls_keylog);
+#else
+    (void)ca;
+#endif
+}
+
+/* tls_connect -- shake hands on the connected sockfd, checking the
+ * certificate is host's (an address or a name), then leave the records
+ * to the kernel so the socket reads and writes plaintext from here on */
+int tls_connect(int sockfd, char *host)
+{
+#ifdef HAVE_TLS
+    tls_handshake hs;
+    int rv = -1, one = 1;
+
+    // our Finished and the request after it would be two small writes,
+    // the second held back until the server's delayed ACK of the first
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    memset(&hs, 0, sizeof hs);
+    if ((hs.ssl = SSL_new(tls_ctx)) == NULL || 
+        SSL_set_fd(hs.ssl, sockfd) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_free(hs.ssl);
+        return (-1);
+    }
+    SSL_set_app_data(hs.ssl, &hs);
+    // not an address: a name, which the server also gets as SNI
+    if (X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(hs.ssl), host) != 1 &&
+        (SSL_set1_host(hs.ssl, host) != 1 || 
+        SSL_set_tlsext_host_name(hs.ssl, host) != 1))
+    {
+        ERR_print_errors_fp(stderr);
+    }
+    else if (SSL_connect(hs.ssl) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        fprintf(stderr, "client: TLS handshake with %s failed\n", host);
+    }
+    else if (tls_offload(&hs, sockfd, TLS_CLIENT) == -1)
+    {
+        perror("client: TLS offload");
+    }
+    else
+    {
+        rv = 0;
+    }
+    SSL_free(hs.ssl); // no close_notify, the fd is the kernel's now
+    OPENSSL_cleanse(hs.secret, sizeof hs.secret);
+
+    return (rv);
+#else
+    (void)sockfd;
+    (void)host;
+    return (-1);
+#endif
+}
+
+/* run_legacy -- one request, the reply ends when the server closes; 
+ * hold the extra byte the server ends it with back unless told not to */
+int run_legacy(int sockfd, char *usr_inpt_buf, int out_fd, int hold)
+{
+    long long n;
+
+    if (send_all(sockfd, usr_inpt_buf, strlen(usr_inpt_buf)) == -1)
+    {
+        perror("send");
+        close(sockfd);
+        return 1;
+    }
+
+    n = stream_body(sockfd, out_fd, -1, hold);
+    close(sockfd);
+
+    return (n == -1);
+}
+
+/* run_get -- a get the legacy way: its parts, then the server closes */
+int run_get(int sockfd, char *usr_inpt_buf)
+{
+    int rv;
+
+    if (send_all(sockfd, usr_inpt_buf, strlen(usr_inpt_buf)) == -1)
+    {
+        perror("send");
+        close(sockfd);
+        return 1;
+    }
+
+    if ((rv = recv_batch(sockfd, get_names(usr_inpt_buf))) == -1)
+    {
+        fprintf(stderr, "client: connection lost\n");
+    }
+    close(sockfd);
+
+    return (rv == -1);
+}
+
+/* run_framed -- send the request in cmd, or every line of stdin as its own
+ * request, over one connection with up to PIPELINE_DEPTH in flight, and
+ * write the replies to stdout in order. */
+int run_framed(int sockfd, char *prog, char *hostport, char *cmd, int out_fd)
+{
+    static char inflight[PIPELINE_DEPTH][BUFSIZ]; // a get's reply needs it
+    char line[BUFSIZ], *req;
+    uint32_t sent = 0, done = 0;
+    int rv = 0, more = 1, len, status;
+    char *nl;
+
+    while (more || done < sent)
+    {
+        while (more && sent - done < PIPELINE_DEPTH)
+        {
+            req = inflight[sent % PIPELINE_DEPTH];
+            if (cmd != NULL)
+            {
+                len = snprintf(req, BUFSIZ, "%s", cmd);
+                more = 0;
+            }
+            else if (fgets(line, sizeof line, stdin) != NULL)
+            {
+                if ((nl = strchr(line, '\n')) != NULL)
+                {
+                    *nl = '\0';
+                }
+                len = snprintf(req, BUFSIZ, "%s %s %s", prog, hostport,
+                    line);
+            }
+            else
+            {
+                more = 0;
+                break;
+            }
+            if (len >= BUFSIZ)
+            {
+                len = BUFSIZ - 1;
+            }
+            if (send_frame(sockfd, sent, req, len) == -1)
+            {
+                perror("send");
+                return 1;
+            }
+            sent++;
+        }
+        if (done == sent)
+        {
+            break;
+        }
+        if ((status = recv_frame(sockfd, &done, out_fd, 
+            inflight[done % PIPELINE_DEPTH])) == -1)
+        {
+            fprintf(stderr, "client: connection lost\n");
+            return 1;
+        }
+        if (status == ST_NOT_MODIFIED)
+        {
+            fprintf(stderr, "request %u: %s\n", done, 
+                status_names[status]);
+            not_modified++;
+        }
+        else if (status != ST_OK)
+        {
+            fprintf(stderr, "request %u: %s\n", done,
+                status < ST_COUNT ? status_names[status] : "UNKNOWN");
+            rv = 1;
+        }
+        done++;
+    }
+    close(sockfd);
+
+    return rv;
+}
+
+/* run_parallel -- dl's file in up to nconns byte ranges at once, each on a
+ * connection and a thread of its own, written into place in dl->out_fd as
+ * it comes; sockfd asks for the size and hash first. With --verify, path
+ * is hashed once it's all there. */
+int run_parallel(int sockfd, download *dl, int nconns, char *path)
+{
+    chunk *chunks;
+    long long size, per;
+    uint64_t got = 0;
+    int i, n, rv = 0, retries = 0;
+
+    size = remote_size(sockfd, dl);
+    close(sockfd);
+    if (size == -1)
+    {
+        return 1;
+    }
+    // the blocks up front: no ENOSPC halfway, and no holes filled in out
+    // of order, which would fragment the file
+    if (size > 0 && fallocate(dl->out_fd, 0, 0, size) == -1 &&
+        (errno != EOPNOTSUPP || ftruncate(dl->out_fd, size) == -1))
+    {
+        perror(path);
+        return 1;
+    }
+
+    n = size / PARALLEL_MIN_CHUNK < nconns ? size / PARALLEL_MIN_CHUNK : 
+        nconns;
+    if (n < 1)
+    {
+        n = 1;
+    }
+    if ((chunks = calloc(n, sizeof(chunk))) == NULL)
+    {
+        fprintf(stderr, "malloc() failed in line %d\n", __LINE__);
+        exit(EXIT_FAILURE);
+    }
+    per = size / n;
+    for (i = 0; i < n; i++)
+    {
+        chunks[i].dl = dl;
+        chunks[i].off = i * per;
+        chunks[i].len = i < n - 1 ? per : size - i * per;
+        if (pthread_create(&chunks[i].thread, NULL, chunk_main, &chunks[i])
+            != 0)
+        {
+            fprintf(stderr, "pthread_create() failed in line %d\n", 
+                __LINE__);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < n; i++)
+    {
+        pthread_join(chunks[i].thread, NULL);
+        bytes_received += chunks[i].done;
+        retries += chunks[i].retries;
+        if (chunks[i].failed)
+        {
+            fprintf(stderr, "range %lld-%lld: gave up at %lld\n", 
+                chunks[i].off, chunks[i].off + chunks[i].len, 
+                chunks[i].off + chunks[i].done);
+            rv = 1;
+        }
+    }
+    fprintf(stderr, "%d connections, %d retries\n", n, retries);
+    free(chunks);
+
+    if (rv == 0 && frame_flags & FRAME_F_HASH)
+    {
+        if (hash_file(path, &got) == 0 && got == dl->hash)
+        {
+            hashes_ok++;
+        }
+        else
+        {
+            fprintf(stderr, "%s: hash %016llx, expected %016llx\n", path,
+                (unsigned long long)got, (unsigned long long)dl->hash);
+            hashes_bad++;
+        }
+    }
+
+    return (rv);
+}
+
+/* remote_size -- the size of dl's file; its hash goes in dl->hash. -1 if
+ * the server won't say either. */
+long long remote_size(int sockfd, download *dl)
+{
+    char req[BUFSIZ], body[64];
+    uint16_t status, flags, saved = frame_flags;
+    uint64_t len;
+    unsigned long long h;
+    long long size;
+    int n;
+
+    n = snprintf(req, sizeof req, "%s %s %s size", dl->prog, dl->hostport,
+        dl->name);
+    frame_flags |= FRAME_F_HASH; // with or without --verify
+    n = n >= (int)sizeof req ? -1 : send_frame(sockfd, 0, req, n);
+    frame_flags = saved;
+    if (n == -1 || recv_header(sockfd, 0, &status, &flags, &len) == -1 ||
+        (status == ST_OK && (len >= sizeof body || 
+        recv_all(sockfd, body, len) == -1)))
+    {
+        fprintf(stderr, "client: connection lost\n");
+        return (-1);
+    }
+    if (status != ST_OK)
+    {
+        fprintf(stderr, "%s: %s\n", dl->name,
+            status < ST_COUNT ? status_names[status] : "UNKNOWN");
+        return (-1);
+    }
+    body[len] = '\0';
+    if ((n = sscanf(body, "%lld %llx", &size, &h)) < 1 || size < 0)
+    {
+        fprintf(stderr, "%s: no size from the server\n", dl->name);
+        return (-1);
+    }
+    if (n < 2)
+    {
+        // it couldn't read the file through, being written as we ask
+        fprintf(stderr, "%s: no hash from the server\n", dl->name);
+        return (-1);
+    }
+    dl->hash = h;
+
+    return (size);
+}
+
+/* chunk_main -- fetch c until it's complete, or it fails for good, or
+ * PARALLEL_RETRIES tries in a row get nothing */
+void *chunk_main(void *arg)
+{
+    chunk *c = arg;
+    char *buf;
+    long long before;
+    int tries = 0;
+    struct timespec backoff;
+
+    if ((buf = malloc(BUF_READ)) == NULL)
+    {
+        fprintf(stderr, "malloc() failed in line %d\n", __LINE__);
+        exit(EXIT_FAILURE);
+    }
+    while (c->done < c->len)
+    {
+        before = c->done;
+        if (chunk_fetch(c, buf) != 1)
+        {
+            break;
+        }
+        // what came is kept, the next try only asks for the rest
+        tries = c->done > before ? 0 : tries + 1;
+        if (tries == PARALLEL_RETRIES)
+        {
+            break;
+        }
+        c->retries++;
+        fprintf(stderr, "range %lld-%lld: trying again at %lld\n", c->off,
+            c->off + c->len, c->off + c->done);
+        // doubled each time, a BUSY server gets a rest
+        backoff.tv_sec = (100 << tries) / 1000;
+        backoff.tv_nsec = (100 << tries) % 1000 * 1000000L;
+        nanosleep(&backoff, NULL);
+    }
+    c->failed = c->done < c->len;
+    free(buf);
+
+    return (NULL);
+}
+
+/* chunk_fetch -- one try at what is left of c: a range request, pinned to
+ * dl->hash, on a new connection, the body written into place as it comes.
+ * 0 when c is complete, 1 when another try may do better, -1 when it
+ * can't. */
+int chunk_fetch(chunk *c, char *buf)
+{
+    download *dl = c->dl;
+    char req[BUFSIZ];
+    uint16_t status, flags;
+    uint64_t len;
+    long long left = c->len - c->done;
+    ssize_t n;
+    int sockfd, reqlen;
+
+    reqlen = snprintf(req, sizeof req, "%s %s %s if-match %016llx %lld %lld",
+        dl->prog, dl->hostport, dl->name, (unsigned long long)dl->hash, 
+        c->off + c->done, left);
+    if (reqlen >= (int)sizeof req)
+    {
+        return (-1);
+    }
+    if ((sockfd = connect_to(dl->ipaddr, dl->port)) == -1)
+    {
+        return (1);
+    }
+    if (send_frame(sockfd, 0, req, reqlen) == -1 || 
+        recv_header(sockfd, 0, &status, &flags, &len) == -1)
+    {
+        close(sockfd);
+        return (1);
+    }
+    if (status != ST_OK && status != ST_CHANGED)
+    {
+        close(sockfd);
+        if (status == ST_BUSY)
+        {
+            return (1);
+        }
+        fprintf(stderr, "range %lld-%lld: %s\n", c->off, c->off + c->len,
+            status < ST_COUNT ? status_names[status] : "UNKNOWN");
+        return (-1);
+    }
+    // a range is never compressed or hashed; shorter, the file shrank
+    // between the server's hash check and its read
+    if (status == ST_CHANGED || flags != 0 || len != (uint64_t)left)
+    {
+        close(sockfd);
+        fprintf(stderr, "range %lld-%lld: %s changed on the server\n", 
+            c->off, c->off + c->len, dl->name);
+        return (-1);
+    }
+
+    while (left > 0)
+    {
+        if ((n = recv(sockfd, buf, left < BUF_READ ? left : BUF_READ, 0)) 
+            == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            close(sockfd);
+            return (1);
+        }
+        if (pwrite_all(dl->out_fd, buf, n, c->off + c->done) == -1)
+        {
+            perror("pwrite");
+            close(sockfd);
+            return (-1);
+        }
+        c->done += n;
+        left -= n;
+    }
+    close(sockfd);
+
+    return (0);
+}
+
+int send_frame(int sockfd, uint32_t id, char *payload, size_t len)
+{
+    char frame[FRAME_REQ_LEN + BUFSIZ];
+    uint32_t magic = htonl(FRAME_REQ_MAGIC);
+    uint16_t flags = htons(frame_flags), plen = htons(len);
+
+    id = htonl(id);
+    memcpy(frame, &magic, 4);
+    memcpy(frame + 4, &id, 4);
+    memcpy(frame + 8, &flags, 2);
+    memcpy(frame + 10, &plen, 2);
+    memcpy(frame + FRAME_REQ_LEN, payload, len);
+
+    return (send_all(sockfd, frame, FRAME_REQ_LEN + len));
+}
+
+/* recv_frame -- read one reply, copy its body to out_fd (or split it into
+ * files if req was a get) and return its status; the request id it
+ * answers must be the next one we expect. A hash that came with the body
+ * is checked on the way, a mismatch counts in hashes_bad. */
+int recv_frame(int sockfd, uint32_t *expect, int out_fd, char *req)
+{
+    uint16_t status, flags;
+    uint64_t len, want, got;
+    xxh64_state hash;
+    int rv;
+
+    if (recv_header(sockfd, *expect, &status, &flags, &len) == -1)
+    {
+        return (-1);
+    }
+    if (flags & FRAME_F_HASH)
+    {
+        if (recv_all(sockfd, (char *)&want, FRAME_HASH_LEN) == -1)
+        {
+            return (-1);
+        }
+        want = be64toh(want);
+        xxh64_init(&hash);
+        body_hash = &hash;
+    }
+
+    // a compressed body ends with its last chunk, whatever len says
+    if (flags & FRAME_F_ZSTD)
+    {
+        rv = recv_zstd(sockfd, out_fd) == -1 ? -1 : status;
+    }
+    // open ended (log follow): whatever comes until the server closes
+    else if (len == FRAME_LEN_STREAM)
+    {
+        rv = stream_body(sockfd, out_fd, -1, 0) == -1 ? -1 : status;
+    }
+    else if (status == ST_OK && get_names(req) != NULL)
+    {
+        rv = recv_batch(sockfd, get_names(req)) == -1 ? -1 : 0;
+    }
+    else
+    {
+        rv = stream_body(sockfd, out_fd, len, 0) != (long long)len ? -1 :
+            status;
+    }
+    body_hash = NULL;
+    if (rv != -1 && flags & FRAME_F_HASH)
+    {
+        if ((got = xxh64_digest(&hash)) == want)
+        {
+            hashes_ok++;
+        }
+        else
+        {
+            fprintf(stderr, "request %u: hash %016llx, expected %016llx\n",
+                *expect, (unsigned long long)got, (unsigned long long)want);
+            hashes_bad++;
+        }
+    }
+
+    return (rv);
+}
+
+/* recv_header -- read a reply's header, in host order; -1 if the
+ * connection is gone or what came is not the reply to request id */
+int recv_header(int sockfd, uint32_t id, uint16_t *status, uint16_t *flags,
+    uint64_t *len)
+{
+    char hdr[FRAME_RESP_LEN];
+    uint32_t magic, rid, hi, lo;
+
+    if (recv_all(sockfd, hdr, FRAME_RESP_LEN) == -1)
+    {
+        return (-1);
+    }
+    memcpy(&magic, hdr, 4);
+    memcpy(&rid, hdr + 4, 4);
+    memcpy(status, hdr + 8, 2);
+    memcpy(flags, hdr + 10, 2);
+    memcpy(&hi, hdr + 12, 4);
+    memcpy(&lo, hdr + 16, 4);
+    if (ntohl(magic) != FRAME_RESP_MAGIC || ntohl(rid) != id)
+    {
+        return (-1);
+    }
+    *status = ntohs(*status);
+    *flags = ntohs(*flags);
+    *len = ((uint64_t)ntohl(hi) << 32) | ntohl(lo);
+
+    return (0);
+}
+
+/* get_names -- the names of a get in req ("prog host:port get a b"), or
+ * NULL if it is something else */
+char *get_names(char *req)
+{
+    int i;
+
+    for (i = 0; i < 2; i++)
+    {
+        req += strspn(req, " ");
+        req += strcspn(req, " ");
+    }
+    req += strspn(req, " ");
+    if (strncmp(req, "get ", 4) != 0)
+    {
+        return (NULL);
+    }
+
+    return (req + 4);
+}
+
+/* recv_batch -- split a get's reply into files named after what was asked
+ * for in names, less any "root/"; one that failed is reported and leaves
+ * no file. Returns how many failed, -1 if the connection broke. */
+int recv_batch(int sockfd, char *names)
+{
+    char hdr[BATCH_PART_LEN], copy[BUFSIZ], *name, *save, *base;
+    uint16_t status;
+    uint32_t hi, lo;
+    uint64_t len;
+    int fd, failed = 0;
+
+    snprintf(copy, sizeof copy, "%s", names);
+    for (name = strtok_r(copy, " ", &save); name != NULL; 
+        name = strtok_r(NULL, " ", &save))
+    {
+        if (recv_all(sockfd, hdr, BATCH_PART_LEN) == -1)
+        {
+            return (-1);
+        }
+        bytes_received += BATCH_PART_LEN;
+        memcpy(&status, hdr, 2);
+        memcpy(&hi, hdr + 4, 4);
+        memcpy(&lo, hdr + 8, 4);
+        status = ntohs(status);
+        len = ((uint64_t)ntohl(hi) << 32) | ntohl(lo);
+        if (status != ST_OK)
+        {
+            fprintf(stderr, "%s: %s\n", name, 
+                status < ST_COUNT ? status_names[status] : "UNKNOWN");
+            failed++;
+            continue;
+        }
+        // the server only has plain names, but never write outside here
+        base = strchr(name, '/') != NULL ? strchr(name, '/') + 1 : name;
+        if (strchr(base, '/') != NULL || base[0] == '.' || base[0] == '\0' ||
+            (fd = open(base, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+        {
+            fprintf(stderr, "%s: can't save it\n", name);
+            failed++;
+            fd = open("/dev/null", O_WRONLY);
+        }
+        if (fd == -1 || stream_body(sockfd, fd, len, 0) != (long long)len)
+        {
+            return (-1);
+        }
+        close(fd);
+    }
+    batch_failed += failed;
+
+    return (failed);
+}
+
+/* recv_zstd -- read a chunked zstd body (u32 length + data, a zero length
+ * ends it) and write it out inflated, one chunk in memory at a time */
+int recv_zstd(int sockfd, int out_fd)
+{
+#ifdef HAVE_ZSTD
+    static char *chunk, *plain;
+    static ZSTD_DCtx *dctx;
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    uint32_t len;
+    size_t rv;
+
+    if (dctx == NULL && ((dctx = ZSTD_createDCtx()) == NULL ||
+        (chunk = malloc(FRAME_ZCHUNK_MAX)) == NULL ||
+        (plain = malloc(ZSTD_DStreamOutSize())) == NULL))
     {
         fprintf(stderr, "malloc() failed in line %d\n", __LINE__);
         exit(EXIT_FAILURE);
     }
-    recv_buf_size = 1024; total_bytes_read = 0;
+    while (1)
+    {
+        if (recv_all(sockfd, (char *)&len, 4) == -1)
+        {
+            return (-1);
+        }
+        bytes_received += 4;
+        if ((len = ntohl(len)) == 0)
+        {
+            return (0);
+        }
+        if (len > FRAME_ZCHUNK_MAX || recv_all(sockfd, chunk, len) == -1)
+        {
+            return (-1);
+        }
+        bytes_received += len;
+        zbytes_in += len;
+        in.src = chunk;
+        in.size = len;
+        in.pos = 0;
+        // every chunk ends with a flush, so all of it comes out now
+        do {
+            out.dst = plain;
+            out.size = ZSTD_DStreamOutSize();
+            out.pos = 0;
+            rv = ZSTD_decompressStream(dctx, &out, &in);
+            if (ZSTD_isError(rv))
+            {
+                fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(rv));
+                return (-1);
+            }
+            if (write_all(out_fd, plain, out.pos) == -1)
+            {
+                perror("write");
+                return (-1);
+            }
+            if (body_hash != NULL)
+            {
+                xxh64_update(body_hash, plain, out.pos);
+            }
+            zbytes_out += out.pos;
+        } while (in.pos < in.size || out.pos == out.size);
+    }
+#else
+    (void)sockfd;
+    (void)out_fd;
+    return (-1);
+#endif
+}
+
+/* stream_body -- copy len bytes from sockfd to out_fd, or everything up to
+ * EOF when len is -1, leaving out the last hold bytes (0 or 1) of it. Goes
+ * through pipefd with splice() while it works and falls back to a single
+ * BUF_READ buffer, so memory stays the same for any size; the buffer too
+ * while body_hash wants to see the bytes. Returns the bytes received, or
+ * -1 on error. */
+long long stream_body(int sockfd, int out_fd, long long len, int hold)
+{
+    char buf[BUF_READ];
+    long long got = 0;
+    size_t want, keep = 0;
+    ssize_t n = 0;
+
+    if (use_splice && body_hash == NULL)
+    {
+        switch (stream_splice(sockfd, out_fd, len, hold, &got))
+        {
+        case 0:
+            return (got);
+        case -2:
+            return (-1);
+        }
+    }
+    // pick up the byte the splice path was holding back
+    if (got > 0 && hold)
+    {
+        keep = 1;
+        if (read(pipefd[0], buf, 1) != 1)
+        {
+            return (-1);
+        }
+    }
+
+    while (len == -1 || got < len)
+    {
+        want = sizeof(buf) - keep;
+        if (len != -1 && (long long)want > len - got)
+        {
+            want = len - got;
+        }
+        if ((n = recv(sockfd, buf + keep, want, 0)) == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        got += n;
+        bytes_received += n;
+        n += keep;
+        if (write_all(out_fd, buf, n - hold) == -1)
+        {
+            perror("write");
+            return (-1);
+        }
+        if (body_hash != NULL)
+        {
+            xxh64_update(body_hash, buf, n - hold);
+        }
+        if (hold)
+        {
+            buf[0] = buf[n - 1];
+            keep = 1;
+        }
+    }
+    if (n == -1)
+    {
+        perror("recv");
+        return (-1);
+    }
+
+    return (got);
+}
 
-    do {
-        bytes_read = recv(sockfd, recv_buf + total_bytes_read, BUF_READ, 0);
-        if (bytes_read <= 0)
+/* stream_splice -- the zero-copy half of stream_body(): socket -> pipe ->
+ * out_fd. Returns 0 when the body is done, -2 on error, and -1 (clearing
+ * use_splice) when either end turns out not to splice; anything received by
+ * then has been written except the held-back byte, which stays in the pipe. */
+int stream_splice(int sockfd, int out_fd, long long len, int hold,
+    long long *got)
+{
+    char buf[BUF_READ];
+    ssize_t n = 0, m;
+    size_t want, in_pipe = 0;
+
+    while (len == -1 || *got < len)
+    {
+        want = BUF_READ;
+        if (len != -1 && (long long)want > len - *got)
+        {
+            want = len - *got;
+        }
+        n = splice(sockfd, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1 && errno == EINVAL)
+        {
+            use_splice = 0;
+            return (-1);
+        }
+        if (n <= 0)
         {
             break;
         }
-        total_bytes_read += bytes_read;
-        if (total_bytes_read >= recv_buf_size)
+        *got += n;
+        bytes_received += n;
+        in_pipe += n;
+
+        while (in_pipe > (size_t)hold)
         {
-            recv_buf_size *= recv_buf_size;
-            if ((recv_buf = realloc(recv_buf, recv_buf_size)) == NULL)
+            m = splice(pipefd[0], NULL, out_fd, NULL, in_pipe - hold,
+                SPLICE_F_MOVE);
+            if (m == -1 && errno == EINTR)
             {
-                fprintf(stderr, "realloc() failed in line %d\n", __LINE__);
-                exit(EXIT_FAILURE);
+                continue;
             }
+            if (m == -1 && errno == EINVAL)
+            {
+                // e.g. a terminal: copy out what's queued and stop splicing
+                use_splice = 0;
+                while (in_pipe > (size_t)hold)
+                {
+                    want = in_pipe - hold < sizeof buf ? in_pipe - hold :
+                        sizeof buf;
+                    if ((m = read(pipefd[0], buf, want)) <= 0 ||
+                        write_all(out_fd, buf, m) == -1)
+                    {
+                        return (-2);
+                    }
+                    in_pipe -= m;
+                }
+                return (-1);
+            }
+            if (m <= 0)
+            {
+                perror("splice");
+                return (-2);
+            }
+            in_pipe -= m;
         }
-    } while (bytes_read > 0);
-    
-    recv_buf[total_bytes_read - 1] = '\0';
-    write(1, recv_buf, strlen(recv_buf));
-    close(sockfd);
-    free(recv_buf);
+    }
+    if (n == -1)
+    {
+        perror("splice");
+        return (-2);
+    }
+    // discard the held-back trailer
+    if (in_pipe > 0 && read(pipefd[0], buf, in_pipe) == -1)
+    {
+        return (-2);
+    }
+
+    return (0);
+}
+
+int write_all(int fd, char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        if ((n = write(fd, buf, len)) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return (-1);
+        }
+        buf += n;
+        len -= n;
+    }
+    return (0);
+}
+
+int pwrite_all(int fd, char *buf, size_t len, off_t off)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        if ((n = pwrite(fd, buf, len, off)) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return (-1);
+        }
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return (0);
+}
+
+int recv_all(int sockfd, char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        if ((n = recv(sockfd, buf, len, 0)) <= 0)
+        {
+            return (-1);
+        }
+        buf += n;
+        len -= n;
+    }
+    return (0);
+}
+
+int send_all(int sockfd, char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        if ((n = send(sockfd, buf, len, 0)) == -1)
+        {
+            return (-1);
+        }
+        buf += n;
+        len -= n;
+    }
+    return (0);
+}
+
+/* hash_file -- *h is the XXH64 of the file at path; -1 if it can't be read */
+int hash_file(char *path, uint64_t *h)
+{
+    char buf[BUF_READ];
+    xxh64_state st;
+    ssize_t n;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+    {
+        return (-1);
+    }
+    xxh64_init(&st);
+    while ((n = read(fd, buf, sizeof buf)) > 0)
+    {
+        xxh64_update(&st, buf, n);
+    }
+    close(fd);
+    if (n == -1)
+    {
+        return (-1);
+    }
+    *h = xxh64_digest(&st);
 
-    return 0;
+    return (0);
 }
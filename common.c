@@ -0,0 +1,413 @@
+/* common.c
+ * Ischanov, Mansur
+ *
+ * Description
+ *  What server.c and client.c both need, kept in one place: the --tune
+ *  option list, the XXH64 content hash and, with HAVE_TLS, the TLS 1.3
+ *  kernel offload. Both include it after their own headers, the way
+ *  bench.c includes client.c, so each still builds with one gcc line.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#ifdef HAVE_TLS
+#include <errno.h>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#endif
+
+#define TUNE_FASTOPEN_QLEN 32 // "fastopen" with no queue length
+#define TLS_SUITES "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:" \
+    "TLS_CHACHA20_POLY1305_SHA256" // what the kernel can take over
+#define TLS_CLIENT 0 // tls_handshake.secret's, and tls_offload()'s side
+#define TLS_SERVER 1
+
+/* XXH64 primes */
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+/* socket options, from --tune; 0 leaves the kernel's default. A client
+ * uses nodelay, the buffer sizes, fastopen (data in the SYN, on or off),
+ * notsent-lowat and busy-poll. */
+typedef struct tcp_tune {
+    int nodelay; // small replies don't wait for the last ACK
+    int cork; // hold each reply's header and body until it's all queued
+    int sndbuf, rcvbuf; // bytes
+    int fastopen; // pending Fast Open requests the listener queues
+    int defer_accept; // s: accept once the request is in
+    int notsent_lowat; // bytes unsent before the socket is writable again
+    int busy_poll; // us spent polling the device on a blocking read
+} tcp_tune;
+
+/* XXH64 of a byte stream fed in pieces */
+typedef struct xxh64_state {
+    uint64_t total, v[4];
+    unsigned char mem[32]; // the start of a stripe still to come
+    size_t memsize;
+} xxh64_state;
+
+#ifdef HAVE_TLS
+/* a TLS 1.3 handshake under way. The keylog callback hands us the traffic
+ * secrets, which is all the kernel needs to take the records over. */
+typedef struct tls_handshake {
+    SSL *ssl;
+    unsigned char secret[2][EVP_MAX_MD_SIZE]; // the client's, the server's
+    int secret_len[2];
+    uint64_t start; // ns, accepted (the server's)
+    int fl; // the socket's file flags, put back once the handshake is done
+} tls_handshake;
+#endif
+
+int tune_parse(char*, tcp_tune*);
+uint64_t xxh_rotl(uint64_t, int);
+uint64_t xxh_read64(unsigned char*);
+uint64_t xxh_round(uint64_t, uint64_t);
+void xxh64_init(xxh64_state*);
+void xxh64_update(xxh64_state*, void*, size_t);
+uint64_t xxh64_digest(xxh64_state*);
+uint64_t xxh64(void*, size_t);
+#ifdef HAVE_TLS
+void tls_keylog(const SSL*, const char*);
+int tls_expand(const EVP_MD*, unsigned char*, int, char*, unsigned char*,
+    size_t);
+int tls_offload(tls_handshake*, int, int);
+#endif
+
+/* tune_parse -- a comma separated list of the tcp_tune options: nodelay,
+ * cork, sndbuf=B, rcvbuf=B, fastopen[=N], defer-accept=S,
+ * notsent-lowat=B, busy-poll=US; "none" for the kernel's defaults. -1 if
+ * there is anything else in it. */
+int tune_parse(char *spec, tcp_tune *t)
+{
+    char *copy, *item, *eq, *save;
+    int val, rv = 0;
+
+    memset(t, 0, sizeof *t);
+    if ((copy = strdup(spec)) == NULL)
+    {
+        fprintf(stderr, "strdup() failed in line %d\n", __LINE__);
+        exit(EXIT_FAILURE);
+    }
+    for (item = strtok_r(copy, ",", &save); item != NULL && rv == 0;
+        item = strtok_r(NULL, ",", &save))
+    {
+        val = 0;
+        if ((eq = strchr(item, '=')) != NULL)
+        {
+            *eq = '\0';
+            if ((val = atoi(eq + 1)) <= 0)
+            {
+                rv = -1;
+            }
+        }
+        if (strcmp(item, "none") == 0 && eq == NULL)
+        {
+            memset(t, 0, sizeof *t);
+        }
+        else if (strcmp(item, "nodelay") == 0 && eq == NULL)
+        {
+            t->nodelay = 1;
+        }
+        else if (strcmp(item, "cork") == 0 && eq == NULL)
+        {
+            t->cork = 1;
+        }
+        else if (strcmp(item, "fastopen") == 0)
+        {
+            t->fastopen = eq != NULL ? val : TUNE_FASTOPEN_QLEN;
+        }
+        else if (strcmp(item, "sndbuf") == 0 && eq != NULL)
+        {
+            t->sndbuf = val;
+        }
+        else if (strcmp(item, "rcvbuf") == 0 && eq != NULL)
+        {
+            t->rcvbuf = val;
+        }
+        else if (strcmp(item, "defer-accept") == 0 && eq != NULL)
+        {
+            t->defer_accept = val;
+        }
+        else if (strcmp(item, "notsent-lowat") == 0 && eq != NULL)
+        {
+            t->notsent_lowat = val;
+        }
+        else if (strcmp(item, "busy-poll") == 0 && eq != NULL)
+        {
+            t->busy_poll = val;
+        }
+        else
+        {
+            rv = -1;
+        }
+    }
+    free(copy);
+
+    return (rv);
+}
+
+/* XXH64, seed 0: four lanes over 32 byte stripes, then the tail */
+uint64_t xxh_rotl(uint64_t x, int r)
+{
+    return ((x << r) | (x >> (64 - r)));
+}
+
+uint64_t xxh_read64(unsigned char *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, 8);
+
+    return (le64toh(v));
+}
+
+uint64_t xxh_round(uint64_t acc, uint64_t in)
+{
+    acc += in * XXH_P2;
+
+    return (xxh_rotl(acc, 31) * XXH_P1);
+}
+
+void xxh64_init(xxh64_state *s)
+{
+    memset(s, 0, sizeof(xxh64_state));
+    s->v[0] = XXH_P1 + XXH_P2;
+    s->v[1] = XXH_P2;
+    s->v[2] = 0;
+    s->v[3] = -XXH_P1;
+}
+
+void xxh64_update(xxh64_state *s, void *data, size_t len)
+{
+    unsigned char *p = data, *end = p + len;
+    int i;
+
+    s->total += len;
+    if (s->memsize + len < 32)
+    {
+        memcpy(s->mem + s->memsize, p, len);
+        s->memsize += len;
+        return;
+    }
+    if (s->memsize > 0)
+    {
+        memcpy(s->mem + s->memsize, p, 32 - s->memsize);
+        p += 32 - s->memsize;
+        for (i = 0; i < 4; i++)
+        {
+            s->v[i] = xxh_round(s->v[i], xxh_read64(s->mem + 8 * i));
+        }
+        s->memsize = 0;
+    }
+    for (; end - p >= 32; p += 32)
+    {
+        for (i = 0; i < 4; i++)
+        {
+            s->v[i] = xxh_round(s->v[i], xxh_read64(p + 8 * i));
+        }
+    }
+    memcpy(s->mem, p, end - p);
+    s->memsize = end - p;
+}
+
+uint64_t xxh64_digest(xxh64_state *s)
+{
+    unsigned char *p = s->mem, *end = p + s->memsize;
+    uint64_t h;
+    uint32_t w;
+    int i;
+
+    if (s->total >= 32)
+    {
+        h = xxh_rotl(s->v[0], 1) + xxh_rotl(s->v[1], 7) + 
+            xxh_rotl(s->v[2], 12) + xxh_rotl(s->v[3], 18);
+        for (i = 0; i < 4; i++)
+        {
+            h = (h ^ xxh_round(0, s->v[i])) * XXH_P1 + XXH_P4;
+        }
+    }
+    else
+    {
+        h = XXH_P5;
+    }
+    h += s->total;
+    for (; end - p >= 8; p += 8)
+    {
+        h = xxh_rotl(h ^ xxh_round(0, xxh_read64(p)), 27) * XXH_P1 + XXH_P4;
+    }
+    if (end - p >= 4)
+    {
+        memcpy(&w, p, 4);
+        h = xxh_rotl(h ^ le32toh(w) * XXH_P1, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++)
+    {
+        h = xxh_rotl(h ^ *p * XXH_P5, 11) * XXH_P1;
+    }
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+
+    return (h ^ (h >> 32));
+}
+
+uint64_t xxh64(void *data, size_t len)
+{
+    xxh64_state s;
+
+    xxh64_init(&s);
+    xxh64_update(&s, data, len);
+
+    return (xxh64_digest(&s));
+}
+
+#ifdef HAVE_TLS
+/* tls_keylog -- OpenSSL's key log, a line "LABEL client_random secret" in
+ * hex per secret; we keep the two application traffic secrets */
+void tls_keylog(const SSL *ssl, const char *line)
+{
+    tls_handshake *hs = SSL_get_app_data(ssl);
+    char *hex = strrchr(line, ' ');
+    int side, n;
+
+    if (strncmp(line, "CLIENT_TRAFFIC_SECRET_0 ", 24) == 0)
+    {
+        side = TLS_CLIENT;
+    }
+    else if (strncmp(line, "SERVER_TRAFFIC_SECRET_0 ", 24) == 0)
+    {
+        side = TLS_SERVER;
+    }
+    else
+    {
+        return;
+    }
+    for (n = 0; n < EVP_MAX_MD_SIZE && 
+        sscanf(hex + 1 + 2 * n, "%2hhx", &hs->secret[side][n]) == 1; n++)
+    {
+    }
+    hs->secret_len[side] = n;
+}
+
+/* tls_expand -- HKDF-Expand-Label(secret, label, "", len), RFC 8446 7.1 */
+int tls_expand(const EVP_MD *md, unsigned char *secret, int secret_len,
+    char *label, unsigned char *out, size_t len)
+{
+    unsigned char info[2 + 1 + 255 + 1];
+    size_t n = 0, label_len = strlen(label);
+    EVP_PKEY_CTX *pctx;
+    int rv = -1;
+
+    info[n++] = len >> 8;
+    info[n++] = len & 0xff;
+    info[n++] = 6 + label_len;
+    memcpy(info + n, "tls13 ", 6);
+    memcpy(info + n + 6, label, label_len);
+    n += 6 + label_len;
+    info[n++] = 0; // no context
+    if ((pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL)) != NULL &&
+        EVP_PKEY_derive_init(pctx) > 0 &&
+        EVP_PKEY_CTX_set_hkdf_mode(pctx, 
+            EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0 &&
+        EVP_PKEY_CTX_set_hkdf_md(pctx, md) > 0 &&
+        EVP_PKEY_CTX_set1_hkdf_key(pctx, secret, secret_len) > 0 &&
+        EVP_PKEY_CTX_add1_hkdf_info(pctx, info, n) > 0 &&
+        EVP_PKEY_derive(pctx, out, &len) > 0)
+    {
+        rv = 0;
+    }
+    EVP_PKEY_CTX_free(pctx);
+
+    return (rv);
+}
+
+/* tls_offload -- give fd's records to the kernel: ours go out under the
+ * traffic secret of side (TLS_SERVER on the server, TLS_CLIENT on the
+ * client), the peer's come in under the other, both from sequence 0 since
+ * no record was sent with them yet. -1 with errno if the kernel said no,
+ * or EPROTO if the handshake left something it can't take over. */
+int tls_offload(tls_handshake *hs, int fd, int side)
+{
+    union {
+        struct tls12_crypto_info_aes_gcm_128 aes128;
+        struct tls12_crypto_info_aes_gcm_256 aes256;
+        struct tls12_crypto_info_chacha20_poly1305 chacha;
+    } ci;
+    const SSL_CIPHER *c = SSL_get_current_cipher(hs->ssl);
+    const EVP_MD *md = c != NULL ? SSL_CIPHER_get_handshake_digest(c) : NULL;
+    unsigned char key[32], iv[12];
+    int dir, sec, rv, suite = c != NULL ? SSL_CIPHER_get_protocol_id(c) : 0;
+    size_t key_len = suite == 0x1301 ? 16 : 32, len;
+
+    // a record OpenSSL read ahead would be lost to the kernel
+    if (md == NULL || SSL_has_pending(hs->ssl) || 
+        (suite != 0x1301 && suite != 0x1302 && suite != 0x1303))
+    {
+        errno = EPROTO;
+        return (-1);
+    }
+    if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof "tls") == -1)
+    {
+        return (-1);
+    }
+    for (dir = TLS_TX; dir <= TLS_RX; dir++)
+    {
+        sec = dir == TLS_TX ? side : !side;
+        if (hs->secret_len[sec] == 0 ||
+            tls_expand(md, hs->secret[sec], hs->secret_len[sec], "key", 
+                key, key_len) == -1 ||
+            tls_expand(md, hs->secret[sec], hs->secret_len[sec], "iv", 
+                iv, sizeof iv) == -1)
+        {
+            errno = EPROTO;
+            return (-1);
+        }
+        // the kernel wants the IV as a 4 byte salt and the 8 after it
+        memset(&ci, 0, sizeof ci);
+        ci.aes128.info.version = TLS_1_3_VERSION;
+        if (suite == 0x1301) // TLS_AES_128_GCM_SHA256
+        {
+            ci.aes128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+            memcpy(ci.aes128.key, key, key_len);
+            memcpy(ci.aes128.salt, iv, 4);
+            memcpy(ci.aes128.iv, iv + 4, 8);
+            len = sizeof ci.aes128;
+        }
+        else if (suite == 0x1302) // TLS_AES_256_GCM_SHA384
+        {
+            ci.aes256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+            memcpy(ci.aes256.key, key, key_len);
+            memcpy(ci.aes256.salt, iv, 4);
+            memcpy(ci.aes256.iv, iv + 4, 8);
+            len = sizeof ci.aes256;
+        }
+        else // TLS_CHACHA20_POLY1305_SHA256, the IV as it is
+        {
+            ci.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+            memcpy(ci.chacha.key, key, key_len);
+            memcpy(ci.chacha.iv, iv, sizeof iv);
+            len = sizeof ci.chacha;
+        }
+        rv = setsockopt(fd, SOL_TLS, dir, &ci, len);
+        OPENSSL_cleanse(&ci, sizeof ci);
+        OPENSSL_cleanse(key, sizeof key);
+        if (rv == -1)
+        {
+            return (-1);
+        }
+    }
+
+    return (0);
+}
+#endif
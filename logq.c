@@ -0,0 +1,561 @@
+/* logq.c
+ *
+ * Description
+ *  query the binary access log the server writes with --binlog
+ * Specifications
+ *  The log is mapped, not read: blocks whose time span misses the query
+ *  are skipped by their header (or by the index a rotated log ends with)
+ *  without touching their records, and the records of the rest are fixed
+ *  width, so filtering is a walk over an array.
+ * Examples
+ *  gcc -Wall logq.c -o logq
+ *  ./logq log.bin  (every record as a line of text)
+ *  ./logq --from "2026-10-17 09:00" --to "2026-10-17 10:00" log.bin.1 log.bin
+ *  ./logq --status NOT_FOUND --by client log.bin  (requests, bytes per key)
+ *  ./logq --client 10.0.0.7 --cmd file --count log.bin
+ *  Times are local, "YYYY-MM-DD[ HH:MM[:SS]]", or seconds since the epoch.
+ */
+
+#define _GNU_SOURCE
+#include <time.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+/* binary log format, see server.c */
+#define BIN_FILE_MAGIC 0x5443504c
+#define BIN_BLOCK_MAGIC 0x54435042
+#define BIN_INDEX_MAGIC 0x54435049
+#define BIN_VERSION 1
+
+enum group_by { BY_NONE, BY_CLIENT, BY_STATUS, BY_CMD };
+
+typedef struct bin_file_header {
+    uint32_t magic, version, record_size, reserved;
+} bin_file_header;
+
+typedef struct bin_header {
+    uint32_t magic, count;
+    uint64_t t_min, t_max;
+} bin_header;
+
+typedef struct bin_record {
+    uint64_t ts;
+    uint64_t bytes;
+    uint8_t addr[16];
+    uint32_t parse_us;
+    uint8_t cmd, status, proto, reserved;
+} bin_record;
+
+typedef struct bin_index_entry {
+    uint64_t off, t_min, t_max;
+    uint32_t count, reserved;
+} bin_index_entry;
+
+typedef struct bin_trailer {
+    uint64_t index_off;
+    uint32_t nblocks, magic;
+} bin_trailer;
+
+/* what to look for */
+typedef struct query {
+    uint64_t from, to; // ns, inclusive
+    int by_addr;
+    uint8_t addr[16];
+    int status, cmd; // -1 for any
+    enum group_by by;
+    int count_only;
+} query;
+
+/* requests and bytes of one group */
+typedef struct group {
+    int used;
+    uint8_t key[16]; // the address, or the status/command in key[0]
+    unsigned long long requests, bytes;
+} group;
+
+/* every group seen, open addressing on the key */
+typedef struct group_table {
+    group *slots;
+    size_t cap, count;
+} group_table;
+
+char *status_names[] = {"OK", "NOT_FOUND", "BAD_FILENAME", "NOT_ALLOWED",
+    "NOT_READABLE", "BAD_REQUEST", "BUSY", "NOT_MODIFIED", "CHANGED"};
+char *cmd_names[] = {"index", "log", "file", "stats", "other", "get"};
+
+unsigned long long matched = 0, matched_bytes = 0;
+unsigned long blocks_total = 0, blocks_read = 0;
+
+void usage();
+uint64_t parse_time(char*);
+int parse_addr(char*, uint8_t*);
+int name_index(char**, int, char*);
+int query_file(char*, query*, group_table*);
+int scan_block(char*, size_t, size_t, query*, group_table*);
+void record_match(bin_record*, query*, group_table*);
+void print_record(bin_record*);
+void format_addr(uint8_t*, char*, size_t);
+char *code_name(char**, int, int, char*);
+group *group_find(group_table*, uint8_t*);
+void group_report(group_table*, enum group_by);
+int group_cmp(const void*, const void*);
+
+void usage()
+{
+    fprintf(stderr, "Usage: logq [--from TIME] [--to TIME] [--client ADDR] "
+        "[--status NAME] [--cmd NAME] [--count | --by client|status|cmd] "
+        "file...\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    query q;
+    group_table groups;
+    int opt, i, rv = 0;
+    static struct option long_opts[] = {
+        {"from", required_argument, NULL, 'f'},
+        {"to", required_argument, NULL, 't'},
+        {"client", required_argument, NULL, 'a'},
+        {"status", required_argument, NULL, 's'},
+        {"cmd", required_argument, NULL, 'c'},
+        {"by", required_argument, NULL, 'b'},
+        {"count", no_argument, NULL, 'n'},
+        {NULL, 0, NULL, 0}
+    };
+
+    memset(&q, 0, sizeof q);
+    q.to = UINT64_MAX;
+    q.status = q.cmd = -1;
+    while ((opt = getopt_long(argc, argv, "f:t:a:s:c:b:n", long_opts, NULL))
+        != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+            q.from = parse_time(optarg);
+            break;
+        case 't':
+            q.to = parse_time(optarg);
+            break;
+        case 'a':
+            if (!parse_addr(optarg, q.addr))
+            {
+                usage();
+            }
+            q.by_addr = 1;
+            break;
+        case 's':
+            if ((q.status = name_index(status_names, 9, optarg)) == -1)
+            {
+                usage();
+            }
+            break;
+        case 'c':
+            if ((q.cmd = name_index(cmd_names, 6, optarg)) == -1)
+            {
+                usage();
+            }
+            break;
+        case 'b':
+            if (strcmp(optarg, "client") == 0)
+            {
+                q.by = BY_CLIENT;
+            }
+            else if (strcmp(optarg, "status") == 0)
+            {
+                q.by = BY_STATUS;
+            }
+            else if (strcmp(optarg, "cmd") == 0)
+            {
+                q.by = BY_CMD;
+            }
+            else
+            {
+                usage();
+            }
+            break;
+        case 'n':
+            q.count_only = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind >= argc || (q.count_only && q.by != BY_NONE))
+    {
+        usage();
+    }
+
+    groups.cap = 256;
+    groups.count = 0;
+    if ((groups.slots = calloc(groups.cap, sizeof(group))) == NULL)
+    {
+        fprintf(stderr, "calloc() failed in line %d\n", __LINE__);
+        exit(EXIT_FAILURE);
+    }
+    for (i = optind; i < argc; i++)
+    {
+        if (query_file(argv[i], &q, &groups) == -1)
+        {
+            rv = 1;
+        }
+    }
+
+    if (q.by != BY_NONE)
+    {
+        group_report(&groups, q.by);
+    }
+    else if (q.count_only)
+    {
+        printf("%llu requests, %llu bytes\n", matched, matched_bytes);
+    }
+    fprintf(stderr, "%llu matched, %lu of %lu blocks read\n", matched,
+        blocks_read, blocks_total);
+    free(groups.slots);
+
+    return (rv);
+}
+
+/* parse_time -- seconds since the epoch, or a local date and time */
+uint64_t parse_time(char *s)
+{
+    char *fmts[] = {"%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d",
+        "%Y-%m-%dT%H:%M:%S"};
+    struct tm tm;
+    char *end;
+    size_t i;
+    time_t t;
+
+    t = strtoll(s, &end, 10);
+    if (*s != '\0' && *end == '\0')
+    {
+        return ((uint64_t)t * 1000000000);
+    }
+    for (i = 0; i < sizeof fmts / sizeof fmts[0]; i++)
+    {
+        memset(&tm, 0, sizeof tm);
+        if ((end = strptime(s, fmts[i], &tm)) != NULL && *end == '\0')
+        {
+            tm.tm_isdst = -1;
+            return ((uint64_t)mktime(&tm) * 1000000000);
+        }
+    }
+    fprintf(stderr, "logq: can't read time \"%s\"\n", s);
+    exit(EXIT_FAILURE);
+}
+
+/* parse_addr -- an IPv6 or IPv4 address, the way the server stores it */
+int parse_addr(char *s, uint8_t *addr)
+{
+    struct in_addr v4;
+
+    memset(addr, 0, 16);
+    if (inet_pton(AF_INET, s, &v4) == 1)
+    {
+        addr[10] = addr[11] = 0xff;
+        memcpy(addr + 12, &v4, 4);
+        return (1);
+    }
+
+    return (inet_pton(AF_INET6, s, addr) == 1);
+}
+
+int name_index(char **names, int n, char *s)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        if (strcmp(names[i], s) == 0)
+        {
+            return (i);
+        }
+    }
+
+    return (-1);
+}
+
+/* query_file -- run q over one log: through its index if it was rotated
+ * out and has one, else block header to block header from the top */
+int query_file(char *path, query *q, group_table *groups)
+{
+    bin_file_header *fh;
+    bin_trailer tr;
+    bin_index_entry *idx;
+    bin_header ih;
+    struct stat st;
+    size_t off, size, idx_end = 0;
+    char *map;
+    int fd;
+    uint32_t i;
+
+    if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+    {
+        perror(path);
+        return (-1);
+    }
+    size = st.st_size;
+    if (size < sizeof *fh)
+    {
+        close(fd);
+        return (0); // nothing logged yet
+    }
+    if ((map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        perror("mmap");
+        close(fd);
+        return (-1);
+    }
+    close(fd);
+    fh = (bin_file_header *)map;
+    if (fh->magic != BIN_FILE_MAGIC || fh->version != BIN_VERSION ||
+        fh->record_size != sizeof(bin_record))
+    {
+        fprintf(stderr, "logq: %s is not a binary log we can read\n", path);
+        munmap(map, size);
+        return (-1);
+    }
+    madvise(map, size, MADV_RANDOM); // whole blocks get skipped
+
+    off = sizeof *fh;
+    if (size >= off + sizeof tr)
+    {
+        memcpy(&tr, map + size - sizeof tr, sizeof tr);
+        if (tr.magic == BIN_INDEX_MAGIC && tr.index_off + sizeof ih +
+            (uint64_t)tr.nblocks * sizeof *idx + sizeof tr == size)
+        {
+            memcpy(&ih, map + tr.index_off, sizeof ih);
+            idx = (bin_index_entry *)(map + tr.index_off + sizeof ih);
+            for (i = 0; i < tr.nblocks; i++)
+            {
+                blocks_total++;
+                if (idx[i].t_max >= q->from && idx[i].t_min <= q->to)
+                {
+                    scan_block(map, size, idx[i].off, q, groups);
+                }
+            }
+            idx_end = size;
+        }
+    }
+    // no index: the headers alone still let us skip blocks
+    while (idx_end == 0 && off + sizeof ih <= size)
+    {
+        memcpy(&ih, map + off, sizeof ih);
+        if (ih.magic == BIN_INDEX_MAGIC)
+        {
+            off += sizeof ih + (size_t)ih.count * sizeof *idx + sizeof tr;
+            continue;
+        }
+        if (ih.magic != BIN_BLOCK_MAGIC)
+        {
+            fprintf(stderr, "logq: %s: garbage at %zu\n", path, off);
+            break;
+        }
+        blocks_total++;
+        if (ih.t_max >= q->from && ih.t_min <= q->to &&
+            scan_block(map, size, off, q, groups) == -1)
+        {
+            break; // the writer's last block, not complete yet
+        }
+        off += sizeof ih + (size_t)ih.count * sizeof(bin_record);
+    }
+    munmap(map, size);
+
+    return (0);
+}
+
+/* scan_block -- the records of the block at off that match q */
+int scan_block(char *map, size_t size, size_t off, query *q,
+    group_table *groups)
+{
+    bin_header bh;
+    bin_record *rec;
+    uint32_t i;
+
+    memcpy(&bh, map + off, sizeof bh);
+    if (bh.magic != BIN_BLOCK_MAGIC ||
+        off + sizeof bh + (size_t)bh.count * sizeof *rec > size)
+    {
+        return (-1);
+    }
+    blocks_read++;
+    rec = (bin_record *)(map + off + sizeof bh);
+    for (i = 0; i < bh.count; i++, rec++)
+    {
+        if (rec->ts < q->from || rec->ts > q->to ||
+            (q->status != -1 && rec->status != q->status) ||
+            (q->cmd != -1 && rec->cmd != q->cmd) ||
+            (q->by_addr && memcmp(rec->addr, q->addr, 16) != 0))
+        {
+            continue;
+        }
+        record_match(rec, q, groups);
+    }
+
+    return (0);
+}
+
+void record_match(bin_record *rec, query *q, group_table *groups)
+{
+    uint8_t key[16];
+    group *g;
+
+    matched++;
+    matched_bytes += rec->bytes;
+    if (q->by == BY_NONE)
+    {
+        if (!q->count_only)
+        {
+            print_record(rec);
+        }
+        return;
+    }
+    memset(key, 0, sizeof key);
+    if (q->by == BY_CLIENT)
+    {
+        memcpy(key, rec->addr, sizeof key);
+    }
+    else
+    {
+        key[0] = q->by == BY_STATUS ? rec->status : rec->cmd;
+    }
+    g = group_find(groups, key);
+    g->requests++;
+    g->bytes += rec->bytes;
+}
+
+void print_record(bin_record *rec)
+{
+    char when[32], addr[INET6_ADDRSTRLEN], st[8], cmd[8];
+    time_t t = rec->ts / 1000000000;
+    struct tm local;
+
+    localtime_r(&t, &local);
+    strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S", &local);
+    format_addr(rec->addr, addr, sizeof addr);
+    printf("%s.%06u %s %s %s %llu %uus %s\n", when,
+        (unsigned)(rec->ts % 1000000000 / 1000), addr,
+        code_name(cmd_names, 6, rec->cmd, cmd),
+        code_name(status_names, 9, rec->status, st),
+        (unsigned long long)rec->bytes, rec->parse_us,
+        rec->proto == 2 ? "framed" : "legacy");
+}
+
+/* format_addr -- IPv4 mapped addresses the way they were written */
+void format_addr(uint8_t *addr, char *buf, size_t len)
+{
+    static const uint8_t mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0xff, 0xff};
+
+    if (memcmp(addr, mapped, sizeof mapped) == 0)
+    {
+        inet_ntop(AF_INET, addr + 12, buf, len);
+    }
+    else
+    {
+        inet_ntop(AF_INET6, addr, buf, len);
+    }
+}
+
+/* code_name -- names[code], or the number if a newer server wrote it */
+char *code_name(char **names, int n, int code, char *buf)
+{
+    if (code < n)
+    {
+        return (names[code]);
+    }
+    sprintf(buf, "%d", code);
+
+    return (buf);
+}
+
+/* group_find -- the group of key, a new one if there is none yet */
+group *group_find(group_table *t, uint8_t *key)
+{
+    group *old;
+    size_t i, h = 5381, n;
+
+    if (2 * (t->count + 1) > t->cap)
+    {
+        old = t->slots;
+        n = t->cap;
+        t->cap *= 2;
+        t->count = 0;
+        if ((t->slots = calloc(t->cap, sizeof(group))) == NULL)
+        {
+            fprintf(stderr, "calloc() failed in line %d\n", __LINE__);
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < n; i++)
+        {
+            if (old[i].used)
+            {
+                *group_find(t, old[i].key) = old[i];
+            }
+        }
+        free(old);
+    }
+    for (i = 0; i < 16; i++)
+    {
+        h = h * 33 + key[i];
+    }
+    for (i = h & (t->cap - 1); t->slots[i].used; i = (i + 1) & (t->cap - 1))
+    {
+        if (memcmp(t->slots[i].key, key, 16) == 0)
+        {
+            return (&t->slots[i]);
+        }
+    }
+    t->slots[i].used = 1;
+    memcpy(t->slots[i].key, key, 16);
+    t->count++;
+
+    return (&t->slots[i]);
+}
+
+int group_cmp(const void *a, const void *b)
+{
+    const group *x = a, *y = b;
+
+    return ((x->requests < y->requests) - (x->requests > y->requests));
+}
+
+/* group_report -- one line per group, the busiest first */
+void group_report(group_table *t, enum group_by by)
+{
+    char name[INET6_ADDRSTRLEN], buf[8];
+    size_t i, n = 0;
+
+    for (i = 0; i < t->cap; i++)
+    {
+        if (t->slots[i].used)
+        {
+            t->slots[n++] = t->slots[i];
+        }
+    }
+    qsort(t->slots, n, sizeof(group), group_cmp);
+    for (i = 0; i < n; i++)
+    {
+        if (by == BY_CLIENT)
+        {
+            format_addr(t->slots[i].key, name, sizeof name);
+        }
+        else
+        {
+            snprintf(name, sizeof name, "%s", by == BY_STATUS ?
+                code_name(status_names, 9, t->slots[i].key[0], buf) :
+                code_name(cmd_names, 6, t->slots[i].key[0], buf));
+        }
+        printf("%-40s %10llu requests %14llu bytes\n", name,
+            t->slots[i].requests, t->slots[i].bytes);
+    }
+}
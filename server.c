@@ -7,42 +7,785 @@
  *  The client server code makes a request and the server responds.
  * Examples
  *  gcc -Wall server.c -o server -lpthread 
- *  gcc -Wall client.c -o client
+ *  gcc -Wall -DHAVE_ZSTD server.c -o server -lpthread -lzstd  (framed
+ *      clients may then ask for zstd compressed bodies)
+ *  gcc -Wall -DHAVE_TLS server.c -o server -lpthread -lssl -lcrypto  (for
+ *      --tls-cert, on a kernel with the tls module)
+ *  gcc -Wall client.c -o client -lpthread
  *  ./server server _port
+ *  ./server --epoll _port  (event loop instead of fork per connection)
+ *  ./server --workers 4 _port  (one SO_REUSEPORT listener + loop per thread)
+ *  ./server --uring _port  (io_uring instead of epoll, with --workers too;
+ *      falls back to epoll on kernels without it)
+ *  ./server --metrics-port 9100 _port  (Prometheus text on :9100, the
+ *      same numbers the stats command returns)
+ *  ./server --binlog _port  (also a binary access log, log.bin, for logq)
+ *  ./server --max-conns 1000 --rate-limit 50 --byte-limit 10000000 _port
+ *      (more connections, or more requests or bytes per second from one
+ *      address, get the BUSY status)
+ *  ./server --tune nodelay,sndbuf=4194304,fastopen,defer-accept=5 _port
+ *      (socket options, see tune_parse(); the default is just nodelay)
+ *  ./server --epoll --io-threads 8 _port  (cold opens and reads go to 8
+ *      threads instead of the 4 default, 0 does them on the loop)
+ *  ./server --epoll --cache-maps --cache-bytes 4294967296 _port  (cached
+ *      files are read-only mappings instead of copies on the heap)
+ *  ./server --epoll --config roots.conf _port  (serve the directories
+ *      roots.conf lists, see roots_load(); "docs/a" is a in the docs
+ *      root, index docs its index. kill -HUP reads it again)
+ *  ./server --epoll --tls-cert cert.pem --tls-key key.pem _port  (TLS 1.3;
+ *      after the handshake the kernel does the records, so bodies still
+ *      go out with sendfile() and splice())
+ *  ./client --framed server_ip_addr:_port  (pipelined requests from stdin)
+ *  ./client server_ip_addr:_port _file _offset [_length]  (byte range)
+ *  ./client --resume _local server_ip_addr:_port _file  (continue download)
  *  ./client server_ip_add:_port _command 
+ *  ./client server_ip_addr:_port log line 5000 100  (100 log records from
+ *      the 5000th; also log _offset [_lines], log tail _n, log follow)
+ *  ./client --resume _local server_ip_addr:_port log  (just the new records)
+ *  ./client server_ip_addr:_port get _file _file...  (one reply for all of
+ *      them, saved under their names)
+ *  ./client --if-changed _local server_ip_addr:_port _file  (NOT_MODIFIED
+ *      and nothing sent while _file still hashes like _local)
+ *  ./client server_ip_addr:_port _file size  (its size, and with --framed
+ *      --verify its hash, as text)
+ *  ./client --parallel 8 --output _local server_ip_addr:_port _file
+ *      (8 byte ranges over 8 connections at once)
  */
 
+#define _GNU_SOURCE
+
 #include <time.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <errno.h>
 #include <netdb.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <setjmp.h>
 #include <dirent.h>
+#include <poll.h>
+#include <getopt.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <endian.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <linux/tls.h>
+#endif
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "common.c"
+
+#define BACKLOG 128 // how many pending connections queue will hold
+#define SHED_MAX 256 // over --max-conns connections kept to answer BUSY
+#define SHED_TIMEOUT 5 // seconds they get to send their request
+#define IDLE_TIMEOUT 60 // seconds a connection may wait for a request
+#define SEND_TIMEOUT 30 // seconds a reply may make no progress
+#define RATE_SLOTS 4096 // client addresses with a token bucket at once
+#define HASH_SLOTS 4096 // files with a content hash at once, a power of two
+#define HASH_CHUNK (256 << 10) // bytes read per step when hashing a file
+#define TUNE_DEFAULT "nodelay" // --tune when none is given
+#define MAX_EVENTS 64 // epoll events handled per wakeup
+#define IO_THREADS 4 // blocking file work pool of the event loops
+#define IO_DEQUE_SIZE 256 // jobs each pool thread queues, a power of two
+#define SENDFILE_CHUNK (1 << 30) // upper bound for one sendfile()/splice()
+#define LOG_PATH "log.log"
+#define LOG_SLOTS 4096 // ring capacity in records, must be a power of two
+#define LOG_RECORD_MAX 256 // longest formatted log line
+#define LOG_FLUSH_RECORDS 256 // wake the writer every this many records
+#define LOG_FLUSH_MS 100 // ...or at least this often
+#define LOG_BATCH 64 // records per writev()
+#define LOG_INDEX_EVERY 1024 // the line index keeps every this many lines
+#define LOG_SCAN_BUF (64 << 10) // bytes read per step when counting lines
+#define LOG_FOLLOW_MS 1000 // followers look at the log at least this often
+#define BINLOG_PATH "log.bin"
+#define BIN_BLOCK_RECORDS 512 // records per block, at most
+
+/* binary access log: a bin_file_header, then blocks of a bin_header and
+ * its bin_records. When the file is rotated out an index of its blocks is
+ * appended: a bin_header with BIN_INDEX_MAGIC and the block count, one
+ * bin_index_entry per block and a bin_trailer. Native byte order, a reader
+ * on the wrong end sees bad magic. logq.c reads it. */
+#define BIN_FILE_MAGIC 0x5443504c
+#define BIN_BLOCK_MAGIC 0x54435042
+#define BIN_INDEX_MAGIC 0x54435049
+#define BIN_VERSION 1
+#define CACHE_SHARDS 16 // independently locked slices of the hot-file cache
+#define CACHE_BUCKETS 256 // hash chains per shard
+#define CACHE_DEFAULT_BYTES (64 << 20)
+#define MAP_HUGE_MIN (2 << 20) // mappings this big ask for huge pages
+#define INDEX_MIN_SLOTS 1024 // initial size of the directory hash table
+#define ROOT_MAX 16 // roots in a --config file, also their log files
+#define ROOT_READERS 1024 // threads that may ever look at serve_roots
+#define ROOT_NAME_MAX 32
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | \
+    IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+#define MAX_TOKENS 64 // words of a request we look at, the rest is ignored
+#define ARENA_SIZE (BUFSIZ + 1024) // per-request scratch, fits any token
+#define OUTPUT_MAX 64 // out_buf only ever carries short text now
+#define LAT_BUCKETS 24 // latency histogram: <= 1us << i, the last is +Inf
+#define UR_ENTRIES 256 // submission queue size of each io_uring
+#define UR_BUFS 128 // provided receive buffers per ring, a power of two
+#define UR_FILES 4096 // fixed file table; sockets with higher fds go without
+#define UR_PIPE_SIZE (1 << 20) // file -> socket splice chunk
+#define Z_MIN 512 // smaller bodies go out as they are
+#define Z_CHUNK (128 << 10) // body bytes compressed per chunk
+#define Z_LEVEL 3
+#define Z_PRECOMPRESS_MAX (16 << 20) // cached bodies up to this keep a copy
+
+/* framed protocol, chosen per connection by the first four bytes:
+ *  request  magic 'TCPQ' | id u32 | flags u16 | length u16 | payload
+ *  response magic 'TCPR' | id u32 | status u16 | flags u16 | length u64 |
+ *           payload
+ * all in network byte order; the payload of a request is the same text a
+ * legacy client sends. Connections stay open and may pipeline requests. */
+#define FRAME_REQ_MAGIC 0x54435051
+#define FRAME_RESP_MAGIC 0x54435052
+#define FRAME_REQ_LEN 12
+#define FRAME_RESP_LEN 20
+
+/* request flag: the client takes zstd; response flag: the body is zstd,
+ * sent as chunks of u32 length + data (at most FRAME_ZCHUNK_MAX), each
+ * ending with a flush, and a zero length chunk at the end. A streamed body
+ * has length FRAME_LEN_STREAM, a precompressed one its real length. */
+#define FRAME_F_ZSTD 0x0001
+#define FRAME_ZCHUNK_MAX (256 << 10)
+#define FRAME_LEN_STREAM UINT64_MAX
+
+/* request flag: the client wants content hashes; response flag: the
+ * header is followed by the XXH64 of the whole file, u64 in network byte
+ * order and not counted in the length. Only full files carry one. */
+#define FRAME_F_HASH 0x0002
+#define FRAME_HASH_LEN 8
+
+/* "get f1 f2 ..." answers with one body (the frame's, or up to the close
+ * for a legacy client) made of a part per name, in order:
+ *  status u16 | reserved u16 | length u64 | the file's bytes
+ * network byte order; a name that failed has its status and no bytes. */
+#define BATCH_PART_LEN 12
+
+enum conn_state { CONN_TLS, CONN_RECV, CONN_IO, CONN_SEND, CONN_FOLLOW, 
+    CONN_DONE };
+// what an io_uring completion is for, kept in the low bits of user_data
+enum uring_op { UR_ACCEPT, UR_RECV, UR_SEND, UR_BODY, UR_SPLICE_IN, 
+    UR_SPLICE_OUT, UR_CLOSE, UR_OTHER };
+enum conn_proto { PROTO_UNKNOWN, PROTO_LEGACY, PROTO_FRAMED };
+enum reply_status { ST_OK, ST_NOT_FOUND, ST_BAD_FILENAME, ST_NOT_ALLOWED,
+    ST_NOT_READABLE, ST_BAD_REQUEST, ST_BUSY, ST_NOT_MODIFIED, ST_CHANGED,
+    ST_COUNT };
+// why a connection or request was turned away or cut off
+enum reject_reason { REJ_CONNS, REJ_RATE, REJ_BYTES, REJ_IDLE, REJ_SLOW,
+    REJ_COUNT };
+enum stat_cmd { CMD_INDEX, CMD_LOG, CMD_FILE, CMD_STATS, CMD_OTHER, 
+    CMD_GET, CMD_COUNT };
+
+char *status_names[] = {"OK", "NOT_FOUND", "BAD_FILENAME", "NOT_ALLOWED",
+    "NOT_READABLE", "BAD_REQUEST", "BUSY", "NOT_MODIFIED", "CHANGED"};
+char *cmd_names[] = {"index", "log", "file", "stats", "other", "get"};
+char *reject_names[] = {"max_conns", "rate", "bytes", "idle_timeout", 
+    "send_timeout"};
+
+/* a version of a file: what its content hash is kept under. An edit
+ * that leaves the size and the mtime, to the ns, as they were goes
+ * unnoticed. */
+typedef struct file_id {
+    uint64_t dev, ino, size;
+    uint64_t mtime; // ns
+} file_id;
+
+/* a cached file: either its bytes or an open fd for sendfile() */
+typedef struct cache_entry {
+    char name[NAME_MAX + 1];
+    file_id id; // what was read
+    char *data; // NULL in fd mode
+    int mapped; // data is a mapping of the file, not a copy
+    int fd; // -1 in buffer and map mode
+    size_t size;
+    atomic_int refs; // the cache holds one, every response in flight one
+    int referenced; // CLOCK bit
+    atomic_int zstate; // precompressed copy: 0 none yet, 1 ready, 2 being 
+                       // made, -1 not worth it
+    char *zdata; // the whole compressed body, chunks and all
+    size_t zsize;
+    struct cache_entry *next; // hash chain
+    struct cache_entry *ring_prev, *ring_next; // CLOCK ring
+} cache_entry;
+
+typedef struct cache_shard {
+    pthread_mutex_t lock;
+    cache_entry *buckets[CACHE_BUCKETS];
+    cache_entry *hand; // CLOCK hand, NULL when the shard is empty
+    size_t used, budget;
+    unsigned long gen; // bumped by every invalidation
+} cache_shard;
+
+/* server-wide hot-file cache, keyed by filename, invalidated by inotify */
+typedef struct file_cache {
+    int enabled, use_fds, use_maps;
+    cache_shard shards[CACHE_SHARDS];
+    atomic_ulong evictions; // hits and misses are in the metrics slots
+} file_cache;
+
+/* one name in the served directory; file_open() stats the fd it opens,
+ * which is never older than what inotify last said */
+typedef struct dir_slot {
+    char *name; // NULL for a never-used slot, dir_tombstone for a deleted one
+} dir_slot;
+
+/* the served directory, read once at startup and then kept current from
+ * inotify: an open-addressing table of names plus the ready-made reply to
+ * the index command */
+typedef struct dir_index {
+    pthread_rwlock_t lock;
+    dir_slot *slots;
+    size_t cap, count, used; // used counts tombstones too
+    int names_changed; // reply needs rebuilding, watcher-only
+    cache_entry *reply; // pinned by every index response in flight
+    int dirfd; // the directory itself
+} dir_index;
 
-#define BACKLOG 10 // how many pending connections queue will hold
+/* a file body still to be sent: page cache -> socket, never via the heap */
+typedef struct file_out {
+    int fd;
+    cache_entry *ce; // pinned cache entry the body comes from, if any
+    off_t off;
+    size_t remaining;
+    int use_splice, pipefd[2];
+    size_t in_pipe; // bytes spliced into the pipe but not yet to the socket
+    int truncated; // the file shrank and we sent less than promised
+    int zpre; // sending ce->zdata instead of the body itself
+    struct zstream *z; // compressing on the fly, NULL if not
+    int follow; // the log: then keep sending whatever gets appended
+    struct batch *batch; // a get: the parts still to come after this one
+} file_out;
+
+/* a get's files, each sent as its part header and then its body */
+typedef struct batch_part {
+    enum reply_status status;
+    file_out fo;
+    struct serve_root *root; // where the name was looked up
+} batch_part;
+
+typedef struct batch {
+    int nparts, next; // next: the part file_out_next() loads
+    uint64_t total; // all the parts with their headers, the reply's length
+    batch_part parts[];
+} batch;
+
+/* a body being compressed as it is sent: one chunk at a time in out */
+typedef struct zstream {
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *cctx;
+#endif
+    char *in; // read buffer, unless the body is in memory already
+    char *out;
+    size_t out_len, out_sent;
+    int done; // out holds the last chunk and the end marker
+} zstream;
+
+/* a word of the request: points into the receive buffer, not terminated */
+typedef struct token_view {
+    char *p;
+    size_t len;
+} token_view;
+
+/* a tokenized request; tok[0] is "ip:port", tok[1] the command */
+typedef struct request {
+    token_view tok[MAX_TOKENS];
+    int ntok;
+    int more; // there were words past MAX_TOKENS
+} request;
+
+/* bump allocator for everything a request needs, reset between requests */
+typedef struct arena {
+    char *base;
+    size_t size, used;
+} arena;
 
 typedef struct file_info {
-    char client_ip_addr[100];
-    unsigned int bufsize;
+    char client_ip_addr[100]; // the connection's, what rates are kept by
+    char client_port[16]; // ":port" as the request has it, for the log
+    enum reply_status status; // set by parse_input()
+    enum stat_cmd cmd; // set by parse_input()
+    file_out fout; // set by parse_input() when the reply is a file
+    int may_defer; // parse_input() may leave what blocks to the I/O pool
+    int deferred; // ...and did, the reply isn't there yet
+    int want_hash; // the request had FRAME_F_HASH
+    int hashed; // the reply carries hash, set by parse_input()
+    int text_reply; // the body is the text parse_input() returned, not fout
+    uint64_t hash;
+    struct root_set *roots; // taken by parse_input()'s caller, roots_get()
+    struct serve_root *root; // what the request was for, if a root, set by
+                             // parse_input()
+    int cache_hits, cache_misses; // its lookups, counted when it's answered
 } file_info;
 
-void *tokenize(char*);
-void *parse_input(char**, char*, file_info*);
-void log_append(char**, char*);
+/* a request parse_input() deferred, run again on an I/O pool thread */
+typedef struct io_job {
+    struct connection *conn;
+    request req; // its tokens still point into conn->in_buf
+    file_info finfo;
+    char *out_buf;
+    uint32_t id; // framing, for when the reply is queued
+    uint16_t flags;
+    long used;
+    uint64_t t0, queued, started, done; // ns
+    struct io_job *next; // on the owner's completion list
+} io_job;
+
+/* one pool thread's jobs; the others steal from it when theirs is empty */
+typedef struct io_deque {
+    pthread_mutex_t lock;
+    io_job *jobs[IO_DEQUE_SIZE];
+    unsigned head, tail; // everyone takes the oldest, at head
+} io_deque;
+
+typedef struct io_pool {
+    io_deque *deques; // one per thread
+    int nthreads;
+    atomic_uint next; // deque the next job goes to
+    atomic_int queued; // jobs in all the deques
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle;
+} io_pool;
+
+typedef struct bin_file_header {
+    uint32_t magic, version, record_size, reserved;
+} bin_file_header;
+
+/* heads a block of records, or the index */
+typedef struct bin_header {
+    uint32_t magic, count;
+    uint64_t t_min, t_max; // ns since the epoch
+} bin_header;
+
+/* one request */
+typedef struct bin_record {
+    uint64_t ts; // ns since the epoch
+    uint64_t bytes; // body length
+    uint8_t addr[16]; // IPv6, IPv4 mapped
+    uint32_t parse_us;
+    uint8_t cmd, status, proto, reserved; // enum stat_cmd, reply_status...
+} bin_record;
+
+typedef struct bin_index_entry {
+    uint64_t off, t_min, t_max;
+    uint32_t count, reserved;
+} bin_index_entry;
+
+typedef struct bin_trailer {
+    uint64_t index_off;
+    uint32_t nblocks, magic;
+} bin_trailer;
+
+/* one formatted log line; seq tells producers and the writer who owns it */
+typedef struct log_slot {
+    atomic_size_t seq;
+    unsigned short len;
+    char data[LOG_RECORD_MAX];
+} log_slot;
+
+/* access log: request handlers push into a bounded lock-free MPSC ring,
+ * one writer thread drains it to a single long-lived fd with writev() */
+typedef struct logger {
+    log_slot *slots;
+    size_t mask;
+    atomic_size_t tail; // next slot a producer claims
+    size_t head; // next slot the writer drains, writer-only
+    atomic_ulong dropped; // records lost because the ring was full
+    unsigned long dropped_reported;
+    int fd, wakefd;
+    off_t max_bytes; // rotate to path.1 past this size, 0 = never
+    char *path;
+    int binary; // records are bin_records, written in blocks
+    pid_t owner; // only this process rotates, forked children follow it
+    pthread_t thread;
+} logger;
+
+/* where every LOG_INDEX_EVERY'th line of the access log starts, so a line
+ * cursor costs a short scan instead of a read from the top. Extended by
+ * the watcher as the log grows and by readers that get there first. */
+typedef struct log_index {
+    pthread_mutex_t lock;
+    off_t *marks; // marks[i]: start of line i * LOG_INDEX_EVERY
+    size_t nmarks, cap;
+    off_t scanned; // indexed up to here, always just past a '\n'
+    unsigned long lines; // complete lines before scanned
+    ino_t ino; // the file indexed, another one after rotation
+} log_index;
 
-pthread_mutex_t lock;
-file_info finfo;
+/* counters of one serving thread (or, forked, of one CPU): written only
+ * by their owner and summed up when someone asks, so the request path
+ * never fights over a cache line */
+typedef struct metrics {
+    uint64_t requests[CMD_COUNT];
+    uint64_t replies[ST_COUNT];
+    uint64_t bytes_sent;
+    uint64_t conns_opened, conns_closed;
+    uint64_t accept_errors;
+    uint64_t rejected[REJ_COUNT];
+    uint64_t parse_hist[LAT_BUCKETS], send_hist[LAT_BUCKETS];
+    uint64_t parse_ns, send_ns; // histogram sums
+    uint64_t io_inline; // the I/O pool was full, done on the loop
+    uint64_t io_wait_hist[LAT_BUCKETS], io_service_hist[LAT_BUCKETS];
+    uint64_t io_wait_ns, io_service_ns;
+    uint64_t tls_failures; // handshakes that never got to the kernel
+    uint64_t tls_hist[LAT_BUCKETS], tls_ns; // accept to keys in the kernel
+    uint64_t cache_hits, cache_misses; // lookups in the roots' caches
+} __attribute__ ((aligned(64))) metrics;
+
+/* all the metrics slots; shared memory so forked children count too */
+typedef struct stats_registry {
+    metrics *slots;
+    int nslots;
+    int shared; // several processes write a slot, adds must be atomic
+} stats_registry;
+
+/* one client address's token buckets, refilled for the time gone by
+ * whenever it is looked at */
+typedef struct rate_slot {
+    atomic_flag lock;
+    char ip[INET6_ADDRSTRLEN]; // "" for a free slot
+    double reqs, bytes; // tokens
+    uint64_t last; // ns, last refill
+} rate_slot;
+
+/* a file's content hash; a slot goes to the file hashed last */
+typedef struct hash_slot {
+    atomic_flag lock;
+    file_id id; // all 0 for a free slot
+    uint64_t hash;
+} hash_slot;
+
+/* per-client limits; a slot is shared by every address that hashes to it
+ * and goes to the one seen last, which then starts with a full bucket */
+typedef struct rate_table {
+    rate_slot *slots; // shared memory, so forked children agree
+    double req_rate, byte_rate; // per second, 0 for no limit
+} rate_table;
+
+/* a served directory: "name/file" is file in it. Each has its own index,
+ * cache and limits, and may have its own access log. */
+typedef struct serve_root {
+    char name[ROOT_NAME_MAX];
+    char *path;
+    int dirfd; // every open is relative to it, -1 until opened
+    int wd; // its inotify watch
+    size_t cache_bytes;
+    double req_rate, byte_rate; // on top of --rate-limit and --byte-limit
+    char *log_path; // NULL: the main access log
+    dir_index dir;
+    file_cache cache;
+    rate_table rates;
+    logger *log;
+} serve_root;
+
+/* all the roots, replaced as a whole by a reload; the first also answers
+ * names without a "root/" */
+typedef struct root_set {
+    int n;
+    serve_root roots[ROOT_MAX];
+} root_set;
+
+/* one thread that reads serve_roots: the generation of the roots it
+ * started with, 0 while it has none. A line each, so taking the roots
+ * writes nothing another thread reads on its request path. */
+typedef struct root_reader {
+    atomic_ulong gen;
+} __attribute__ ((aligned(64))) root_reader;
+
+struct connection;
+
+/* one serving thread: its own listener, event loop and request state */
+typedef struct worker {
+    int id, sockfd;
+    pthread_t thread;
+    file_info finfo;
+    metrics *stats;
+    struct connection *conns; // all of them, for the timeout sweep
+    int io_efd; // I/O pool completions are signalled here, -1 for no pool
+    _Atomic(io_job *) io_done; // finished jobs, newest first
+    atomic_int nconns; // open; log followers are closed on their own thread
+} worker;
+
+/* per-connection state for the event loop */
+typedef struct connection {
+    int fd;
+    worker *owner;
+    enum conn_state state;
+    enum conn_proto proto;
+    int peer_closed;
+    char client_ip_addr[INET6_ADDRSTRLEN];
+    char in_buf[BUFSIZ];
+    size_t in_len;
+    char hdr[FRAME_RESP_LEN + FRAME_HASH_LEN]; // response header, framed
+                                               // protocol only
+    size_t hdr_len, hdr_sent;
+    char arena_buf[ARENA_SIZE];
+    arena mem;
+    file_out fout;
+    char *out_buf;
+    size_t out_len, out_sent;
+    uint64_t body_len; // fout.remaining when the reply was queued
+    uint64_t send_start; // ns, for the send latency histogram
+    int slot; // io_uring fixed file index, -1 for none
+    int slot_fd; // what the last files update put in the slot
+    int inflight; // io_uring operations not completed yet
+    int busy; // over --max-conns: one BUSY reply, then closed
+    int timed_out;
+    uint64_t last_active; // ns, last time the socket was ready
+    struct connection *prev, *next; // the owner's list
+    io_job io; // CONN_IO: what the I/O pool is doing for it
+#ifdef HAVE_TLS
+    tls_handshake *tls; // CONN_TLS only, freed once the kernel has the keys
+#endif
+    int tls_write; // CONN_TLS: the handshake waits to write, not to read
+} connection;
+
+/* one io_uring, set up and driven with the raw syscalls */
+typedef struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    unsigned sq_local; // our tail, published by uring_enter()
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *br; // provided receive buffers, group 0
+    char *bufs;
+    worker *owner;
+    struct __kernel_timespec tick; // the timeout sweep's period
+    uint64_t io_count; // I/O pool eventfd reads land here
+} uring;
+
+void usage();
+int make_listener(char*, int);
+void tune_listener(int, tcp_tune*);
+void tune_accepted(int, tcp_tune*);
+void tune_cork(int, tcp_tune*, int);
+void serve_fork(worker*);
+void serve_epoll(worker*);
+void epoll_settle(int, connection*);
+void serve_workers(char*, int);
+void *worker_main(void*);
+void serve_uring(worker*);
+int uring_init(uring*);
+struct io_uring_sqe *uring_sqe(uring*, connection*, enum uring_op);
+int uring_enter(uring*, unsigned);
+void uring_complete(uring*, struct io_uring_cqe*);
+void uring_accept(uring*);
+void uring_tick(uring*);
+void uring_io_arm(uring*);
+void uring_accept_done(uring*, struct io_uring_cqe*);
+void uring_step(uring*, connection*);
+void uring_sqe_fd(struct io_uring_sqe*, connection*);
+void uring_recv(uring*, connection*);
+int uring_send(uring*, connection*);
+void uring_buf_return(uring*, int);
+void uring_poll(uring*, connection*, short);
+int set_nonblocking(int);
+void accept_connections(int, worker*);
+connection *conn_new(int, worker*, struct sockaddr_storage*);
+int conns_open();
+void conn_step(connection*);
+short conn_events(connection*);
+void conn_recv(connection*);
+int conn_process(connection*);
+int conn_send(connection*);
+int conn_next_part(connection*);
+void conn_reply_done(connection*);
+void conn_close(connection*);
+void conn_unlink(connection*);
+void conn_retire(connection*);
+void conn_sweep(worker*);
+void conn_reply_ready(connection*, file_info*, uint32_t, uint16_t, long,
+    uint64_t);
+int conn_defer(connection*, request*, file_info*, uint32_t, uint16_t, long,
+    uint64_t);
+void conn_io_done(connection*);
+void io_pool_init(io_pool*, int);
+void io_attach(worker*);
+int io_submit(io_pool*, io_job*);
+io_job *io_take(io_deque*);
+void *io_main(void*);
+void io_run(io_job*);
+void io_complete(io_job*);
+io_job *io_collect(worker*);
+void tls_step(connection*);
+void tls_fail(connection*);
+void tls_done(connection*);
+#ifdef HAVE_TLS
+void tls_init(char*, char*);
+#endif
+void *busy_reply(arena*, file_info*);
+void rate_init(rate_table*, double, double);
+int rate_check(rate_table*, char*, enum reject_reason*);
+void rate_charge(rate_table*, char*, size_t);
+int rate_admit(rate_table*, char*, size_t);
+void hash_init();
+int hash_lookup(file_id*, uint64_t*);
+void hash_store(file_id*, uint64_t);
+int content_hash(file_out*, file_id*, uint64_t*, int);
+void file_id_of(file_id*, struct stat*);
+long frame_parse(char*, size_t, uint32_t*, uint16_t*, char**, size_t*);
+void frame_header(char*, uint32_t, int, int, uint64_t);
+void file_out_init(file_out*);
+int file_out_send(file_out*, int);
+void file_out_close(file_out*);
+int file_out_next(file_out*, char*);
+uint64_t file_out_total(file_out*);
+int file_out_pending(file_out*);
+char *file_out_data(file_out*);
+int file_out_compress(file_out*);
+int zstream_fill(file_out*);
+void cache_precompress(cache_entry*);
+void arena_init(arena*, char*, size_t);
+void arena_reset(arena*);
+void *arena_alloc(arena*, size_t);
+char *arena_strndup(arena*, char*, size_t);
+int tok_eq(token_view*, char*);
+int tok_to_off(token_view*, off_t*);
+int tok_to_hash(token_view*, uint64_t*);
+int tokenize(char*, size_t, request*, file_info*);
+void *parse_input(request*, arena*, file_info*);
+enum reply_status file_open(char*, file_out*, file_info*, file_id*);
+int open_beneath(int, char*);
+void log_append(char*, file_info*);
+void logger_init(logger*, char*, off_t, int);
+int logger_open(logger*);
+int logger_push(logger*, char*, size_t);
+void logger_drain(logger*);
+void logger_rotate(logger*);
+void logger_discard(logger*);
+void logger_postfork_child();
+void *logger_main(void*);
+void binlog_add(connection*, file_info*, uint64_t);
+void binlog_seal(int);
+void log_index_init(log_index*);
+int log_index_update(log_index*, int);
+void log_index_refresh(log_index*);
+off_t log_index_seek(log_index*, int, unsigned long);
+unsigned long log_index_line_at(log_index*, int, off_t);
+void log_index_prefork();
+void log_index_postfork();
+void log_index_postfork_child();
+off_t log_scan(int, off_t, off_t, unsigned long*);
+int log_range(log_index*, int, request*, file_out*);
+void log_follow(connection*);
+void *follow_main(void*);
+void cache_init(file_cache*, size_t, int, int);
+char *cache_map(int, size_t);
+void map_sigbus(int);
+unsigned long name_hash(char*);
+void dir_index_build(dir_index*);
+dir_slot *dir_index_find(dir_index*, char*);
+int dir_index_lookup(dir_index*, char*);
+void dir_index_put(dir_index*, char*);
+void dir_index_remove(dir_index*, char*);
+void dir_index_grow(dir_index*);
+void dir_index_serialize(dir_index*);
+cache_entry *dir_index_reply(dir_index*);
+void dir_index_event(dir_index*, struct inotify_event*);
+void dir_index_free(dir_index*);
+root_set *roots_load(char*);
+int root_open(serve_root*);
+void roots_free(root_set*);
+void roots_reload();
+void roots_unwatch(root_set*, root_set*);
+root_set *roots_get();
+void roots_put();
+void roots_synchronize();
+serve_root *root_find(root_set*, char*, char**);
+serve_root *root_named(root_set*, token_view*);
+logger *root_logger(char*);
+void roots_prefork();
+void roots_postfork();
+void roots_postfork_child();
+cache_entry *cache_lookup(file_cache*, char*, unsigned long*);
+cache_entry *cache_insert(file_cache*, char*, int, struct stat*, 
+    unsigned long);
+void cache_unlink(cache_shard*, cache_entry*);
+void cache_release(cache_entry*);
+void cache_invalidate(file_cache*, char*);
+void cache_clear(file_cache*);
+void cache_report(file_cache*, FILE*);
+void file_out_from_cache(file_out*, cache_entry*);
+void watcher_init(sigset_t*);
+void *watcher_main(void*);
+void stats_init(stats_registry*, int, int);
+void stats_add(uint64_t*, uint64_t);
+void stats_latency(uint64_t*, uint64_t*, uint64_t);
+uint64_t stats_now();
+cache_entry *stats_render(stats_registry*);
+unsigned long listen_drops();
+void stats_listen(char*);
+void *stats_main(void*);
+
+logger access_log;
+logger bin_log; // --binlog only
+log_index log_lines;
+_Atomic(root_set *) serve_roots; // only the watcher changes it, see 
+                                 // roots_reload()
+pthread_rwlock_t roots_lock; // write-held to swap serve_roots, read-held
+                             // across fork()
+root_reader root_readers[ROOT_READERS];
+atomic_int nroot_readers;
+atomic_ulong roots_gen = 1; // bumped by every swap
+__thread int reader_slot = -1, reader_depth = 0; // this thread's reader
+char *config_path = NULL; // --config, NULL serves just the cwd
+int cache_allowed = 0; // roots get caches, the loops only
+size_t root_cache_bytes = CACHE_DEFAULT_BYTES; // unless the config says
+int root_cache_fds = 0, root_cache_maps = 0;
+off_t root_log_max = 0;
+logger root_logs[ROOT_MAX]; // the roots' own access logs, never closed
+int root_logs_used = 0;
+int watch_fd = -1, cwd_wd = -1; // the watcher's inotify, its watch on "."
+stats_registry server_stats;
+int use_uring = 0;
+int use_binlog = 0;
+int listen_backlog = BACKLOG;
+int max_conns = 0; // 0 for no limit
+int idle_timeout = IDLE_TIMEOUT, send_timeout = SEND_TIMEOUT; // s, 0 = none
+worker *loop_workers; // all of this process's, see conns_open()
+int nloop_workers;
+// forked, serving a connection; lock-free, so the SIGCHLD handler may
+// touch it whichever thread it interrupts
+atomic_int live_children = 0;
+rate_table client_rates;
+hash_slot *content_hashes; // HASH_SLOTS, shared memory like client_rates
+tcp_tune server_tune;
+io_pool blocking_io; // the event loops' only, fork mode blocks anyway
+__thread sigjmp_buf *map_fault; // where a SIGBUS from a mapping goes
+int io_threads = IO_THREADS;
+int use_tls = 0; // --tls-cert: every connection starts with a handshake
+#ifdef HAVE_TLS
+SSL_CTX *tls_ctx;
+#endif
+char dir_tombstone[] = "";
 
 void sigchld_handler(int s)
 {
@@ -51,7 +794,10 @@ void sigchld_handler(int s)
     // waitpid() might overwrite errno, so we save and restore it:
     int saved_errno = errno;
 
-    while ( waitpid(-1, NULL, WNOHANG) > 0 );
+    while ( waitpid(-1, NULL, WNOHANG) > 0 )
+    {
+        atomic_fetch_sub(&live_children, 1);
+    }
 
     errno = saved_errno;
 }
@@ -68,34 +814,258 @@ void *get_in_addr(struct sockaddr *sa)
 
 int main(int argc, char **argv)
 {
-    char **token;
-    char *out_buf; 
-    char s[INET6_ADDRSTRLEN], in_buf[BUFSIZ];
-    int sockfd, new_fd, rv, yes = 1;  
-    struct addrinfo hints, *servinfo, *p;
-    struct sockaddr_storage their_addr; // connector's address information
+    int opt, use_epoll = 0, nworkers = 0, cache_fds = 0, cache_maps = 0;
+    double req_rate = 0, byte_rate = 0;
+    char *metrics_port = NULL;
+    off_t log_max_bytes = 0;
+    size_t cache_bytes = CACHE_DEFAULT_BYTES;
+    sigset_t mask;
     struct sigaction sa;
-    socklen_t sin_size;
-    
-    if (argc != 2)
+    worker w;
+    char *tune = TUNE_DEFAULT, *tls_cert = NULL, *tls_key = NULL;
+    static struct option long_opts[] = {
+        {"epoll", no_argument, NULL, 'e'},
+        {"workers", required_argument, NULL, 'w'},
+        {"log-max-bytes", required_argument, NULL, 'l'},
+        {"cache-bytes", required_argument, NULL, 'c'},
+        {"cache-fds", no_argument, NULL, 'F'},
+        {"cache-maps", no_argument, NULL, 'P'},
+        {"metrics-port", required_argument, NULL, 'm'},
+        {"uring", no_argument, NULL, 'u'},
+        {"binlog", no_argument, NULL, 'b'},
+        {"backlog", required_argument, NULL, 'B'},
+        {"max-conns", required_argument, NULL, 'M'},
+        {"rate-limit", required_argument, NULL, 'r'},
+        {"byte-limit", required_argument, NULL, 'R'},
+        {"idle-timeout", required_argument, NULL, 'i'},
+        {"send-timeout", required_argument, NULL, 's'},
+        {"io-threads", required_argument, NULL, 'T'},
+        {"tune", required_argument, NULL, 't'},
+        {"config", required_argument, NULL, 'C'},
+        {"tls-cert", required_argument, NULL, 'S'},
+        {"tls-key", required_argument, NULL, 'K'},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "ew:l:c:FPm:ubB:M:r:R:i:s:T:t:C:S:K:", 
+        long_opts, NULL)) != -1)
     {
-        fprintf(stderr, "Usage: server port # example port 4443\n");
-        exit(EXIT_FAILURE);
+        switch (opt)
+        {
+        case 'e':
+            use_epoll = 1;
+            break;
+        case 'w':
+            if ((nworkers = atoi(optarg)) < 1)
+            {
+                usage();
+            }
+            break;
+        case 'l':
+            log_max_bytes = atoll(optarg);
+            break;
+        case 'c':
+            cache_bytes = strtoull(optarg, NULL, 10);
+            break;
+        case 'F':
+            cache_fds = 1;
+            break;
+        case 'P':
+            cache_maps = 1;
+            break;
+        case 'm':
+            metrics_port = optarg;
+            break;
+        case 'u':
+            use_uring = 1;
+            break;
+        case 'b':
+            use_binlog = 1;
+            break;
+        case 'B':
+            if ((listen_backlog = atoi(optarg)) < 1)
+            {
+                usage();
+            }
+            break;
+        case 'M':
+            max_conns = atoi(optarg);
+            break;
+        case 'r':
+            req_rate = atof(optarg);
+            break;
+        case 'R':
+            byte_rate = atof(optarg);
+            break;
+        case 'i':
+            idle_timeout = atoi(optarg);
+            break;
+        case 's':
+            send_timeout = atoi(optarg);
+            break;
+        case 'T':
+            io_threads = atoi(optarg);
+            break;
+        case 't':
+            tune = optarg;
+            break;
+        case 'C':
+            config_path = optarg;
+            break;
+        case 'S':
+#ifndef HAVE_TLS
+            fprintf(stderr, "server: built without TLS, no --tls-cert\n");
+            exit(EXIT_FAILURE);
+#endif
+            tls_cert = optarg;
+            break;
+        case 'K':
+            tls_key = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1 || tune_parse(tune, &server_tune) == -1 ||
+        (cache_fds && cache_maps) || (tls_key != NULL && tls_cert == NULL))
+    {
+        usage();
+    }
+#ifdef HAVE_TLS
+    if (tls_cert != NULL)
+    {
+        tls_init(tls_cert, tls_key != NULL ? tls_key : tls_cert);
     }
+#endif
     
-    if (pthread_mutex_init(&lock, NULL) != 0)
+    // block SIGUSR1 and SIGHUP before any thread starts, the watcher takes
+    // them
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    logger_init(&access_log, LOG_PATH, log_max_bytes, 0);
+    if (use_binlog)
+    {
+        logger_init(&bin_log, BINLOG_PATH, log_max_bytes, 1);
+    }
+    pthread_atfork(NULL, NULL, logger_postfork_child);
+    log_index_init(&log_lines);
+    // a forked child's cache dies with it, so only the loops get one
+    cache_allowed = use_epoll || use_uring || nworkers > 0;
+    root_cache_bytes = cache_bytes;
+    root_cache_fds = cache_fds;
+    root_cache_maps = cache_maps;
+    root_log_max = log_max_bytes;
+    watcher_init(&mask);
+    // a slot per thread; forked children each pick their CPU's
+    if (nworkers > 0)
+    {
+        stats_init(&server_stats, nworkers, 0);
+    }
+    else if (use_epoll || use_uring)
+    {
+        stats_init(&server_stats, 1, 0);
+    }
+    else
+    {
+        stats_init(&server_stats, sysconf(_SC_NPROCESSORS_CONF), 1);
+    }
+    if (metrics_port != NULL)
+    {
+        stats_listen(metrics_port);
+    }
+    rate_init(&client_rates, req_rate, byte_rate);
+    hash_init();
+    if (cache_allowed && cache_maps)
+    {
+        sa.sa_handler = map_sigbus;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = 0;
+        if (sigaction(SIGBUS, &sa, NULL) == -1)
+        {
+            perror("sigaction");
+            exit(1);
+        }
+    }
+    if ((use_epoll || use_uring || nworkers > 0) && io_threads > 0)
     {
-        fprintf(stderr, "mutex() failed in line %d\n", __LINE__);
+        io_pool_init(&blocking_io, io_threads);
     }
+
+    if (nworkers > 0)
+    {
+        serve_workers(argv[optind], nworkers);
+        return (0);
+    }
+
+    memset(&w, 0, sizeof w);
+    w.sockfd = make_listener(argv[optind], 0);
+    w.stats = &server_stats.slots[0];
+    w.io_efd = -1;
+    loop_workers = &w;
+    nloop_workers = 1;
+
+    if (use_uring)
+    {
+        serve_uring(&w);
+    }
+    else if (use_epoll)
+    {
+        serve_epoll(&w);
+    }
+    else
+    {
+        sa.sa_handler = sigchld_handler; // reap all dead processes
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART;
+        if ( sigaction(SIGCHLD, &sa, NULL) == -1) 
+        {
+            perror("sigaction");
+            exit(1);
+        }
+        serve_fork(&w);
+    }
+
+    return (0);
+}
+
+void usage()
+{
+    fprintf(stderr, "Usage: server [--epoll | --uring] [--workers N] "
+        "[--log-max-bytes N] [--cache-bytes N] [--cache-fds | --cache-maps] "
+        "[--metrics-port P] [--binlog] [--backlog N] [--max-conns N] "
+        "[--rate-limit REQ/S] [--byte-limit BYTES/S] [--idle-timeout S] "
+        "[--send-timeout S] [--io-threads N] [--tune opt,...] "
+        "[--config file] [--tls-cert file [--tls-key file]] "
+        "port # example port 4443\n"
+        "tune: none | nodelay | cork | sndbuf=B | rcvbuf=B | fastopen[=N] "
+        "| defer-accept=S | notsent-lowat=B | busy-poll=US\n"
+        "requests: index [root] | stats | log [offset [lines]] "
+        "| log line N [lines] "
+        "| log tail N | log follow [offset] | file [offset [length]] "
+        "| file if-none-match HASH | file if-match HASH offset [length] "
+        "| file size | get file...\n");
+    exit(EXIT_FAILURE);
+}
+
+/* make_listener -- bind and listen on port; reuseport lets several
+ * listeners share it so the kernel spreads connections between them. */
+int make_listener(char *port, int reuseport)
+{
+    int sockfd, rv, yes = 1;  
+    struct addrinfo hints, *servinfo, *p;
+
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE; // use my IP
 
-    if ((rv = getaddrinfo(NULL, argv[1], &hints, &servinfo)) != 0) 
+    if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) 
     {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-        return (1);
+        exit(1);
     }
 
     // loop through all the results and bind to the first we can
@@ -115,6 +1085,13 @@ int main(int argc, char **argv)
             exit(1);
         }
 
+        if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes,
+                sizeof(int)) == -1) 
+        {
+            perror("setsockopt");
+            exit(1);
+        }
+
         if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) 
         {
             close(sockfd);
@@ -133,304 +1110,5226 @@ int main(int argc, char **argv)
         exit(1);
     }
 
-    // listen allows queue of up to BACKLOG number
-    if (listen(sockfd, BACKLOG) == -1) 
+    tune_listener(sockfd, &server_tune);
+    // listen allows queue of up to --backlog (BACKLOG) number
+    if (listen(sockfd, listen_backlog) == -1) 
     {
         perror("listen");
         exit(1);
     }
 
-    sa.sa_handler = sigchld_handler; // reap all dead processes
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
-    if ( sigaction(SIGCHLD, &sa, NULL) == -1) 
+    return (sockfd);
+}
+
+/* tune_listener -- what has to be set before connections arrive; accepted
+ * sockets inherit the buffer sizes. Failures are reported, not fatal:
+ * Fast Open for instance also needs net.ipv4.tcp_fastopen to allow it. */
+void tune_listener(int fd, tcp_tune *t)
+{
+    if (t->sndbuf > 0 && 
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &t->sndbuf, sizeof(int)) == -1)
     {
-        perror("sigaction");
-        exit(1);
+        perror("setsockopt SO_SNDBUF");
+    }
+    if (t->rcvbuf > 0 && 
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &t->rcvbuf, sizeof(int)) == -1)
+    {
+        perror("setsockopt SO_RCVBUF");
+    }
+    if (t->fastopen > 0 && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, 
+        &t->fastopen, sizeof(int)) == -1)
+    {
+        perror("setsockopt TCP_FASTOPEN");
+    }
+    if (t->defer_accept > 0 && setsockopt(fd, IPPROTO_TCP, 
+        TCP_DEFER_ACCEPT, &t->defer_accept, sizeof(int)) == -1)
+    {
+        perror("setsockopt TCP_DEFER_ACCEPT");
+    }
+}
+
+/* tune_accepted -- the per-connection options, on a new socket. Once per
+ * process for each error, or a refused option would flood stderr. */
+void tune_accepted(int fd, tcp_tune *t)
+{
+    static atomic_int warned;
+
+    if ((t->nodelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, 
+            &t->nodelay, sizeof(int)) == -1) ||
+        (t->notsent_lowat > 0 && setsockopt(fd, IPPROTO_TCP, 
+            TCP_NOTSENT_LOWAT, &t->notsent_lowat, sizeof(int)) == -1) ||
+        (t->busy_poll > 0 && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, 
+            &t->busy_poll, sizeof(int)) == -1))
+    {
+        if (atomic_exchange(&warned, 1) == 0)
+        {
+            perror("setsockopt");
+        }
+    }
+}
+
+/* tune_cork -- with "cork": hold a reply back until all of it is queued,
+ * so header and body go out in full segments rather than a short one */
+void tune_cork(int fd, tcp_tune *t, int on)
+{
+    if (t->cork)
+    {
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(int));
     }
+}
+
+/* serve_fork -- the original model: one child process per connection. Past
+ * --max-conns the parent answers BUSY itself, polling those connections
+ * along with the listener. */
+void serve_fork(worker *w)
+{
+    int new_fd, n, i;  
+    struct sockaddr_storage their_addr; // connector's address information
+    struct pollfd pfd[SHED_MAX + 1];
+    connection *shed[SHED_MAX + 1];
+    socklen_t sin_size;
+    connection *conn;
+    pid_t pid;
 
     while (1) 
     {  
+        pfd[0].fd = w->sockfd;
+        pfd[0].events = POLLIN;
+        for (n = 1, conn = w->conns; conn != NULL; conn = conn->next, n++)
+        {
+            shed[n] = conn;
+            pfd[n].fd = conn->fd;
+            pfd[n].events = conn_events(conn);
+        }
+        if (poll(pfd, n, n > 1 ? 1000 : -1) == -1)
+        {
+            continue; // EINTR, a child is gone
+        }
+        for (i = 1; i < n; i++)
+        {
+            if (pfd[i].revents != 0)
+            {
+                conn_step(shed[i]);
+                if (shed[i]->state == CONN_DONE)
+                {
+                    conn_close(shed[i]);
+                }
+            }
+        }
+        conn_sweep(w);
+        if (!(pfd[0].revents & POLLIN))
+        {
+            continue;
+        }
+
         sin_size = sizeof their_addr;
-        new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size);
+        new_fd = accept(w->sockfd, (struct sockaddr *)&their_addr, 
+            &sin_size);
         if (new_fd == -1) 
         {
             perror("accept");
+            stats_add(&w->stats->accept_errors, 1);
             continue;
         }
 
-        inet_ntop(their_addr.ss_family, 
-            get_in_addr((struct sockaddr *)&their_addr), s, sizeof s);
-        strcat(finfo.client_ip_addr, s);
+        if (max_conns > 0 && atomic_load(&live_children) >= max_conns)
+        {
+            // no fork bomb: we say BUSY from here, or just close
+            if (atomic_load(&w->nconns) >= SHED_MAX || 
+                set_nonblocking(new_fd) == -1 ||
+                (conn = conn_new(new_fd, w, &their_addr)) == NULL)
+            {
+                stats_add(&w->stats->rejected[REJ_CONNS], 1);
+                close(new_fd);
+                continue;
+            }
+            if (!conn->busy)
+            {
+                conn->busy = 1;
+                stats_add(&w->stats->rejected[REJ_CONNS], 1);
+            }
+            continue;
+        }
 
-        if (!fork()) 
+        if ((pid = fork()) == 0) 
         { 
-            close(sockfd); // child doesn't need the listener
-            
-            if (recv(new_fd, in_buf, sizeof(in_buf) -1, 0) == -1)
+            close(w->sockfd); // child doesn't need the listener
+            for (conn = w->conns; conn != NULL; conn = conn->next)
             {
-                perror("recv");
+                close(conn->fd); // nor the parent's BUSY ones
             }
+            w->conns = NULL;
+            atomic_store(&w->nconns, 0);
+            signal(SIGPIPE, SIG_IGN);
+            w->stats = &server_stats.slots[sched_getcpu() % 
+                server_stats.nslots];
 
-            if ((out_buf = malloc(1024 * sizeof(char))) == NULL)
+            // the same state machine as the event loop, driven by poll()
+            if (set_nonblocking(new_fd) == -1 || 
+                (conn = conn_new(new_fd, w, &their_addr)) == NULL)
             {
-                fprintf(stderr, "malloc() failed in line %d\n", __LINE__);
                 exit(EXIT_FAILURE);
-            } 
-            finfo.bufsize = 1024;
-
-            token = tokenize(in_buf);
-            out_buf = parse_input(token, out_buf, &finfo);
-            
-            if (send(new_fd, out_buf, strlen(out_buf), 0) == -1)
+            }
+            pfd[0].fd = new_fd;
+            while (conn_step(conn), conn->state != CONN_DONE && 
+                conn->state != CONN_FOLLOW)
+            {
+                pfd[0].events = conn_events(conn);
+                n = conn->state == CONN_SEND ? send_timeout : idle_timeout;
+                if (poll(pfd, 1, n > 0 ? n * 1000 : -1) == 0)
+                {
+                    stats_add(&w->stats->rejected[conn->state == CONN_SEND ?
+                        REJ_SLOW : REJ_IDLE], 1);
+                    break;
+                }
+            }
+            if (conn->state == CONN_FOLLOW)
             {
-                perror("send"); 
+                log_follow(conn); // this process has nothing else to do
             }
-            
-            close(new_fd);
-            free(out_buf);
-            free(token);
+            conn_close(conn);
 
+            // no writer thread survives fork(), the child drains its own
+            logger_drain(&access_log);
+            for (n = 0; n < root_logs_used; n++)
+            {
+                logger_drain(&root_logs[n]);
+            }
+            if (use_binlog)
+            {
+                logger_drain(&bin_log);
+            }
             exit(EXIT_SUCCESS);
         }
+        if (pid > 0)
+        {
+            atomic_fetch_add(&live_children, 1);
+        }
         close(new_fd);  
     }
-    pthread_mutex_destroy(&lock);
-
-    return (0);
 }
 
-void *parse_input(char **input, char *output, file_info *finfo)
+/* serve_epoll -- single process, non-blocking, edge-triggered event loop.
+ * Every connection walks CONN_RECV -> CONN_SEND -> closed, or back to
+ * CONN_RECV for the next request on a framed connection. */
+void serve_epoll(worker *w)
 {
-    int fd, file_found; 
-    unsigned long file_size;
-    off_t curr_pos, total_read = 0;
-    size_t read_bytes; 
-    char message[100];
-    char reject[] = ")(*&^%$#@?!`~-+0123456789";
-    struct dirent *de;
-    DIR *dr;
-    
-    *output = '\0'; *message = '\0';
-    if (*(input + 1) == NULL)
+    int epfd, i, n, sockfd = w->sockfd, io_ready = 0;
+    struct epoll_event ev, events[MAX_EVENTS];
+    connection *conn;
+    io_job *job, *next;
+    uint64_t swept = 0;
+
+    if (set_nonblocking(sockfd) == -1)
     {
-        return (output);
+        perror("fcntl");
+        exit(1);
     }
-    
-    if ((dr = opendir(".")) == NULL)
+    if ((epfd = epoll_create1(0)) == -1)
     {
-        fprintf(stderr, "opendir() failed in line %d\n", __LINE__);
-        exit(EXIT_FAILURE);
+        perror("epoll_create1");
+        exit(1);
     }
-    // message[0] = '\0';
-    
-    if ((strcmp(*(input + 1), "index")) == 0)
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL; // NULL marks the listener
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev) == -1)
     {
-        while ((de = readdir(dr)) != NULL)
-        {
-            if ((strcmp(de->d_name, "..") != 0) && 
-                (strcmp(de->d_name, ".") != 0))
-            {
-                strcat(output, de->d_name);
-                strcat(output, "\n");
-                total_read += strlen(de->d_name) + 1;
-            }
-        }
-        strcat(output, "\n");
-        total_read++;
-        strcat(message, "index ");
-        sprintf(message + strlen(message), "%lu\n", total_read);
-        log_append(input, message);
+        perror("epoll_ctl");
+        exit(1);
     }
-    else if ((strcmp(*(input + 1), "server")) == 0 || 
-        (strcmp(*(input + 1), "client")) == 0)
+    io_attach(w);
+    if (w->io_efd != -1)
     {
-        strcat(message, *(input + 1));
-        strcat(message, " NOT_ALLOWED\n");
-        log_append(input, message);
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = &w->io_efd; // marks the I/O pool's completions
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, w->io_efd, &ev) == -1)
+        {
+            perror("epoll_ctl");
+            exit(1);
+        }
     }
-    else if (strcmp(*(input + 1), "log") == 0)
+    signal(SIGPIPE, SIG_IGN);
+
+    while (1)
     {
-        if ((fd = open("log.log", O_RDONLY)) == -1)
+        // wake up every second at least, for the timeout sweep
+        if ((n = epoll_wait(epfd, events, MAX_EVENTS, 1000)) == -1)
         {
-            file_found = 1;
-            log_append(input, "log 0\n");
-            return (output);
+            if (errno != EINTR)
+            {
+                perror("epoll_wait");
+            }
+            continue;
         }
-        file_found = 1;
-        curr_pos = lseek(fd, (size_t)0, SEEK_CUR);
-        file_size = lseek(fd, 0L, SEEK_END);
-        lseek(fd, curr_pos, SEEK_SET); 
-        if ((output = realloc(output, file_size + 10)) == NULL)
+        if (stats_now() - swept >= 1000000000)
         {
-            fprintf(stderr, "realloc() failed in line"
-            "%d\n", __LINE__);
-            exit(EXIT_FAILURE);
+            conn_sweep(w);
+            swept = stats_now();
         }
-        finfo->bufsize = file_size + 10;
-        while (total_read < file_size)
+        for (i = 0; i < n; i++)
         {
-            if ((read_bytes = read(fd, ((char *)output) + total_read, 1024)) 
-                < 0)
-            {
-                log_append(input, "NOT_READABLE\n");
-            }
-            else 
+            if ((conn = events[i].data.ptr) == NULL)
             {
-                total_read = total_read + read_bytes;
+                accept_connections(epfd, w);
+                continue;
             }
-        }
-        strcat(output, " ");
-        sprintf(message, "log %lu\n", total_read);
-        log_append(input, message);
-    } 
-    else 
-    {
-        file_found = 0;
-        while ((de = readdir(dr)) != NULL)
-        {
-            if (strcmp(de->d_name, *(input + 1)) == 0)
+            if (events[i].data.ptr == &w->io_efd)
             {
-                if ((strcspn(de->d_name, reject) != strlen(de->d_name)) ||
-                    (de->d_name[0] == '.'))
-                {
-                    log_append(input, "BAD_FILENAME\n");
-                    return (output);
-                }
-
-                if ((fd = open(de->d_name, O_RDONLY)) == -1)
-                {
-                    file_found = 1;
-                    log_append(input, "NOT_READABLE\n");
-                }
-                else
-                {
-                    file_found = 1;
-                    curr_pos = lseek(fd, (size_t)0, SEEK_CUR);
-                    file_size = lseek(fd, 0L, SEEK_END);
-                    lseek(fd, curr_pos, SEEK_SET); 
-                    
-                    if (finfo->bufsize <= file_size)
-                    {
-                        if ((output = 
-                                realloc(output, file_size + 10)) == NULL)
-                        {
-                            fprintf(stderr, "realloc() failed in line"
-                            "%d\n", __LINE__);
-                            exit(EXIT_FAILURE);
-                        }
-                        finfo->bufsize = file_size + 10;
-                    }
-                    while (total_read < file_size)
-                    {
-                        if ((read_bytes = 
-                            read(fd, ((char *)output) + total_read, 1024)) 
-                            < 0)
-                        {
-                            log_append(input, "NOT_READABLE\n");
-                        }
-                        else 
-                        {
-                            total_read = total_read + read_bytes;
-                        }
-                    }
-                    strcat(output, " ");
-                    
-                    if (total_read < 1000)
-                    {
-                        sprintf(message, "%lu\n", total_read);
-                    }
-                    else 
-                    {
-                        strcat(message, "bigfile ");
-                        sprintf(message + strlen(message), "%lu\n", 
-                            total_read);
-                        log_append(input, message);
-                    }
-                    log_append(input, message);
-                }
+                io_ready = 1;
+                continue;
             }
+            conn_step(conn);
+            epoll_settle(epfd, conn);
         }
-        if (!file_found)
+        // after the batch: closing one of these would leave its events in
+        // there dangling, while a connection in CONN_IO never gets closed
+        for (job = io_ready ? io_collect(w) : NULL; job != NULL; job = next)
         {
-            log_append(input, "NOT_FOUND\n");
+            next = job->next;
+            conn = job->conn;
+            conn_io_done(conn);
+            conn_step(conn);
+            epoll_settle(epfd, conn);
         }
-        close(fd);
-    } 
-    return (output);
+        io_ready = 0;
+    }
 }
 
-void *tokenize(char *buffer)
+/* epoll_settle -- after a step, hand a follower off or close what's done */
+void epoll_settle(int epfd, connection *conn)
 {
-    char **token;
-    char *tmp;
-    int i = 0;
-
-    if ((token = malloc(1010101010 * sizeof(char))) == NULL)
+    if (conn->state == CONN_FOLLOW)
     {
-        fprintf(stderr, "malloc() failed in line %d\n", __LINE__);
-        exit(EXIT_FAILURE);
+        // the follower blocks, it can't stay in this loop
+        epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+        conn_retire(conn);
     }
-    tmp = strtok(buffer, " ");
-    while (tmp != NULL)
+    else if (conn->state == CONN_DONE)
     {
-        tmp = strtok(NULL, " ");
-        *(token + i) = tmp;
-        i++;
+        conn_close(conn);
     }
-    tmp = strchr(*token, ':');
-    strcat(finfo.client_ip_addr, tmp);
-
-    return (token);
 }
 
-void log_append(char **request, char* message)
+/* serve_workers -- n threads, each with its own SO_REUSEPORT listener and
+ * event loop; nothing is shared between them on the request path. */
+void serve_workers(char *port, int n)
 {
-    char date[200];
-    int fd, hr, min, sec, dd, mm, yy; 
-    time_t now;
-    time(&now);
-    struct tm *local = localtime(&now);
-    
-    hr = local->tm_hour;
-    min = local->tm_min;
-    sec = local->tm_sec;
-    dd = local->tm_mday;
-    mm = local->tm_mon + 1;
-    yy = local->tm_year + 1900;
-    
-    pthread_mutex_lock(&lock); 
-    if ((fd = open("log.log", O_WRONLY | O_APPEND | O_CREAT)) < 0)
+    int i;
+    worker *workers;
+
+    if ((workers = calloc(n, sizeof(worker))) == NULL)
     {
-        chmod("log.log", 0777);
-        if ((fd = open("log.log", O_WRONLY | O_APPEND | O_CREAT)) < 0)
+        fprintf(stderr, "calloc() failed in line %d\n", __LINE__);
+        exit(EXIT_FAILURE);
+    }
+    loop_workers = workers;
+    nloop_workers = n;
+    signal(SIGPIPE, SIG_IGN);
+    for (i = 0; i < n; i++)
+    {
+        workers[i].id = i;
+        workers[i].sockfd = make_listener(port, 1);
+        workers[i].stats = &server_stats.slots[i];
+        workers[i].io_efd = -1;
+        if (pthread_create(&workers[i].thread, NULL, worker_main, 
+                &workers[i]) != 0)
         {
-            fprintf(stderr, "open() failed in line %d\n", __LINE__);
+            fprintf(stderr, "pthread_create() failed in line %d\n", 
+                __LINE__);
             exit(EXIT_FAILURE);
         }
     }
-
-    if (sprintf(date, "[%d-%d-%d %d:%d:%d] ", yy, mm, dd, hr, min, sec) < 0)
+    for (i = 0; i < n; i++)
     {
-        fprintf(stderr, "sprintf() failed in line %d\n", __LINE__);
-        exit(EXIT_FAILURE);
+        pthread_join(workers[i].thread, NULL);
     }
+    free(workers);
+}
 
-    if (write(fd, date, strlen(date)) < 0)
+void *worker_main(void *arg)
+{
+    if (use_uring)
     {
-        fprintf(stderr, "write() failed in line %d\n", __LINE__);
+        serve_uring((worker *)arg);
+        return (NULL);
+    }
+    serve_epoll((worker *)arg);
+
+    return (NULL);
+}
+
+int set_nonblocking(int fd)
+{
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL, 0)) == -1)
+    {
+        return (-1);
+    }
+    return (fcntl(fd, F_SETFL, flags | O_NONBLOCK));
+}
+
+void accept_connections(int epfd, worker *w)
+{
+    int new_fd;
+    struct sockaddr_storage their_addr;
+    struct epoll_event ev;
+    socklen_t sin_size;
+    connection *conn;
+
+    // edge-triggered: drain the accept queue until it would block
+    while (1)
+    {
+        sin_size = sizeof their_addr;
+        new_fd = accept4(w->sockfd, (struct sockaddr *)&their_addr, &sin_size,
+            SOCK_NONBLOCK);
+        if (new_fd == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                perror("accept");
+                stats_add(&w->stats->accept_errors, 1);
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return;
+        }
+
+        if ((conn = conn_new(new_fd, w, &their_addr)) == NULL)
+        {
+            close(new_fd);
+            continue;
+        }
+
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, new_fd, &ev) == -1)
+        {
+            perror("epoll_ctl");
+            conn_close(conn);
+        }
+    }
+}
+
+connection *conn_new(int fd, worker *w, struct sockaddr_storage *addr)
+{
+    connection *conn;
+    int n;
+
+    atomic_fetch_add(&w->nconns, 1);
+    n = conns_open();
+    // past the limit and past what we keep around to say BUSY: just close
+    if (max_conns > 0 && n > max_conns + SHED_MAX)
+    {
+        atomic_fetch_sub(&w->nconns, 1);
+        stats_add(&w->stats->rejected[REJ_CONNS], 1);
+        return (NULL);
+    }
+    if ((conn = calloc(1, sizeof(connection))) == NULL)
+    {
+        fprintf(stderr, "calloc() failed in line %d\n", __LINE__);
+        atomic_fetch_sub(&w->nconns, 1);
+        return (NULL);
+    }
+    if (max_conns > 0 && n > max_conns)
+    {
+        conn->busy = 1;
+        stats_add(&w->stats->rejected[REJ_CONNS], 1);
+    }
+    tune_accepted(fd, &server_tune);
+    conn->last_active = stats_now();
+    conn->next = w->conns;
+    if (w->conns != NULL)
+    {
+        w->conns->prev = conn;
+    }
+    w->conns = conn;
+    conn->fd = fd;
+    conn->owner = w;
+    conn->slot = -1;
+    arena_init(&conn->mem, conn->arena_buf, sizeof conn->arena_buf);
+    file_out_init(&conn->fout);
+    conn->state = use_tls ? CONN_TLS : CONN_RECV;
+    inet_ntop(addr->ss_family, get_in_addr((struct sockaddr *)addr), 
+        conn->client_ip_addr, sizeof conn->client_ip_addr);
+    stats_add(&w->stats->conns_opened, 1);
+
+    return (conn);
+}
+
+/* conns_open -- this process's open connections; every loop counts its
+ * own, so an accept on one never writes to another's cache line */
+int conns_open()
+{
+    int i, n = 0;
+
+    for (i = 0; i < nloop_workers; i++)
+    {
+        n += atomic_load_explicit(&loop_workers[i].nconns, 
+            memory_order_relaxed);
+    }
+
+    return (n);
+}
+
+/* conn_step -- advance conn as far as it goes without blocking: read,
+ * answer every complete request already buffered, send. Returns with the
+ * state telling the caller what to wait for. */
+void conn_step(connection *conn)
+{
+    conn->last_active = stats_now();
+    while (conn->state != CONN_DONE && conn->state != CONN_FOLLOW)
+    {
+        if (conn->state == CONN_TLS)
+        {
+            tls_step(conn);
+            if (conn->state == CONN_TLS)
+            {
+                return; // the handshake waits on the socket
+            }
+            continue;
+        }
+        if (conn->state == CONN_RECV)
+        {
+            conn_recv(conn);
+            if (!conn_process(conn))
+            {
+                if (conn->peer_closed)
+                {
+                    conn->state = CONN_DONE;
+                }
+                return; // need more bytes
+            }
+        }
+        if (conn->state == CONN_IO)
+        {
+            return; // back through conn_io_done() once the pool is done
+        }
+        if (!conn_send(conn))
+        {
+            return; // socket buffer full
+        }
+    }
+}
+
+/* conn_events -- what poll() waits for before conn's next step */
+short conn_events(connection *conn)
+{
+    if (conn->state == CONN_SEND || (conn->state == CONN_TLS && 
+        conn->tls_write))
+    {
+        return (POLLOUT);
+    }
+    return (POLLIN);
+}
+
+/* conn_recv -- read until the socket would block, the buffer is full or
+ * the peer closed its end. */
+void conn_recv(connection *conn)
+{
+    ssize_t nread;
+
+    while (!conn->peer_closed && conn->in_len < sizeof(conn->in_buf))
+    {
+        nread = recv(conn->fd, conn->in_buf + conn->in_len, 
+            sizeof(conn->in_buf) - conn->in_len, 0);
+        if (nread > 0)
+        {
+            conn->in_len += nread;
+            continue;
+        }
+        if (nread == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (nread == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return;
+        }
+        if (nread == -1)
+        {
+            perror("recv");
+        }
+        conn->peer_closed = 1;
+    }
+}
+
+/* conn_process -- if a whole request is buffered, answer it: run it
+ * through tokenize() and parse_input() and queue the reply. A legacy
+ * request is whatever arrived before the socket ran dry, exactly like the
+ * single recv() of the original server. Returns 1 if a reply was queued. */
+int conn_process(connection *conn)
+{
+    uint32_t magic = htonl(FRAME_REQ_MAGIC), id = 0;
+    uint16_t flags = 0;
+    char *payload = conn->in_buf;
+    size_t payload_len = conn->in_len;
+    long used = conn->in_len;
+    request req;
+    file_info *finfo;
+    metrics *m = conn->owner->stats;
+    enum reject_reason why;
+    uint64_t t0;
+
+    if (conn->proto == PROTO_UNKNOWN)
+    {
+        if (conn->in_len < FRAME_REQ_LEN && !conn->peer_closed &&
+            memcmp(conn->in_buf, &magic, conn->in_len) == 0)
+        {
+            return (0); // could still turn out to be a frame
+        }
+        conn->proto = conn->in_len >= 4 && 
+            memcmp(conn->in_buf, &magic, 4) == 0 ? PROTO_FRAMED : 
+            PROTO_LEGACY;
+    }
+    if (conn->proto == PROTO_LEGACY && conn->in_len == 0)
+    {
+        return (0);
+    }
+    if (conn->proto == PROTO_FRAMED)
+    {
+        used = frame_parse(conn->in_buf, conn->in_len, &id, &flags, &payload,
+            &payload_len);
+        if (used == 0)
+        {
+            return (0);
+        }
+        if (used < 0)
+        {
+            conn->peer_closed = 1; // garbage, nothing more makes sense
+            conn->in_len = 0;
+            return (0);
+        }
+    }
+
+    finfo = &conn->owner->finfo;
+    strcpy(finfo->client_ip_addr, conn->client_ip_addr);
+    finfo->client_port[0] = '\0'; // tokenize() has the request's
+    finfo->hashed = 0;
+    finfo->cache_hits = finfo->cache_misses = 0;
+    t0 = stats_now();
+    arena_reset(&conn->mem);
+    if (conn->busy)
+    {
+        conn->out_buf = busy_reply(&conn->mem, finfo);
+    }
+    else if (!rate_check(&client_rates, conn->client_ip_addr, &why))
+    {
+        stats_add(&m->rejected[why], 1);
+        conn->out_buf = busy_reply(&conn->mem, finfo);
+    }
+    else
+    {
+        tokenize(payload, payload_len, &req, finfo);
+        finfo->want_hash = (flags & FRAME_F_HASH) != 0;
+        finfo->may_defer = conn->owner->io_efd != -1;
+        finfo->roots = roots_get();
+        conn->out_buf = parse_input(&req, &conn->mem, finfo);
+        roots_put();
+        finfo->may_defer = 0;
+        if (finfo->deferred)
+        {
+            return (conn_defer(conn, &req, finfo, id, flags, used, t0));
+        }
+    }
+    conn_reply_ready(conn, finfo, id, flags, used, t0);
+
+    return (1);
+}
+
+/* conn_reply_ready -- queue the reply parse_input() put together */
+void conn_reply_ready(connection *conn, file_info *finfo, uint32_t id, 
+    uint16_t flags, long used, uint64_t t0)
+{
+    metrics *m = conn->owner->stats;
+    int zflags = 0;
+    uint64_t h;
+
+    rate_charge(&client_rates, conn->client_ip_addr, 
+        file_out_total(&finfo->fout));
+    conn->fout = finfo->fout;
+    conn->body_len = conn->fout.remaining;
+    conn->send_start = stats_now();
+    stats_latency(m->parse_hist, &m->parse_ns, conn->send_start - t0);
+    stats_add(&m->requests[finfo->cmd], 1);
+    stats_add(&m->replies[finfo->status], 1);
+    if (finfo->cache_hits + finfo->cache_misses > 0)
+    {
+        stats_add(&m->cache_hits, finfo->cache_hits);
+        stats_add(&m->cache_misses, finfo->cache_misses);
+    }
+    if (use_binlog)
+    {
+        binlog_add(conn, finfo, conn->send_start - t0);
+    }
+
+    conn->out_len = strlen(conn->out_buf);
+    conn->out_sent = conn->hdr_sent = 0;
+    conn->hdr_len = 0;
+    tune_cork(conn->fd, &server_tune, 1);
+    if (conn->proto == PROTO_FRAMED)
+    {
+        // the length says where the body ends, no trailing byte needed
+        if (flags & FRAME_F_ZSTD && !conn->fout.follow && 
+            conn->fout.batch == NULL && file_out_compress(&conn->fout))
+        {
+            zflags = FRAME_F_ZSTD;
+        }
+        if (finfo->hashed)
+        {
+            zflags |= FRAME_F_HASH;
+        }
+        // a text reply goes out of out_buf, less the legacy trailing byte
+        conn->out_len = finfo->text_reply ? conn->out_len - 1 : 0;
+        // a followed log has no end, it lasts as long as the connection
+        frame_header(conn->hdr, id, finfo->status, zflags, 
+            conn->fout.z != NULL || conn->fout.follow ? FRAME_LEN_STREAM : 
+            file_out_total(&conn->fout) + conn->out_len);
+        conn->hdr_len = FRAME_RESP_LEN;
+        if (finfo->hashed)
+        {
+            h = htobe64(finfo->hash);
+            memcpy(conn->hdr + FRAME_RESP_LEN, &h, FRAME_HASH_LEN);
+            conn->hdr_len += FRAME_HASH_LEN;
+        }
+    }
+    memmove(conn->in_buf, conn->in_buf + used, conn->in_len - used);
+    conn->in_len -= used;
+    conn->state = CONN_SEND;
+}
+
+/* conn_defer -- park conn in CONN_IO while the I/O pool runs its request;
+ * done right here when the pool's deques are all full */
+int conn_defer(connection *conn, request *req, file_info *finfo, 
+    uint32_t id, uint16_t flags, long used, uint64_t t0)
+{
+    io_job *job = &conn->io;
+
+    job->conn = conn;
+    job->req = *req;
+    job->finfo = *finfo;
+    job->finfo.deferred = 0;
+    job->id = id;
+    job->flags = flags;
+    job->used = used;
+    job->t0 = t0;
+    conn->state = CONN_IO;
+    if (!io_submit(&blocking_io, job))
+    {
+        stats_add(&conn->owner->stats->io_inline, 1);
+        io_run(job);
+        conn_io_done(conn);
+    }
+
+    return (1);
+}
+
+/* conn_io_done -- the I/O pool ran conn's request, queue the reply */
+void conn_io_done(connection *conn)
+{
+    io_job *job = &conn->io;
+    metrics *m = conn->owner->stats;
+
+    stats_latency(m->io_wait_hist, &m->io_wait_ns, 
+        job->started - job->queued);
+    stats_latency(m->io_service_hist, &m->io_service_ns, 
+        job->done - job->started);
+    conn->out_buf = job->out_buf;
+    conn_reply_ready(conn, &job->finfo, job->id, job->flags, job->used, 
+        job->t0);
+}
+
+/* conn_send -- header, then the file body, then whatever parse_input()
+ * left in out_buf. Returns 0 while the socket is full; when the reply is
+ * out, a framed connection goes back to CONN_RECV, a legacy one is done. */
+int conn_send(connection *conn)
+{
+    ssize_t nsent;
+    int rv;
+
+    do
+    {
+        while (conn->hdr_sent < conn->hdr_len)
+        {
+            nsent = send(conn->fd, conn->hdr + conn->hdr_sent,
+                conn->hdr_len - conn->hdr_sent, MSG_NOSIGNAL | 
+                (file_out_pending(&conn->fout) ? MSG_MORE : 0));
+            if (nsent == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (nsent == -1)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    return (0);
+                }
+                perror("send");
+                conn->state = CONN_DONE;
+                return (1);
+            }
+            conn->hdr_sent += nsent;
+        }
+
+        if ((rv = file_out_send(&conn->fout, conn->fd)) == 0)
+        {
+            return (0);
+        }
+        if (rv == -1)
+        {
+            perror("sendfile");
+            conn->state = CONN_DONE;
+            return (1);
+        }
+    } while (conn_next_part(conn));
+
+    while (conn->out_sent < conn->out_len)
+    {
+        nsent = send(conn->fd, conn->out_buf + conn->out_sent,
+            conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        if (nsent == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return (0);
+            }
+            perror("send");
+            break;
+        }
+        conn->out_sent += nsent;
+    }
+
+    conn_reply_done(conn);
+    return (1);
+}
+
+/* conn_next_part -- a get: the next file's part header goes out through
+ * hdr, its body through fout; what was sent of the last one is counted
+ * now, both are reused. 0 when the reply is complete. */
+int conn_next_part(connection *conn)
+{
+    uint64_t sent = conn->hdr_sent + conn->body_len - conn->fout.remaining;
+
+    if (!file_out_next(&conn->fout, conn->hdr))
+    {
+        return (0);
+    }
+    stats_add(&conn->owner->stats->bytes_sent, sent);
+    conn->hdr_len = BATCH_PART_LEN;
+    conn->hdr_sent = 0;
+    conn->body_len = conn->fout.remaining;
+
+    return (1);
+}
+
+/* conn_reply_done -- the reply is out (or failed): count it, then a framed
+ * connection waits for the next request and a legacy one is done. */
+void conn_reply_done(connection *conn)
+{
+    metrics *m = conn->owner->stats;
+
+    stats_add(&m->bytes_sent, conn->hdr_sent + conn->out_sent + 
+        conn->body_len - conn->fout.remaining);
+    stats_latency(m->send_hist, &m->send_ns, stats_now() - conn->send_start);
+    tune_cork(conn->fd, &server_tune, 0); // out it goes, what's left of it
+
+    // a short body would desync the frames that follow it
+    if (conn->busy)
+    {
+        conn->state = CONN_DONE; // said BUSY, that's all it gets
+    }
+    else if (conn->fout.follow && !conn->fout.truncated && 
+        conn->state != CONN_DONE)
+    {
+        conn->state = CONN_FOLLOW; // caught up, now tail the log
+    }
+    else if (conn->proto == PROTO_FRAMED && !conn->fout.truncated && 
+        conn->state != CONN_DONE)
+    {
+        file_out_close(&conn->fout);
+        conn->state = CONN_RECV;
+    }
+    else
+    {
+        conn->state = CONN_DONE;
+    }
+}
+
+/* serve_uring -- the event loop again, but every socket operation is an
+ * io_uring request: one multishot accept, recv into provided buffers,
+ * send, and file bodies as linked file -> pipe -> socket splices, all on
+ * fixed files. One io_uring_enter() submits a batch and waits for the next.
+ * Requests go through the same conn_process() as the other loops. */
+void serve_uring(worker *w)
+{
+    uring ur;
+    unsigned head, tail;
+
+    if (uring_init(&ur) == -1)
+    {
+        fprintf(stderr, "io_uring unavailable (%s), using epoll\n", 
+            strerror(errno));
+        serve_epoll(w);
+        return;
+    }
+    ur.owner = w;
+    signal(SIGPIPE, SIG_IGN);
+    uring_accept(&ur);
+    uring_tick(&ur);
+    io_attach(w);
+    if (w->io_efd != -1)
+    {
+        uring_io_arm(&ur);
+    }
+
+    while (1)
+    {
+        if (uring_enter(&ur, 1) == -1 && errno != EINTR)
+        {
+            perror("io_uring_enter");
+        }
+        head = *ur.cq_head;
+        tail = __atomic_load_n(ur.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+            uring_complete(&ur, &ur.cqes[head & *ur.cq_mask]);
+            head++;
+            __atomic_store_n(ur.cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/* uring_init -- set up the ring, a sparse fixed file table and the
+ * provided buffer ring; -1 with errno if the kernel can't do any of it
+ * (the buffer ring and multishot accept arrived together in 5.19). */
+int uring_init(uring *ur)
+{
+    struct io_uring_params p;
+    struct io_uring_rsrc_register files;
+    struct io_uring_buf_reg reg;
+    size_t sq_len, cq_len;
+    char *sq, *cq;
+    int i;
+
+    memset(ur, 0, sizeof *ur);
+    memset(&p, 0, sizeof p);
+    if ((ur->fd = syscall(__NR_io_uring_setup, UR_ENTRIES, &p)) == -1)
+    {
+        return (-1);
+    }
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | 
+        MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+    cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | 
+        MAP_POPULATE, ur->fd, IORING_OFF_CQ_RING);
+    ur->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), 
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, 
+        IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || ur->sqes == MAP_FAILED)
+    {
+        close(ur->fd);
+        return (-1);
+    }
+    ur->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ur->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ur->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ur->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ur->sq_entries = p.sq_entries;
+    ur->sq_local = *ur->sq_tail;
+    ur->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ur->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ur->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ur->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    memset(&files, 0, sizeof files);
+    files.nr = UR_FILES;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (syscall(__NR_io_uring_register, ur->fd, IORING_REGISTER_FILES2, 
+            &files, sizeof files) == -1)
+    {
+        close(ur->fd);
+        return (-1);
+    }
+
+    ur->br = mmap(NULL, UR_BUFS * sizeof(struct io_uring_buf), PROT_READ | 
+        PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ur->br == MAP_FAILED || (ur->bufs = malloc(UR_BUFS * BUFSIZ)) == NULL)
+    {
+        fprintf(stderr, "malloc() failed in line %d\n", __LINE__);
+        exit(EXIT_FAILURE);
+    }
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (unsigned long)ur->br;
+    reg.ring_entries = UR_BUFS;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, ur->fd, IORING_REGISTER_PBUF_RING, 
+            &reg, 1) == -1)
+    {
+        close(ur->fd);
+        return (-1);
+    }
+    for (i = 0; i < UR_BUFS; i++)
+    {
+        uring_buf_return(ur, i);
+    }
+
+    return (0);
+}
+
+/* uring_sqe -- a zeroed submission entry for an operation on conn, queued
+ * with the next uring_enter() */
+struct io_uring_sqe *uring_sqe(uring *ur, connection *conn, 
+    enum uring_op op)
+{
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    if (ur->sq_local - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) 
+        == ur->sq_entries)
+    {
+        uring_enter(ur, 0); // full, push what we have
+    }
+    idx = ur->sq_local & *ur->sq_mask;
+    sqe = &ur->sqes[idx];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->user_data = (unsigned long)conn | op;
+    ur->sq_array[idx] = idx;
+    ur->sq_local++;
+    if (conn != NULL)
+    {
+        conn->inflight++;
+    }
+
+    return (sqe);
+}
+
+/* uring_enter -- submit everything queued, optionally wait for one
+ * completion */
+int uring_enter(uring *ur, unsigned wait)
+{
+    unsigned n = ur->sq_local - *ur->sq_tail;
+
+    __atomic_store_n(ur->sq_tail, ur->sq_local, __ATOMIC_RELEASE);
+    return (syscall(__NR_io_uring_enter, ur->fd, n, wait, 
+        wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0));
+}
+
+/* uring_complete -- apply one completion to its connection and, once
+ * nothing of it is in flight any more, move the connection along */
+void uring_complete(uring *ur, struct io_uring_cqe *cqe)
+{
+    connection *conn = (connection *)(unsigned long)(cqe->user_data & ~7UL);
+    enum uring_op op = cqe->user_data & 7;
+    int res = cqe->res;
+    struct io_uring_sqe *sqe;
+    file_out *fo;
+    io_job *job, *next;
+
+    if (op == UR_ACCEPT)
+    {
+        uring_accept_done(ur, cqe);
+        return;
+    }
+    if (conn == NULL && op == UR_RECV)
+    {
+        // the I/O pool finished something
+        for (job = io_collect(ur->owner); job != NULL; job = next)
+        {
+            next = job->next;
+            conn_io_done(job->conn);
+            uring_step(ur, job->conn);
+        }
+        uring_io_arm(ur);
+        return;
+    }
+    if (conn == NULL)
+    {
+        // the once a second timeout, no connection of its own
+        conn_sweep(ur->owner);
+        uring_tick(ur);
+        return;
+    }
+    fo = &conn->fout;
+    conn->inflight--;
+    if (res > 0)
+    {
+        conn->last_active = stats_now();
+    }
+    switch (op)
+    {
+    case UR_RECV:
+        if (res > 0)
+        {
+            memcpy(conn->in_buf + conn->in_len, ur->bufs + 
+                (cqe->flags >> IORING_CQE_BUFFER_SHIFT) * BUFSIZ, res);
+            conn->in_len += res;
+        }
+        else if (res != -ENOBUFS) // out of buffers just means try again
+        {
+            conn->peer_closed = 1;
+        }
+        if (cqe->flags & IORING_CQE_F_BUFFER)
+        {
+            uring_buf_return(ur, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        break;
+    case UR_SEND:
+        if (res < 0)
+        {
+            conn->state = CONN_DONE;
+        }
+        else if (conn->hdr_sent < conn->hdr_len)
+        {
+            conn->hdr_sent += res;
+        }
+        else
+        {
+            conn->out_sent += res;
+        }
+        break;
+    case UR_BODY:
+        if (res == -EFAULT && fo->z == NULL && fo->ce != NULL && 
+            fo->ce->mapped)
+        {
+            fo->remaining = 0; // the mapped file shrank under us
+            fo->truncated = 1;
+        }
+        else if (res < 0)
+        {
+            conn->state = CONN_DONE;
+        }
+        else if (fo->z != NULL)
+        {
+            fo->z->out_sent += res;
+        }
+        else
+        {
+            fo->off += res;
+            fo->remaining -= res;
+        }
+        break;
+    case UR_SPLICE_IN:
+        if (res > 0)
+        {
+            fo->off += res;
+            fo->remaining -= res;
+            fo->in_pipe += res;
+            break;
+        }
+        if (res < 0)
+        {
+            conn->state = CONN_DONE; // the linked splice out is cancelled
+            break;
+        }
+        // the file shrank: nothing will ever reach the pipe, so the linked
+        // splice out would wait forever
+        fo->remaining = 0;
+        fo->truncated = 1;
+        sqe = uring_sqe(ur, conn, UR_OTHER);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (unsigned long)conn | UR_SPLICE_OUT;
+        break;
+    case UR_SPLICE_OUT:
+        if (res > 0)
+        {
+            fo->in_pipe -= res;
+        }
+        // a short splice in (a range that starts mid-page doesn't fit the
+        // pipe) breaks the link too: what it did get goes out next step
+        else if (!fo->truncated && (res != -ECANCELED || fo->in_pipe == 0))
+        {
+            conn->state = CONN_DONE;
+        }
+        break;
+    case UR_CLOSE:
+        conn_retire(conn);
+        return;
+    default:
+        break;
+    }
+    if (conn->inflight == 0)
+    {
+        uring_step(ur, conn);
+    }
+}
+
+/* uring_accept -- (re)arm the multishot accept on the listener */
+void uring_accept(uring *ur)
+{
+    struct io_uring_sqe *sqe = uring_sqe(ur, NULL, UR_ACCEPT);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ur->owner->sockfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+/* uring_tick -- complete (with no connection) a second from now */
+void uring_tick(uring *ur)
+{
+    struct io_uring_sqe *sqe = uring_sqe(ur, NULL, UR_OTHER);
+
+    ur->tick.tv_sec = 1;
+    ur->tick.tv_nsec = 0;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long)&ur->tick;
+    sqe->len = 1;
+}
+
+/* uring_io_arm -- complete (with no connection) when the I/O pool signals */
+void uring_io_arm(uring *ur)
+{
+    struct io_uring_sqe *sqe = uring_sqe(ur, NULL, UR_RECV);
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = ur->owner->io_efd;
+    sqe->addr = (unsigned long)&ur->io_count;
+    sqe->len = sizeof ur->io_count;
+}
+
+/* uring_accept_done -- a new connection: put its socket in the fixed file
+ * table, linked ahead of the first recv so that already sees it there */
+void uring_accept_done(uring *ur, struct io_uring_cqe *cqe)
+{
+    struct sockaddr_storage their_addr;
+    socklen_t sin_size = sizeof their_addr;
+    struct io_uring_sqe *sqe;
+    connection *conn;
+    int fd = cqe->res;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        uring_accept(ur);
+    }
+    if (fd < 0)
+    {
+        if (fd != -EAGAIN && fd != -EINTR)
+        {
+            stats_add(&ur->owner->stats->accept_errors, 1);
+        }
+        return;
+    }
+    // multishot accept shares one address buffer, so ask afterwards
+    if (getpeername(fd, (struct sockaddr *)&their_addr, &sin_size) == -1 ||
+        (conn = conn_new(fd, ur->owner, &their_addr)) == NULL)
+    {
+        close(fd);
+        return;
+    }
+    if (fd < UR_FILES)
+    {
+        conn->slot_fd = fd;
+        sqe = uring_sqe(ur, conn, UR_OTHER);
+        sqe->opcode = IORING_OP_FILES_UPDATE;
+        sqe->addr = (unsigned long)&conn->slot_fd;
+        sqe->len = 1;
+        sqe->off = fd;
+        sqe->flags = IOSQE_IO_LINK;
+        conn->slot = fd;
+    }
+    uring_step(ur, conn);
+}
+
+/* uring_step -- conn_step() for the ring: process what's buffered, then
+ * queue the next recv or send, or take the connection down */
+void uring_step(uring *ur, connection *conn)
+{
+    struct io_uring_sqe *sqe;
+
+    while (1)
+    {
+        if (conn->state == CONN_TLS)
+        {
+            tls_step(conn);
+            if (conn->state == CONN_TLS)
+            {
+                uring_poll(ur, conn, conn->tls_write ? POLLOUT : POLLIN);
+                return;
+            }
+            continue;
+        }
+        if (conn->state == CONN_IO)
+        {
+            return; // the I/O pool has it, nothing of ours in flight
+        }
+        if (conn->state == CONN_RECV)
+        {
+            if (conn_process(conn))
+            {
+                continue;
+            }
+            if (!conn->peer_closed)
+            {
+                uring_recv(ur, conn);
+                return;
+            }
+            conn->state = CONN_DONE;
+        }
+        if (conn->state == CONN_SEND)
+        {
+            if (uring_send(ur, conn))
+            {
+                return;
+            }
+            conn_reply_done(conn);
+            continue;
+        }
+        break;
+    }
+
+    // CONN_DONE: empty the slot first, the table holds a socket reference
+    if (conn->slot == -1)
+    {
+        conn_retire(conn);
+        return;
+    }
+    conn->slot_fd = -1;
+    sqe = uring_sqe(ur, conn, UR_CLOSE);
+    sqe->opcode = IORING_OP_FILES_UPDATE;
+    sqe->addr = (unsigned long)&conn->slot_fd;
+    sqe->len = 1;
+    sqe->off = conn->slot;
+}
+
+/* uring_poll -- complete once conn's socket is ready for events; the TLS
+ * handshake does its own reads and writes */
+void uring_poll(uring *ur, connection *conn, short events)
+{
+    struct io_uring_sqe *sqe = uring_sqe(ur, conn, UR_OTHER);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    uring_sqe_fd(sqe, conn);
+    sqe->poll32_events = events;
+}
+
+/* uring_sqe_fd -- point sqe at conn's socket, the fixed slot if it has one */
+void uring_sqe_fd(struct io_uring_sqe *sqe, connection *conn)
+{
+    sqe->fd = conn->slot != -1 ? conn->slot : conn->fd;
+    if (conn->slot != -1)
+    {
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+}
+
+void uring_recv(uring *ur, connection *conn)
+{
+    struct io_uring_sqe *sqe = uring_sqe(ur, conn, UR_RECV);
+
+    sqe->opcode = IORING_OP_RECV;
+    uring_sqe_fd(sqe, conn);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->len = sizeof(conn->in_buf) - conn->in_len;
+}
+
+/* uring_send -- queue the next piece of the reply: header, body, out_buf.
+ * Returns 0 when there is nothing left to send. */
+int uring_send(uring *ur, connection *conn)
+{
+    struct io_uring_sqe *sqe;
+    file_out *fo = &conn->fout;
+    size_t len, skew;
+    int size;
+
+    if (conn->hdr_sent == conn->hdr_len && !file_out_pending(fo))
+    {
+        conn_next_part(conn); // a get: on to the next file, if any
+    }
+    if (conn->hdr_sent < conn->hdr_len || 
+        (!file_out_pending(fo) && conn->out_sent < conn->out_len))
+    {
+        sqe = uring_sqe(ur, conn, UR_SEND);
+        sqe->opcode = IORING_OP_SEND;
+        uring_sqe_fd(sqe, conn);
+        if (conn->hdr_sent < conn->hdr_len)
+        {
+            sqe->addr = (unsigned long)(conn->hdr + conn->hdr_sent);
+            sqe->len = conn->hdr_len - conn->hdr_sent;
+            sqe->msg_flags = file_out_pending(fo) ? MSG_MORE : 0;
+        }
+        else
+        {
+            sqe->addr = (unsigned long)(conn->out_buf + conn->out_sent);
+            sqe->len = conn->out_len - conn->out_sent;
+        }
+        return (1);
+    }
+    if (!file_out_pending(fo))
+    {
+        return (0);
+    }
+
+    if (fo->z != NULL)
+    {
+        // compressing on the fly: the next chunk, made right here
+        if (fo->z->out_sent == fo->z->out_len && zstream_fill(fo) == -1)
+        {
+            conn->state = CONN_DONE;
+            return (0);
+        }
+        sqe = uring_sqe(ur, conn, UR_BODY);
+        sqe->opcode = IORING_OP_SEND;
+        uring_sqe_fd(sqe, conn);
+        sqe->addr = (unsigned long)(fo->z->out + fo->z->out_sent);
+        sqe->len = fo->z->out_len - fo->z->out_sent;
+        return (1);
+    }
+    len = fo->remaining < SENDFILE_CHUNK ? fo->remaining : SENDFILE_CHUNK;
+    if (file_out_data(fo) != NULL)
+    {
+        // buffer-mode cache hit: send the cached bytes themselves
+        sqe = uring_sqe(ur, conn, UR_BODY);
+        sqe->opcode = IORING_OP_SEND;
+        uring_sqe_fd(sqe, conn);
+        sqe->addr = (unsigned long)(file_out_data(fo) + fo->off);
+        sqe->len = len;
+        return (1);
+    }
+
+    if (fo->pipefd[0] == -1)
+    {
+        if (pipe2(fo->pipefd, O_CLOEXEC) == -1)
+        {
+            perror("pipe2");
+            conn->state = CONN_DONE;
+            return (0);
+        }
+        fcntl(fo->pipefd[1], F_SETPIPE_SZ, UR_PIPE_SIZE);
+    }
+    if (fo->in_pipe == 0)
+    {
+        // file -> pipe linked to pipe -> socket: one round trip per chunk.
+        // The pipe holds whole pages and a start mid-page takes one more,
+        // so cut the chunk to what fits: a short splice in breaks the link
+        skew = fo->off % sysconf(_SC_PAGESIZE);
+        if ((size = fcntl(fo->pipefd[1], F_GETPIPE_SZ)) > 0 && 
+            (size_t)size < len + skew)
+        {
+            len = size - skew;
+        }
+        sqe = uring_sqe(ur, conn, UR_SPLICE_IN);
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->splice_fd_in = fo->fd;
+        sqe->splice_off_in = fo->off;
+        sqe->fd = fo->pipefd[1];
+        sqe->off = -1;
+        sqe->len = len;
+        sqe->splice_flags = SPLICE_F_MOVE;
+        sqe->flags = IOSQE_IO_LINK;
+    }
+    else
+    {
+        len = fo->in_pipe;
+    }
+    sqe = uring_sqe(ur, conn, UR_SPLICE_OUT);
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->splice_fd_in = fo->pipefd[0];
+    sqe->splice_off_in = -1;
+    uring_sqe_fd(sqe, conn);
+    sqe->off = -1;
+    sqe->len = len;
+    sqe->splice_flags = SPLICE_F_MOVE;
+
+    return (1);
+}
+
+/* uring_buf_return -- hand receive buffer bid back to the kernel */
+void uring_buf_return(uring *ur, int bid)
+{
+    struct io_uring_buf *buf;
+    unsigned short tail = ur->br->tail;
+
+    buf = &ur->br->bufs[tail & (UR_BUFS - 1)];
+    buf->addr = (unsigned long)(ur->bufs + bid * BUFSIZ);
+    buf->len = BUFSIZ;
+    buf->bid = bid;
+    __atomic_store_n(&ur->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* frame_parse -- if buf starts with a complete request frame, point at its
+ * payload and return the frame's total length; 0 if more bytes are needed,
+ * -1 if it isn't a frame or could never fit the receive buffer. */
+long frame_parse(char *buf, size_t len, uint32_t *id, uint16_t *flags,
+    char **payload, size_t *payload_len)
+{
+    uint32_t magic, id_n;
+    uint16_t plen, flags_n;
+
+    if (len < FRAME_REQ_LEN)
+    {
+        return (0);
+    }
+    memcpy(&magic, buf, 4);
+    memcpy(&id_n, buf + 4, 4);
+    memcpy(&flags_n, buf + 8, 2);
+    memcpy(&plen, buf + 10, 2);
+    if (ntohl(magic) != FRAME_REQ_MAGIC || 
+        FRAME_REQ_LEN + ntohs(plen) > BUFSIZ)
+    {
+        return (-1);
+    }
+    if (len < (size_t)FRAME_REQ_LEN + ntohs(plen))
+    {
+        return (0);
+    }
+    *id = ntohl(id_n);
+    *flags = ntohs(flags_n);
+    *payload = buf + FRAME_REQ_LEN;
+    *payload_len = ntohs(plen);
+
+    return (FRAME_REQ_LEN + ntohs(plen));
+}
+
+void frame_header(char *hdr, uint32_t id, int status, int flags, 
+    uint64_t len)
+{
+    uint32_t magic = htonl(FRAME_RESP_MAGIC), hi, lo;
+    uint16_t st = htons(status), fl = htons(flags);
+
+    id = htonl(id);
+    hi = htonl((uint32_t)(len >> 32));
+    lo = htonl((uint32_t)len);
+    memcpy(hdr, &magic, 4);
+    memcpy(hdr + 4, &id, 4);
+    memcpy(hdr + 8, &st, 2);
+    memcpy(hdr + 10, &fl, 2);
+    memcpy(hdr + 12, &hi, 4);
+    memcpy(hdr + 16, &lo, 4);
+}
+
+void conn_close(connection *conn)
+{
+    conn_unlink(conn);
+    stats_add(&conn->owner->stats->conns_closed, 1);
+    close(conn->fd); // also removes it from the epoll set
+    file_out_close(&conn->fout);
+    tls_done(conn);
+    atomic_fetch_sub(&conn->owner->nconns, 1);
+    free(conn);
+}
+
+/* conn_unlink -- take conn off its owner's list */
+void conn_unlink(connection *conn)
+{
+    if (conn->prev != NULL)
+    {
+        conn->prev->next = conn->next;
+    }
+    else if (conn->owner->conns == conn)
+    {
+        conn->owner->conns = conn->next;
+    }
+    if (conn->next != NULL)
+    {
+        conn->next->prev = conn->prev;
+    }
+    conn->prev = conn->next = NULL;
+}
+
+/* conn_sweep -- shut down w's connections that waited too long for a
+ * request, or for room to send their reply in; the loop sees them fail
+ * and closes them as usual */
+void conn_sweep(worker *w)
+{
+    uint64_t now = stats_now(), limit;
+    connection *conn;
+
+    for (conn = w->conns; conn != NULL; conn = conn->next)
+    {
+        if (conn->state == CONN_IO)
+        {
+            continue; // waiting on our own disk, not on the client
+        }
+        limit = conn->state == CONN_SEND ? send_timeout : idle_timeout;
+        if (conn->busy && (limit == 0 || limit > SHED_TIMEOUT))
+        {
+            limit = SHED_TIMEOUT;
+        }
+        if (conn->timed_out || limit == 0 || 
+            now - conn->last_active < limit * 1000000000)
+        {
+            continue;
+        }
+        conn->timed_out = 1;
+        shutdown(conn->fd, SHUT_RDWR);
+        stats_add(&w->stats->rejected[conn->state == CONN_SEND ? REJ_SLOW :
+            REJ_IDLE], 1);
+    }
+}
+
+/* tls_step -- take conn's handshake as far as the socket lets it. Once
+ * it is done the kernel gets the keys and conn goes on to CONN_RECV as if
+ * it had been plaintext all along: nothing of OpenSSL is left on the
+ * request path, and sendfile() and splice() still work. */
+void tls_step(connection *conn)
+{
+#ifdef HAVE_TLS
+    static atomic_int warned;
+    tls_handshake *hs = conn->tls;
+    metrics *m = conn->owner->stats;
+    int rv;
+
+    if (hs == NULL)
+    {
+        if ((hs = conn->tls = calloc(1, sizeof(tls_handshake))) == NULL)
+        {
+            fprintf(stderr, "calloc() failed in line %d\n", __LINE__);
+            conn->state = CONN_DONE;
+            return;
+        }
+        hs->start = stats_now();
+        // io_uring's sockets block, but a handshake must not stop a loop
+        if ((hs->fl = fcntl(conn->fd, F_GETFL)) == -1 ||
+            fcntl(conn->fd, F_SETFL, hs->fl | O_NONBLOCK) == -1 ||
+            (hs->ssl = SSL_new(tls_ctx)) == NULL || 
+            SSL_set_fd(hs->ssl, conn->fd) != 1)
+        {
+            tls_fail(conn);
+            return;
+        }
+        SSL_set_app_data(hs->ssl, hs);
+    }
+    conn->tls_write = 0;
+    if ((rv = SSL_accept(hs->ssl)) != 1)
+    {
+        rv = SSL_get_error(hs->ssl, rv);
+        if (rv == SSL_ERROR_WANT_READ || rv == SSL_ERROR_WANT_WRITE)
+        {
+            conn->tls_write = rv == SSL_ERROR_WANT_WRITE;
+            return;
+        }
+    }
+    else if (tls_offload(hs, conn->fd, TLS_SERVER) == 0 && 
+        fcntl(conn->fd, F_SETFL, hs->fl) != -1)
+    {
+        stats_latency(m->tls_hist, &m->tls_ns, stats_now() - hs->start);
+        tls_done(conn);
+        conn->state = CONN_RECV;
+        return;
+    }
+    else if (atomic_exchange(&warned, 1) == 0)
+    {
+        perror("tls offload"); // the kernel's doing, once is enough
+    }
+#endif
+    tls_fail(conn);
+}
+
+/* tls_fail -- give up on conn's handshake, and so on conn */
+void tls_fail(connection *conn)
+{
+#ifdef HAVE_TLS
+    ERR_clear_error(); // the queue is per thread, and would only grow
+    stats_add(&conn->owner->stats->tls_failures, 1);
+    tls_done(conn);
+#endif
+    conn->state = CONN_DONE;
+}
+
+/* tls_done -- drop conn's handshake state, if it has any */
+void tls_done(connection *conn)
+{
+#ifdef HAVE_TLS
+    if (conn->tls != NULL)
+    {
+        SSL_free(conn->tls->ssl); // the fd is ours, SSL_set_fd() leaves it
+        OPENSSL_cleanse(conn->tls->secret, sizeof conn->tls->secret);
+        free(conn->tls);
+        conn->tls = NULL;
+    }
+#else
+    (void)conn;
+#endif
+}
+
+#ifdef HAVE_TLS
+/* tls_init -- the context every handshake is made from. TLS 1.3 only,
+ * suites the kernel knows, and no session tickets: they are sent after
+ * the handshake, records the kernel would get instead of OpenSSL. Exits
+ * when the kernel can't do TLS, serving plaintext instead would be worse
+ * than not serving. */
+void tls_init(char *cert, char *key)
+{
+    int fd;
+
+    // with the module there, an unconnected socket gets ENOTCONN instead
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+        (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof "tls") == -1 && 
+        errno == ENOENT))
+    {
+        fprintf(stderr, "server: no kernel TLS (modprobe tls)\n");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    if ((tls_ctx = SSL_CTX_new(TLS_server_method())) == NULL ||
+        SSL_CTX_set_min_proto_version(tls_ctx, TLS1_3_VERSION) != 1 ||
+        SSL_CTX_set_ciphersuites(tls_ctx, TLS_SUITES) != 1 ||
+        SSL_CTX_set_num_tickets(tls_ctx, 0) != 1 ||
+        SSL_CTX_use_certificate_chain_file(tls_ctx, cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(tls_ctx, key, SSL_FILETYPE_PEM) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        fprintf(stderr, "server: no TLS with %s and %s\n", cert, key);
+        exit(EXIT_FAILURE);
+    }
+    SSL_CTX_set_keylog_callback(tls_ctx, tls_keylog);
+    use_tls = 1;
+}
+#endif
+
+/* busy_reply -- all a request gets while its client is over a limit */
+void *busy_reply(arena *mem, file_info *finfo)
+{
+    char *output = arena_alloc(mem, OUTPUT_MAX);
+
+    *output = '\0';
+    file_out_init(&finfo->fout);
+    finfo->cmd = CMD_OTHER;
+    finfo->status = ST_BUSY;
+    log_append("BUSY\n", finfo);
+
+    return (output);
+}
+
+void rate_init(rate_table *rt, double req_rate, double byte_rate)
+{
+    int i;
+
+    rt->req_rate = req_rate;
+    rt->byte_rate = byte_rate;
+    if (req_rate <= 0 && byte_rate <= 0)
+    {
+        rt->slots = NULL;
+        return;
+    }
+    rt->slots = mmap(NULL, RATE_SLOTS * sizeof(rate_slot), PROT_READ | 
+        PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (rt->slots == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < RATE_SLOTS; i++)
+    {
+        atomic_flag_clear(&rt->slots[i].lock);
+    }
+}
+
+/* rate_check -- take a request token from ip's bucket; 0 and the reason
+ * if it has none, or has spent more than its bytes already. A bucket holds
+ * one second's worth. */
+int rate_check(rate_table *rt, char *ip, enum reject_reason *why)
+{
+    rate_slot *s;
+    uint64_t now;
+    double dt, cap;
+    int ok = 1;
+
+    if (rt->slots == NULL)
+    {
+        return (1);
+    }
+    s = &rt->slots[name_hash(ip) & (RATE_SLOTS - 1)];
+    now = stats_now();
+    // locks are per slot and only held for these few lines
+    while (atomic_flag_test_and_set_explicit(&s->lock, memory_order_acquire));
+    if (strcmp(s->ip, ip) != 0)
+    {
+        strcpy(s->ip, ip);
+        s->reqs = rt->req_rate > 1 ? rt->req_rate : 1;
+        s->bytes = rt->byte_rate;
+    }
+    else
+    {
+        dt = (now - s->last) / 1e9;
+        cap = rt->req_rate > 1 ? rt->req_rate : 1;
+        s->reqs = s->reqs + dt * rt->req_rate < cap ? 
+            s->reqs + dt * rt->req_rate : cap;
+        s->bytes = s->bytes + dt * rt->byte_rate < rt->byte_rate ? 
+            s->bytes + dt * rt->byte_rate : rt->byte_rate;
+    }
+    s->last = now;
+    if (rt->req_rate > 0 && s->reqs < 1)
+    {
+        *why = REJ_RATE;
+        ok = 0;
+    }
+    else if (rt->byte_rate > 0 && s->bytes <= 0)
+    {
+        *why = REJ_BYTES;
+        ok = 0;
+    }
+    else
+    {
+        s->reqs -= 1;
+    }
+    atomic_flag_clear_explicit(&s->lock, memory_order_release);
+
+    return (ok);
+}
+
+/* rate_charge -- bill ip for a body; it may go into debt, which keeps its
+ * next requests out until the bucket has refilled past zero */
+void rate_charge(rate_table *rt, char *ip, size_t bytes)
+{
+    rate_slot *s;
+
+    if (rt->slots == NULL || rt->byte_rate <= 0 || bytes == 0)
+    {
+        return;
+    }
+    s = &rt->slots[name_hash(ip) & (RATE_SLOTS - 1)];
+    while (atomic_flag_test_and_set_explicit(&s->lock, memory_order_acquire));
+    if (strcmp(s->ip, ip) == 0)
+    {
+        s->bytes -= bytes;
+    }
+    atomic_flag_clear_explicit(&s->lock, memory_order_release);
+}
+
+/* rate_admit -- rate_check() and rate_charge() in one, for the limits of
+ * a root, which only see the requests that name something in it */
+int rate_admit(rate_table *rt, char *ip, size_t bytes)
+{
+    enum reject_reason why;
+
+    if (!rate_check(rt, ip, &why))
+    {
+        return (0);
+    }
+    rate_charge(rt, ip, bytes);
+
+    return (1);
+}
+
+/* hash_init -- the content hash table, shared so forked children fill
+ * it for each other */
+void hash_init()
+{
+    int i;
+
+    content_hashes = mmap(NULL, HASH_SLOTS * sizeof(hash_slot), PROT_READ |
+        PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (content_hashes == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < HASH_SLOTS; i++)
+    {
+        atomic_flag_clear(&content_hashes[i].lock);
+    }
+}
+
+/* hash_lookup -- *h is the hash of id's content, if it is known */
+int hash_lookup(file_id *id, uint64_t *h)
+{
+    hash_slot *s;
+    int found;
+
+    s = &content_hashes[xxh_round(id->dev, id->ino) & (HASH_SLOTS - 1)];
+    while (atomic_flag_test_and_set_explicit(&s->lock, memory_order_acquire));
+    if ((found = memcmp(&s->id, id, sizeof(file_id)) == 0))
+    {
+        *h = s->hash;
+    }
+    atomic_flag_clear_explicit(&s->lock, memory_order_release);
+
+    return (found);
+}
+
+void hash_store(file_id *id, uint64_t h)
+{
+    hash_slot *s;
+
+    s = &content_hashes[xxh_round(id->dev, id->ino) & (HASH_SLOTS - 1)];
+    while (atomic_flag_test_and_set_explicit(&s->lock, memory_order_acquire));
+    s->id = *id;
+    s->hash = h;
+    atomic_flag_clear_explicit(&s->lock, memory_order_release);
+}
+
+/* content_hash -- *h is the XXH64 of fo's whole file, id. Known ones cost
+ * a lookup and cached bodies no syscall; otherwise the file is read once,
+ * unless may_block is 0. Returns 1, 0 for "would block", -1 when the file
+ * came up short, being changed under us. */
+int content_hash(file_out *fo, file_id *id, uint64_t *h, int may_block)
+{
+    xxh64_state st;
+    char *buf;
+    uint64_t got = 0;
+    ssize_t n;
+    sigjmp_buf env;
+
+    if (hash_lookup(id, h))
+    {
+        return (1);
+    }
+    if (fo->ce != NULL && fo->ce->data != NULL)
+    {
+        if (fo->ce->mapped)
+        {
+            if (sigsetjmp(env, 1) != 0)
+            {
+                map_fault = NULL;
+                return (-1);
+            }
+            map_fault = &env;
+        }
+        *h = xxh64(fo->ce->data, fo->ce->size);
+        map_fault = NULL;
+    }
+    else if (!may_block)
+    {
+        return (0);
+    }
+    else
+    {
+        if ((buf = malloc(HASH_CHUNK)) == NULL)
+        {
+            fprintf(stderr, "malloc() failed in line %d\n", __LINE__);
+            exit(EXIT_FAILURE);
+        }
+        xxh64_init(&st);
+        while (got < id->size && (n = pread(fo->fd, buf, 
+            id->size - got < HASH_CHUNK ? id->size - got : HASH_CHUNK, 
+            got)) > 0)
+        {
+            xxh64_update(&st, buf, n);
+            got += n;
+        }
+        free(buf);
+        if (got != id->size)
+        {
+            return (-1);
+        }
+        *h = xxh64_digest(&st);
+    }
+    hash_store(id, *h);
+
+    return (1);
+}
+
+void file_id_of(file_id *id, struct stat *st)
+{
+    memset(id, 0, sizeof(file_id));
+    id->dev = st->st_dev;
+    id->ino = st->st_ino;
+    id->size = st->st_size;
+    id->mtime = st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+}
+
+/* io_pool_init -- start n threads for the file work that may block: cold
+ * opens, stats and reads, the log's line counting. Each has a deque of
+ * its own, fed round robin; a thread stuck on a slow disk has its backlog
+ * stolen by the others. */
+void io_pool_init(io_pool *p, int n)
+{
+    int i;
+    pthread_t thread;
+
+    if ((p->deques = calloc(n, sizeof(io_deque))) == NULL)
+    {
+        fprintf(stderr, "calloc() failed in line %d\n", __LINE__);
+        exit(EXIT_FAILURE);
+    }
+    p->nthreads = n;
+    atomic_init(&p->next, 0);
+    atomic_init(&p->queued, 0);
+    pthread_mutex_init(&p->idle_lock, NULL);
+    pthread_cond_init(&p->idle, NULL);
+    for (i = 0; i < n; i++)
+    {
+        pthread_mutex_init(&p->deques[i].lock, NULL);
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (pthread_create(&thread, NULL, io_main, &p->deques[i]) != 0)
+        {
+            fprintf(stderr, "pthread_create() failed in line %d\n", 
+                __LINE__);
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+}
+
+/* io_attach -- give w's loop the eventfd the pool signals it with */
+void io_attach(worker *w)
+{
+    w->io_efd = -1;
+    atomic_init(&w->io_done, NULL);
+    if (blocking_io.deques == NULL)
+    {
+        return;
+    }
+    if ((w->io_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+    {
+        perror("eventfd"); // no pool for this loop then
+    }
+}
+
+/* io_submit -- queue job on the next deque with room; 0 when all are full */
+int io_submit(io_pool *p, io_job *job)
+{
+    unsigned start = atomic_fetch_add(&p->next, 1), i;
+    io_deque *d;
+
+    job->queued = stats_now();
+    for (i = 0; i < (unsigned)p->nthreads; i++)
+    {
+        d = &p->deques[(start + i) % p->nthreads];
+        pthread_mutex_lock(&d->lock);
+        if (d->tail - d->head < IO_DEQUE_SIZE)
+        {
+            d->jobs[d->tail++ & (IO_DEQUE_SIZE - 1)] = job;
+            pthread_mutex_unlock(&d->lock);
+            atomic_fetch_add(&p->queued, 1);
+            pthread_mutex_lock(&p->idle_lock);
+            pthread_cond_signal(&p->idle);
+            pthread_mutex_unlock(&p->idle_lock);
+            return (1);
+        }
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    return (0);
+}
+
+/* io_take -- the oldest job on d, NULL if it has none */
+io_job *io_take(io_deque *d)
+{
+    io_job *job = NULL;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->head != d->tail)
+    {
+        job = d->jobs[d->head++ & (IO_DEQUE_SIZE - 1)];
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return (job);
+}
+
+/* io_main -- a pool thread: its own deque first, then everyone else's */
+void *io_main(void *arg)
+{
+    io_deque *own = arg;
+    io_pool *p = &blocking_io;
+    int me = own - p->deques, i;
+    io_job *job;
+
+    while (1)
+    {
+        job = io_take(own);
+        for (i = 1; job == NULL && i < p->nthreads; i++)
+        {
+            job = io_take(&p->deques[(me + i) % p->nthreads]);
+        }
+        if (job == NULL)
+        {
+            pthread_mutex_lock(&p->idle_lock);
+            while (atomic_load(&p->queued) == 0)
+            {
+                pthread_cond_wait(&p->idle, &p->idle_lock);
+            }
+            pthread_mutex_unlock(&p->idle_lock);
+            continue;
+        }
+        atomic_fetch_sub(&p->queued, 1);
+        io_run(job);
+        io_complete(job);
+    }
+
+    return (NULL);
+}
+
+/* io_run -- parse_input() again, this time it may block. The connection
+ * is parked in CONN_IO, nothing else touches its buffers meanwhile. */
+void io_run(io_job *job)
+{
+    connection *conn = job->conn;
+
+    job->started = stats_now();
+    arena_reset(&conn->mem);
+    job->finfo.roots = roots_get(); // maybe newer ones than on the loop
+    job->out_buf = parse_input(&job->req, &conn->mem, &job->finfo);
+    roots_put();
+    job->done = stats_now();
+}
+
+/* io_complete -- hand job back to its connection's loop */
+void io_complete(io_job *job)
+{
+    worker *w = job->conn->owner;
+    uint64_t one = 1;
+
+    job->next = atomic_load(&w->io_done);
+    while (!atomic_compare_exchange_weak(&w->io_done, &job->next, job));
+    if (write(w->io_efd, &one, sizeof one) == -1)
+    {
+        perror("write"); // can only be a full counter, it's readable then
+    }
+}
+
+/* io_collect -- the jobs finished for w's loop, oldest first */
+io_job *io_collect(worker *w)
+{
+    uint64_t n;
+    io_job *job, *next, *done = NULL;
+
+    // drain the counter before taking the list, a later job signals anew
+    if (read(w->io_efd, &n, sizeof n) == -1 && errno != EAGAIN)
+    {
+        perror("read");
+    }
+    for (job = atomic_exchange(&w->io_done, NULL); job != NULL; job = next)
+    {
+        next = job->next;
+        job->next = done;
+        done = job;
+    }
+
+    return (done);
+}
+
+/* conn_retire -- a loop is done with conn: close it, or if it follows the
+ * log hand it to a thread of its own */
+void conn_retire(connection *conn)
+{
+    metrics *m = conn->owner->stats;
+    pthread_t thread;
+
+    if (conn->state != CONN_FOLLOW)
+    {
+        conn_close(conn);
+        return;
+    }
+    conn_unlink(conn); // no timeouts for a follower
+    if (pthread_create(&thread, NULL, follow_main, conn) != 0)
+    {
+        conn_close(conn);
+        return;
+    }
+    pthread_detach(thread);
+    // off this loop's books, the thread never touches its counters (nor
+    // conn from here on, it may be gone already)
+    stats_add(&m->conns_closed, 1);
+}
+
+void *follow_main(void *arg)
+{
+    connection *conn = arg;
+
+    log_follow(conn);
+    close(conn->fd);
+    file_out_close(&conn->fout);
+    atomic_fetch_sub(&conn->owner->nconns, 1);
+    free(conn);
+
+    return (NULL);
+}
+
+void file_out_init(file_out *fo)
+{
+    fo->fd = -1;
+    fo->ce = NULL;
+    fo->off = 0;
+    fo->remaining = 0;
+    fo->use_splice = 0;
+    fo->pipefd[0] = fo->pipefd[1] = -1;
+    fo->in_pipe = 0;
+    fo->truncated = 0;
+    fo->zpre = 0;
+    fo->z = NULL;
+    fo->follow = 0;
+    fo->batch = NULL;
+}
+
+/* file_out_send -- push the file body to sock with sendfile(), or with
+ * splice() through a pipe when the file system can't sendfile. Safe to call
+ * again after a partial send: returns 1 when done, 0 when sock would block
+ * and -1 on error. */
+int file_out_send(file_out *fo, int sock)
+{
+    ssize_t n;
+    size_t len;
+    char *data;
+
+    while (fo->z != NULL)
+    {
+        if (fo->z->out_sent == fo->z->out_len)
+        {
+            if (fo->z->done)
+            {
+                return (1);
+            }
+            if (zstream_fill(fo) == -1)
+            {
+                return (-1);
+            }
+            continue;
+        }
+        n = send(sock, fo->z->out + fo->z->out_sent, 
+            fo->z->out_len - fo->z->out_sent, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1)
+        {
+            return ((errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1);
+        }
+        fo->z->out_sent += n;
+    }
+
+    while (fo->remaining > 0 || fo->in_pipe > 0)
+    {
+        len = fo->remaining < SENDFILE_CHUNK ? fo->remaining : SENDFILE_CHUNK;
+        if ((data = file_out_data(fo)) != NULL)
+        {
+            // buffer-mode cache hit: straight from the cached bytes
+            n = send(sock, data + fo->off, len, MSG_NOSIGNAL);
+            if (n == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n == -1 && errno == EFAULT && fo->ce->mapped)
+            {
+                fo->remaining = 0; // the mapped file shrank under us
+                fo->truncated = 1;
+                break;
+            }
+            if (n == -1)
+            {
+                return ((errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1);
+            }
+            fo->off += n;
+            fo->remaining -= n;
+            continue;
+        }
+        if (!fo->use_splice)
+        {
+            n = sendfile(sock, fo->fd, &fo->off, len);
+            if (n > 0)
+            {
+                fo->remaining -= n;
+                continue;
+            }
+            if (n == 0)
+            {
+                fo->remaining = 0; // file shrank under us
+                fo->truncated = 1;
+                break;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return (0);
+            }
+            if (errno != EINVAL && errno != ENOSYS)
+            {
+                return (-1);
+            }
+            fo->use_splice = 1;
+            continue;
+        }
+
+        if (fo->in_pipe == 0)
+        {
+            if (fo->pipefd[0] == -1 && pipe2(fo->pipefd, O_NONBLOCK) == -1)
+            {
+                return (-1);
+            }
+            n = splice(fo->fd, &fo->off, fo->pipefd[1], NULL, len,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n == -1)
+            {
+                return (-1);
+            }
+            if (n == 0)
+            {
+                fo->remaining = 0;
+                fo->truncated = 1;
+                break;
+            }
+            fo->remaining -= n;
+            fo->in_pipe = n;
+        }
+        n = splice(fo->pipefd[0], NULL, sock, NULL, fo->in_pipe, 
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return (0);
+            }
+            return (-1);
+        }
+        fo->in_pipe -= n;
+    }
+
+    return (1);
+}
+
+void file_out_close(file_out *fo)
+{
+    batch *b = fo->batch;
+
+    if (b != NULL)
+    {
+        while (b->next < b->nparts)
+        {
+            file_out_close(&b->parts[b->next++].fo);
+        }
+        free(b);
+    }
+    if (fo->z != NULL)
+    {
+#ifdef HAVE_ZSTD
+        ZSTD_freeCCtx(fo->z->cctx);
+#endif
+        free(fo->z->in);
+        free(fo->z->out);
+        free(fo->z);
+    }
+    if (fo->ce != NULL)
+    {
+        cache_release(fo->ce); // the fd, if any, belongs to the entry
+    }
+    else if (fo->fd != -1)
+    {
+        close(fo->fd);
+    }
+    if (fo->pipefd[0] != -1)
+    {
+        close(fo->pipefd[0]);
+        close(fo->pipefd[1]);
+    }
+    file_out_init(fo);
+}
+
+void file_out_from_cache(file_out *fo, cache_entry *ce)
+{
+    fo->ce = ce;
+    fo->fd = ce->fd;
+    fo->off = 0;
+    fo->remaining = ce->size;
+}
+
+/* file_out_next -- a get: swap the body just sent for the next part's and
+ * put its header in hdr. 0 when there is none, or when a file shrank: the
+ * parts after it couldn't be told apart anymore. */
+int file_out_next(file_out *fo, char *hdr)
+{
+    batch *b = fo->batch;
+    batch_part *part;
+    int pipefd[2], use_splice = fo->use_splice;
+    uint16_t status, reserved = 0;
+    uint32_t hi, lo;
+
+    if (b == NULL || b->next == b->nparts || fo->truncated)
+    {
+        return (0);
+    }
+    // the pipe, if any, is empty by now and good for the next file too
+    pipefd[0] = fo->pipefd[0];
+    pipefd[1] = fo->pipefd[1];
+    fo->pipefd[0] = fo->pipefd[1] = -1;
+    fo->batch = NULL;
+    file_out_close(fo);
+
+    part = &b->parts[b->next++];
+    *fo = part->fo;
+    file_out_init(&part->fo); // fo has it now
+    fo->batch = b;
+    fo->pipefd[0] = pipefd[0];
+    fo->pipefd[1] = pipefd[1];
+    fo->use_splice = use_splice;
+
+    status = htons(part->status);
+    hi = htonl((uint64_t)fo->remaining >> 32);
+    lo = htonl(fo->remaining & 0xffffffff);
+    memcpy(hdr, &status, 2);
+    memcpy(hdr + 2, &reserved, 2);
+    memcpy(hdr + 4, &hi, 4);
+    memcpy(hdr + 8, &lo, 4);
+
+    return (1);
+}
+
+/* file_out_total -- the body's length as queued, all of a get's parts */
+uint64_t file_out_total(file_out *fo)
+{
+    return (fo->batch != NULL ? fo->batch->total : fo->remaining);
+}
+
+/* file_out_pending -- is any of the body still to go? */
+int file_out_pending(file_out *fo)
+{
+    if (fo->z != NULL)
+    {
+        return (!fo->z->done || fo->z->out_sent < fo->z->out_len);
+    }
+    return (fo->remaining > 0 || fo->in_pipe > 0);
+}
+
+/* file_out_data -- the body's bytes if they are in memory, else NULL */
+char *file_out_data(file_out *fo)
+{
+    if (fo->ce == NULL)
+    {
+        return (NULL);
+    }
+    return (fo->zpre ? fo->ce->zdata : fo->ce->data);
+}
+
+/* file_out_compress -- switch fo to a zstd body: the cache entry's
+ * precompressed copy when it has one (making it on first use), otherwise
+ * compression on the fly. Returns 0, leaving fo as it was, for bodies too
+ * small to bother, copies that didn't shrink, or a build without zstd. */
+int file_out_compress(file_out *fo)
+{
+#ifdef HAVE_ZSTD
+    zstream *z;
+
+    if (fo->remaining < Z_MIN)
+    {
+        return (0);
+    }
+    // only a whole body can use the copy, ranges are compressed afresh
+    if (fo->ce != NULL && fo->off == 0 && fo->remaining == fo->ce->size)
+    {
+        if (atomic_load(&fo->ce->zstate) == 0)
+        {
+            cache_precompress(fo->ce);
+        }
+        switch (atomic_load(&fo->ce->zstate))
+        {
+        case 1:
+            fo->zpre = 1;
+            fo->remaining = fo->ce->zsize;
+            return (1);
+        case -1:
+            return (0);
+        }
+    }
+
+    if ((z = calloc(1, sizeof(zstream))) == NULL || 
+        (z->cctx = ZSTD_createCCtx()) == NULL ||
+        (z->out = malloc(4 + ZSTD_compressBound(Z_CHUNK) + 4)) == NULL ||
+        (file_out_data(fo) == NULL && (z->in = malloc(Z_CHUNK)) == NULL))
+    {
+        fprintf(stderr, "malloc() failed in line %d\n", __LINE__);
+        exit(EXIT_FAILURE);
+    }
+    ZSTD_CCtx_setParameter(z->cctx, ZSTD_c_compressionLevel, Z_LEVEL);
+    fo->z = z;
+    return (1);
+#else
+    (void)fo;
+    return (0);
+#endif
+}
+
+/* zstream_fill -- compress the next Z_CHUNK of the body into z->out as one
+ * chunk, plus the end marker after the last. -1 on error. */
+int zstream_fill(file_out *fo)
+{
+#ifdef HAVE_ZSTD
+    zstream *z = fo->z;
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    uint32_t len;
+    size_t rv;
+    ssize_t n;
+    char *data;
+    sigjmp_buf env;
+
+    n = fo->remaining < Z_CHUNK ? fo->remaining : Z_CHUNK;
+    if ((data = file_out_data(fo)) != NULL)
+    {
+        in.src = data + fo->off;
+    }
+    else
+    {
+        while ((n = pread(fo->fd, z->in, n, fo->off)) == -1 && errno == EINTR)
+            ;
+        if (n == -1)
+        {
+            return (-1);
+        }
+        in.src = z->in;
+    }
+    if (n == 0 && fo->remaining > 0)
+    {
+        fo->remaining = 0; // file shrank under us
+        fo->truncated = 1;
+    }
+    fo->off += n;
+    fo->remaining -= n;
+    in.size = n;
+    in.pos = 0;
+    out.dst = z->out + 4;
+    out.size = ZSTD_compressBound(Z_CHUNK);
+    out.pos = 0;
+    if (fo->ce != NULL && fo->ce->mapped)
+    {
+        if (sigsetjmp(env, 1) != 0)
+        {
+            // the file shrank, the compressor's state is lost with the page
+            map_fault = NULL;
+            fo->remaining = 0;
+            fo->truncated = 1;
+            return (-1);
+        }
+        map_fault = &env;
+    }
+    // the bound fits a whole chunk, so one call flushes it all
+    rv = ZSTD_compressStream2(z->cctx, &out, &in, 
+        fo->remaining == 0 ? ZSTD_e_end : ZSTD_e_flush);
+    map_fault = NULL;
+    if (ZSTD_isError(rv) || rv != 0)
+    {
+        fprintf(stderr, "zstd: %s\n", ZSTD_isError(rv) ? 
+            ZSTD_getErrorName(rv) : "short flush");
+        return (-1);
+    }
+
+    len = htonl(out.pos);
+    memcpy(z->out, &len, 4);
+    z->out_len = 4 + out.pos;
+    z->out_sent = 0;
+    if (fo->remaining == 0)
+    {
+        memset(z->out + z->out_len, 0, 4);
+        z->out_len += 4;
+        z->done = 1;
+    }
+    return (0);
+#else
+    (void)fo;
+    return (-1);
+#endif
+}
+
+/* cache_precompress -- give ce a compressed copy, built by running the
+ * streaming compressor over it once; whoever gets here first does the
+ * work, anyone racing with it just compresses on the fly meanwhile */
+void cache_precompress(cache_entry *ce)
+{
+    int expect = 0;
+    size_t cap = 0, len = 0;
+    char *buf = NULL;
+    file_out fo;
+
+    if (!atomic_compare_exchange_strong(&ce->zstate, &expect, 2))
+    {
+        return;
+    }
+    if (ce->size > Z_PRECOMPRESS_MAX)
+    {
+        atomic_store(&ce->zstate, -1);
+        return;
+    }
+    file_out_init(&fo);
+    file_out_from_cache(&fo, ce);
+    if (!file_out_compress(&fo))
+    {
+        atomic_store(&ce->zstate, -1);
+        return;
+    }
+    while (!fo.z->done)
+    {
+        if (zstream_fill(&fo) == -1)
+        {
+            break;
+        }
+        if (len + fo.z->out_len > cap && (buf = realloc(buf, 
+            cap = 2 * cap + fo.z->out_len)) == NULL)
+        {
+            fprintf(stderr, "realloc() failed in line %d\n", __LINE__);
+            exit(EXIT_FAILURE);
+        }
+        memcpy(buf + len, fo.z->out, fo.z->out_len);
+        len += fo.z->out_len;
+    }
+    if (!fo.z->done || fo.truncated || len >= ce->size)
+    {
+        free(buf); // failed, or compression doesn't pay for this one
+        fo.ce = NULL;
+        fo.fd = -1;
+        file_out_close(&fo);
+        atomic_store(&ce->zstate, -1);
+        return;
+    }
+    fo.ce = NULL; // borrowed, not ours to release
+    fo.fd = -1;
+    file_out_close(&fo);
+    ce->zdata = buf;
+    ce->zsize = len;
+    atomic_store(&ce->zstate, 1);
+}
+
+void cache_init(file_cache *fc, size_t budget, int use_fds, int use_maps)
+{
+    int i;
+
+    memset(fc, 0, sizeof(file_cache));
+    fc->enabled = budget > 0;
+    fc->use_fds = use_fds;
+    fc->use_maps = use_maps;
+    for (i = 0; i < CACHE_SHARDS; i++)
+    {
+        pthread_mutex_init(&fc->shards[i].lock, NULL);
+        fc->shards[i].budget = budget / CACHE_SHARDS;
+    }
+}
+
+// FNV-1a
+unsigned long name_hash(char *name)
+{
+    unsigned long h = 14695981039346656037UL;
+
+    while (*name)
+    {
+        h = (h ^ (unsigned char)*name++) * 1099511628211UL;
+    }
+    return (h);
+}
+
+/* cache_lookup -- return a pinned entry for name, or NULL and the shard's
+ * invalidation generation so a later cache_insert() can tell if it raced
+ * with a change to the file. */
+cache_entry *cache_lookup(file_cache *fc, char *name, unsigned long *gen)
+{
+    unsigned long h;
+    cache_shard *sh;
+    cache_entry *ce;
+
+    if (!fc->enabled)
+    {
+        return (NULL);
+    }
+    h = name_hash(name);
+    sh = &fc->shards[h % CACHE_SHARDS];
+    pthread_mutex_lock(&sh->lock);
+    for (ce = sh->buckets[(h / CACHE_SHARDS) % CACHE_BUCKETS]; ce != NULL; 
+        ce = ce->next)
+    {
+        if (strcmp(ce->name, name) == 0)
+        {
+            ce->referenced = 1;
+            atomic_fetch_add(&ce->refs, 1);
+            break;
+        }
+    }
+    *gen = sh->gen;
+    pthread_mutex_unlock(&sh->lock);
+
+    return (ce);
+}
+
+/* cache_insert -- cache the open file fd under name and return the new
+ * entry pinned for the caller, or NULL if it doesn't fit or the file may
+ * have changed since the lookup. fd stays owned by the caller. */
+cache_entry *cache_insert(file_cache *fc, char *name, int fd, 
+    struct stat *st, unsigned long gen)
+{
+    unsigned long h;
+    size_t got = 0;
+    ssize_t n;
+    cache_shard *sh;
+    cache_entry *ce, *victim, *old;
+
+    if (!fc->enabled || strlen(name) > NAME_MAX)
+    {
+        return (NULL);
+    }
+    h = name_hash(name);
+    sh = &fc->shards[h % CACHE_SHARDS];
+    if ((size_t)st->st_size > sh->budget)
+    {
+        return (NULL);
+    }
+    if ((ce = calloc(1, sizeof(cache_entry))) == NULL)
+    {
+        return (NULL);
+    }
+    strcpy(ce->name, name);
+    file_id_of(&ce->id, st);
+    ce->size = st->st_size;
+    ce->fd = -1;
+    if (fc->use_fds)
+    {
+        ce->fd = dup(fd);
+    }
+    else if (fc->use_maps && ce->size > 0)
+    {
+        // the mapping is the page cache itself, nothing is read yet
+        ce->data = cache_map(fd, ce->size);
+        ce->mapped = ce->data != NULL;
+        got = ce->mapped ? ce->size : 0;
+    }
+    else if ((ce->data = malloc(ce->size + 1)) != NULL)
+    {
+        while (got < ce->size && 
+            (n = pread(fd, ce->data + got, ce->size - got, got)) > 0)
+        {
+            got += n;
+        }
+    }
+    if ((fc->use_fds && ce->fd == -1) || (!fc->use_fds && 
+        (ce->data == NULL || got != ce->size)))
+    {
+        free(ce->data);
+        free(ce);
+        return (NULL);
+    }
+    atomic_init(&ce->refs, 2); // the cache's and the caller's
+
+    pthread_mutex_lock(&sh->lock);
+    if (sh->gen != gen)
+    {
+        // the directory changed since the lookup, don't trust what we read
+        pthread_mutex_unlock(&sh->lock);
+        atomic_store(&ce->refs, 1);
+        return (ce);
+    }
+    // another thread missed on the same name and got here first: ours is
+    // no older, it takes that one's place
+    for (old = sh->buckets[(h / CACHE_SHARDS) % CACHE_BUCKETS]; 
+        old != NULL && strcmp(old->name, name) != 0; old = old->next);
+    if (old != NULL)
+    {
+        cache_unlink(sh, old);
+        cache_release(old);
+    }
+    // CLOCK: sweep, giving referenced entries a second chance
+    while (sh->used + ce->size > sh->budget && sh->hand != NULL)
+    {
+        victim = sh->hand;
+        sh->hand = victim->ring_next;
+        if (victim->referenced)
+        {
+            victim->referenced = 0;
+            continue;
+        }
+        cache_unlink(sh, victim);
+        cache_release(victim);
+        atomic_fetch_add_explicit(&fc->evictions, 1, memory_order_relaxed);
+    }
+    ce->next = sh->buckets[(h / CACHE_SHARDS) % CACHE_BUCKETS];
+    sh->buckets[(h / CACHE_SHARDS) % CACHE_BUCKETS] = ce;
+    if (sh->hand == NULL)
+    {
+        ce->ring_prev = ce->ring_next = ce;
+        sh->hand = ce;
+    }
+    else
+    {
+        // insert just behind the hand so it is the last to be swept
+        ce->ring_next = sh->hand;
+        ce->ring_prev = sh->hand->ring_prev;
+        ce->ring_prev->ring_next = ce;
+        sh->hand->ring_prev = ce;
+    }
+    sh->used += ce->size;
+    pthread_mutex_unlock(&sh->lock);
+
+    return (ce);
+}
+
+/* cache_unlink -- drop ce from its shard, shard lock held; the cache's
+ * reference still has to be released by the caller. */
+void cache_unlink(cache_shard *sh, cache_entry *ce)
+{
+    cache_entry **pp;
+    unsigned long h = name_hash(ce->name);
+
+    for (pp = &sh->buckets[(h / CACHE_SHARDS) % CACHE_BUCKETS]; *pp != NULL;
+        pp = &(*pp)->next)
+    {
+        if (*pp == ce)
+        {
+            *pp = ce->next;
+            break;
+        }
+    }
+    if (ce->ring_next == ce)
+    {
+        sh->hand = NULL;
+    }
+    else
+    {
+        ce->ring_prev->ring_next = ce->ring_next;
+        ce->ring_next->ring_prev = ce->ring_prev;
+        if (sh->hand == ce)
+        {
+            sh->hand = ce->ring_next;
+        }
+    }
+    sh->used -= ce->size;
+}
+
+void cache_release(cache_entry *ce)
+{
+    if (atomic_fetch_sub(&ce->refs, 1) != 1)
+    {
+        return;
+    }
+    if (ce->fd != -1)
+    {
+        close(ce->fd);
+    }
+    if (ce->mapped)
+    {
+        munmap(ce->data, ce->size);
+    }
+    else
+    {
+        free(ce->data);
+    }
+    free(ce->zdata);
+    free(ce);
+}
+
+/* cache_map -- fd's first size bytes mapped read-only, the kernel told
+ * they are read front to back and soon. Returns NULL if mmap() fails. */
+char *cache_map(int fd, size_t size)
+{
+    char *p;
+
+    posix_fadvise(fd, 0, size, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, size, POSIX_FADV_WILLNEED);
+    if ((p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        perror("mmap");
+        return (NULL);
+    }
+    madvise(p, size, MADV_SEQUENTIAL);
+    madvise(p, size, MADV_WILLNEED);
+    if (size >= MAP_HUGE_MIN)
+    {
+        // a hint, taken only where the page cache has huge pages
+        madvise(p, size, MADV_HUGEPAGE);
+    }
+
+    return (p);
+}
+
+/* map_sigbus -- a mapped file was truncated and the page read is gone:
+ * back to the reader's map_fault, or die as if there were no handler.
+ * send() from such a page fails with EFAULT instead. */
+void map_sigbus(int sig)
+{
+    if (map_fault != NULL)
+    {
+        siglongjmp(*map_fault, 1);
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+void cache_invalidate(file_cache *fc, char *name)
+{
+    unsigned long h;
+    cache_shard *sh;
+    cache_entry *ce, *next;
+
+    if (!fc->enabled)
+    {
+        return;
+    }
+    h = name_hash(name);
+    sh = &fc->shards[h % CACHE_SHARDS];
+    pthread_mutex_lock(&sh->lock);
+    sh->gen++;
+    // every match: cache_insert() keeps one per name, but don't count on it
+    for (ce = sh->buckets[(h / CACHE_SHARDS) % CACHE_BUCKETS]; ce != NULL; 
+        ce = next)
+    {
+        next = ce->next;
+        if (strcmp(ce->name, name) == 0)
+        {
+            cache_unlink(sh, ce);
+            cache_release(ce);
+        }
+    }
+    pthread_mutex_unlock(&sh->lock);
+}
+
+void cache_clear(file_cache *fc)
+{
+    int i;
+    cache_shard *sh;
+    cache_entry *ce;
+
+    for (i = 0; fc->enabled && i < CACHE_SHARDS; i++)
+    {
+        sh = &fc->shards[i];
+        pthread_mutex_lock(&sh->lock);
+        sh->gen++;
+        while ((ce = sh->hand) != NULL)
+        {
+            cache_unlink(sh, ce);
+            cache_release(ce);
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+}
+
+void cache_report(file_cache *fc, FILE *fp)
+{
+    int i;
+    size_t used = 0;
+
+    for (i = 0; i < CACHE_SHARDS; i++)
+    {
+        pthread_mutex_lock(&fc->shards[i].lock);
+        used += fc->shards[i].used;
+        pthread_mutex_unlock(&fc->shards[i].lock);
+    }
+    fprintf(fp, "cache: evictions %lu bytes %zu\n", 
+        atomic_load(&fc->evictions), used);
+}
+
+/* watcher_init -- load the roots, which need the inotify fd for their
+ * watches, and start the thread that turns inotify events on them into
+ * index updates and cache invalidations, SIGUSR1 into a cache report and
+ * SIGHUP into a reload. */
+void watcher_init(sigset_t *mask)
+{
+    static int fds[2];
+    pthread_t thread;
+    pthread_rwlockattr_t attr;
+
+    if ((fds[0] = watch_fd = inotify_init1(IN_CLOEXEC)) == -1)
+    {
+        perror("inotify_init1");
+        exit(EXIT_FAILURE);
+    }
+    // the access log is here, whether it is served or not
+    if ((cwd_wd = inotify_add_watch(fds[0], ".", WATCH_MASK)) == -1)
+    {
+        perror("inotify_add_watch");
+        exit(EXIT_FAILURE);
+    }
+    // a fork() with every connection, a reload must still get its turn
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, 
+        PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&roots_lock, &attr);
+    if ((serve_roots = roots_load(config_path)) == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+    // never fork() while the watcher holds a lock, the child would
+    // inherit it locked with nobody left to unlock it
+    pthread_atfork(roots_prefork, roots_postfork, roots_postfork_child);
+    if ((fds[1] = signalfd(-1, mask, SFD_CLOEXEC)) == -1)
+    {
+        perror("signalfd");
+        exit(EXIT_FAILURE);
+    }
+    if (pthread_create(&thread, NULL, watcher_main, fds) != 0)
+    {
+        fprintf(stderr, "pthread_create() failed in line %d\n", __LINE__);
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
+
+/* watcher_main -- the only thread that changes serve_roots, so it reads
+ * it without the lock */
+void *watcher_main(void *arg)
+{
+    int *fds = arg;
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    struct signalfd_siginfo si;
+    struct pollfd pfd[2];
+    ssize_t len;
+    char *p;
+    int i;
+    serve_root *r;
+
+    pfd[0].fd = fds[0];
+    pfd[1].fd = fds[1];
+    pfd[0].events = pfd[1].events = POLLIN;
+    while (1)
+    {
+        if (poll(pfd, 2, -1) == -1)
+        {
+            continue;
+        }
+        if (pfd[1].revents & POLLIN && read(fds[1], &si, sizeof si) > 0)
+        {
+            if (si.ssi_signo == SIGHUP)
+            {
+                roots_reload();
+            }
+            for (i = 0; si.ssi_signo == SIGUSR1 && i < serve_roots->n; i++)
+            {
+                fprintf(stderr, "%s ", serve_roots->roots[i].path);
+                cache_report(&serve_roots->roots[i].cache, stderr);
+            }
+        }
+        if (!(pfd[0].revents & POLLIN) || 
+            (len = read(fds[0], buf, sizeof buf)) <= 0)
+        {
+            continue;
+        }
+        for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len)
+        {
+            ev = (struct inotify_event *)p;
+            for (i = 0; i < serve_roots->n; i++)
+            {
+                r = &serve_roots->roots[i];
+                if (ev->mask & IN_Q_OVERFLOW)
+                {
+                    // lost events, trust nothing
+                    cache_clear(&r->cache); 
+                    dir_index_build(&r->dir);
+                }
+                else if (ev->len > 0 && ev->wd == r->wd)
+                {
+                    cache_invalidate(&r->cache, ev->name);
+                    dir_index_event(&r->dir, ev);
+                }
+            }
+            if (ev->len > 0 && ev->wd == cwd_wd && 
+                strcmp(ev->name, LOG_PATH) == 0)
+            {
+                log_index_refresh(&log_lines);
+            }
+        }
+        // rebuild the index reply once per batch, not once per event
+        for (i = 0; i < serve_roots->n; i++)
+        {
+            if (serve_roots->roots[i].dir.names_changed)
+            {
+                dir_index_serialize(&serve_roots->roots[i].dir);
+            }
+        }
+    }
+
+    return (NULL);
+}
+
+/* stats_init -- n zeroed metrics slots in memory that survives fork() */
+void stats_init(stats_registry *sr, int n, int shared)
+{
+    sr->slots = mmap(NULL, n * sizeof(metrics), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sr->slots == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    sr->nslots = n;
+    sr->shared = shared;
+}
+
+/* stats_add -- bump a counter in the caller's own slot. With one writer a
+ * plain load and store is enough (no locked instruction), relaxed atomics
+ * only keep a concurrent reader from seeing a torn value. */
+void stats_add(uint64_t *c, uint64_t n)
+{
+    if (server_stats.shared)
+    {
+        __atomic_fetch_add(c, n, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n, 
+        __ATOMIC_RELAXED);
+}
+
+void stats_latency(uint64_t *hist, uint64_t *sum, uint64_t ns)
+{
+    uint64_t q = ns > 0 ? (ns - 1) / 1000 : 0;
+    int i = q == 0 ? 0 : 64 - __builtin_clzll(q);
+
+    stats_add(&hist[i < LAT_BUCKETS ? i : LAT_BUCKETS - 1], 1);
+    stats_add(sum, ns);
+}
+
+uint64_t stats_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/* stats_render -- sum every slot and format the result as Prometheus text,
+ * returned as an unshared cache entry the reply can be sent from */
+cache_entry *stats_render(stats_registry *sr)
+{
+    metrics sum;
+    uint64_t *from, *to, acc;
+    size_t i, k, len;
+    int h;
+    char *names[] = {"parse", "send", "io_wait", "io_service", 
+        "tls_handshake"};
+    uint64_t *hists[5], sums[5];
+    FILE *fp;
+    cache_entry *ce;
+
+    // metrics is nothing but uint64_t counters, add them up word by word
+    memset(&sum, 0, sizeof sum);
+    for (i = 0; i < (size_t)sr->nslots; i++)
+    {
+        from = (uint64_t *)&sr->slots[i];
+        to = (uint64_t *)&sum;
+        for (k = 0; k < sizeof(metrics) / sizeof(uint64_t); k++)
+        {
+            to[k] += __atomic_load_n(&from[k], __ATOMIC_RELAXED);
+        }
+    }
+
+    if ((ce = calloc(1, sizeof(cache_entry))) == NULL ||
+        (fp = open_memstream(&ce->data, &len)) == NULL)
+    {
+        fprintf(stderr, "malloc() failed in line %d\n", __LINE__);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(fp, "# TYPE tcp_requests_total counter\n");
+    for (i = 0; i < CMD_COUNT; i++)
+    {
+        fprintf(fp, "tcp_requests_total{command=\"%s\"} %lu\n", cmd_names[i],
+            (unsigned long)sum.requests[i]);
+    }
+    fprintf(fp, "# TYPE tcp_replies_total counter\n");
+    for (i = 0; i < ST_COUNT; i++)
+    {
+        fprintf(fp, "tcp_replies_total{status=\"%s\"} %lu\n", status_names[i],
+            (unsigned long)sum.replies[i]);
+    }
+    fprintf(fp, "# TYPE tcp_rejected_total counter\n");
+    for (i = 0; i < REJ_COUNT; i++)
+    {
+        fprintf(fp, "tcp_rejected_total{reason=\"%s\"} %lu\n", 
+            reject_names[i], (unsigned long)sum.rejected[i]);
+    }
+    fprintf(fp, "# TYPE tcp_sent_bytes_total counter\n"
+        "tcp_sent_bytes_total %lu\n"
+        "# TYPE tcp_connections_total counter\n"
+        "tcp_connections_total %lu\n"
+        "# TYPE tcp_connections_active gauge\n"
+        "tcp_connections_active %lu\n"
+        "# TYPE tcp_accept_errors_total counter\n"
+        "tcp_accept_errors_total %lu\n"
+        "# HELP tcp_listen_drops_total host-wide, from /proc/net/netstat\n"
+        "# TYPE tcp_listen_drops_total counter\n"
+        "tcp_listen_drops_total %lu\n"
+        "# TYPE tcp_log_dropped_total counter\n"
+        "tcp_log_dropped_total %lu\n"
+        "# TYPE tcp_cache_hits_total counter\n"
+        "tcp_cache_hits_total %lu\n"
+        "# TYPE tcp_cache_misses_total counter\n"
+        "tcp_cache_misses_total %lu\n",
+        (unsigned long)sum.bytes_sent, (unsigned long)sum.conns_opened,
+        (unsigned long)(sum.conns_opened - sum.conns_closed),
+        (unsigned long)sum.accept_errors, listen_drops(),
+        atomic_load(&access_log.dropped), (unsigned long)sum.cache_hits,
+        (unsigned long)sum.cache_misses);
+    fprintf(fp, "# TYPE tcp_io_queue_depth gauge\n"
+        "tcp_io_queue_depth %d\n"
+        "# TYPE tcp_io_inline_total counter\n"
+        "tcp_io_inline_total %lu\n"
+        "# TYPE tcp_tls_failures_total counter\n"
+        "tcp_tls_failures_total %lu\n",
+        blocking_io.deques != NULL ? atomic_load(&blocking_io.queued) : 0,
+        (unsigned long)sum.io_inline, (unsigned long)sum.tls_failures);
+    hists[0] = sum.parse_hist; sums[0] = sum.parse_ns;
+    hists[1] = sum.send_hist; sums[1] = sum.send_ns;
+    hists[2] = sum.io_wait_hist; sums[2] = sum.io_wait_ns;
+    hists[3] = sum.io_service_hist; sums[3] = sum.io_service_ns;
+    hists[4] = sum.tls_hist; sums[4] = sum.tls_ns;
+    for (h = 0; h < 5; h++)
+    {
+        fprintf(fp, "# TYPE tcp_%s_seconds histogram\n", names[h]);
+        for (i = 0, acc = 0; i < LAT_BUCKETS; i++)
+        {
+            acc += hists[h][i];
+            if (i < LAT_BUCKETS - 1)
+            {
+                fprintf(fp, "tcp_%s_seconds_bucket{le=\"%g\"} %lu\n", 
+                    names[h], (1UL << i) / 1e6, (unsigned long)acc);
+            }
+            else
+            {
+                fprintf(fp, "tcp_%s_seconds_bucket{le=\"+Inf\"} %lu\n", 
+                    names[h], (unsigned long)acc);
+            }
+        }
+        fprintf(fp, "tcp_%s_seconds_sum %.9f\ntcp_%s_seconds_count %lu\n",
+            names[h], sums[h] / 1e9, names[h],
+            (unsigned long)acc);
+    }
+    if (fclose(fp) != 0)
+    {
+        fprintf(stderr, "malloc() failed in line %d\n", __LINE__);
+        exit(EXIT_FAILURE);
+    }
+    ce->size = len;
+    ce->fd = -1;
+    atomic_init(&ce->refs, 1);
+
+    return (ce);
+}
+
+/* listen_drops -- TcpExt ListenDrops: SYNs and handshakes the kernel threw
+ * away because an accept queue was full. Host-wide, there is no
+ * per-socket count. */
+unsigned long listen_drops()
+{
+    char names[4096], values[4096], *n, *v, *sn, *sv;
+    unsigned long drops = 0;
+    FILE *fp;
+
+    if ((fp = fopen("/proc/net/netstat", "r")) == NULL)
+    {
+        return (0);
+    }
+    while (fgets(names, sizeof names, fp) != NULL &&
+        fgets(values, sizeof values, fp) != NULL)
+    {
+        if (strncmp(names, "TcpExt:", 7) != 0)
+        {
+            continue;
+        }
+        for (n = strtok_r(names, " \n", &sn), v = strtok_r(values, " \n", &sv);
+            n != NULL && v != NULL;
+            n = strtok_r(NULL, " \n", &sn), v = strtok_r(NULL, " \n", &sv))
+        {
+            if (strcmp(n, "ListenDrops") == 0)
+            {
+                drops = strtoul(v, NULL, 10);
+            }
+        }
+    }
+    fclose(fp);
+
+    return (drops);
+}
+
+/* stats_listen -- serve stats_render() over plain HTTP on port for
+ * Prometheus; one blocking thread is plenty for a scraper */
+void stats_listen(char *port)
+{
+    static int sockfd;
+    pthread_t thread;
+
+    sockfd = make_listener(port, 0);
+    if (pthread_create(&thread, NULL, stats_main, &sockfd) != 0)
+    {
+        fprintf(stderr, "pthread_create() failed in line %d\n", __LINE__);
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
+
+void *stats_main(void *arg)
+{
+    int sockfd = *(int *)arg, fd;
+    char buf[BUFSIZ], hdr[128];
+    struct timeval tv = {1, 0};
+    cache_entry *ce;
+
+    while (1)
+    {
+        if ((fd = accept(sockfd, NULL, NULL)) == -1)
+        {
+            continue;
+        }
+        // whatever the scraper asks for, it gets the metrics
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+        recv(fd, buf, sizeof buf, 0);
+        ce = stats_render(&server_stats);
+        snprintf(hdr, sizeof hdr, "HTTP/1.0 200 OK\r\nContent-Type: "
+            "text/plain; version=0.0.4\r\nContent-Length: %lu\r\n\r\n",
+            (unsigned long)ce->size);
+        send(fd, hdr, strlen(hdr), MSG_NOSIGNAL | MSG_MORE);
+        send(fd, ce->data, ce->size, MSG_NOSIGNAL);
+        cache_release(ce);
+        close(fd);
+    }
+
+    return (NULL);
+}
+
+/* dir_index_build -- (re)read the whole of di->dirfd; run when its root
+ * is opened and whenever inotify tells us it lost events. */
+void dir_index_build(dir_index *di)
+{
+    DIR *dr;
+    struct dirent *de;
+    size_t i;
+    int fd;
+
+    if (di->slots == NULL)
+    {
+        pthread_rwlock_init(&di->lock, NULL);
+        di->cap = INDEX_MIN_SLOTS;
+        if ((di->slots = calloc(di->cap, sizeof(dir_slot))) == NULL)
+        {
+            fprintf(stderr, "calloc() failed in line %d\n", __LINE__);
+            exit(EXIT_FAILURE);
+        }
+    }
+    // a directory stream of its own, readdir() moves the offset
+    if ((fd = openat(di->dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) 
+        == -1 || (dr = fdopendir(fd)) == NULL)
+    {
+        fprintf(stderr, "opendir() failed in line %d\n", __LINE__);
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_rwlock_wrlock(&di->lock);
+    for (i = 0; i < di->cap; i++)
+    {
+        if (di->slots[i].name != dir_tombstone)
+        {
+            free(di->slots[i].name);
+        }
+        di->slots[i].name = NULL;
+    }
+    di->count = di->used = 0;
+    while ((de = readdir(dr)) != NULL)
+    {
+        if ((strcmp(de->d_name, "..") != 0) && (strcmp(de->d_name, ".") != 0))
+        {
+            dir_index_put(di, de->d_name);
+        }
+    }
+    pthread_rwlock_unlock(&di->lock);
+    closedir(dr);
+
+    dir_index_serialize(di);
+}
+
+/* dir_index_find -- linear probe for name; returns its slot, or the slot
+ * it would go in (a reused tombstone if there is one). Lock held. */
+dir_slot *dir_index_find(dir_index *di, char *name)
+{
+    size_t i;
+    dir_slot *s, *grave = NULL;
+
+    for (i = name_hash(name) & (di->cap - 1); ; i = (i + 1) & (di->cap - 1))
+    {
+        s = &di->slots[i];
+        if (s->name == NULL)
+        {
+            return (grave != NULL ? grave : s);
+        }
+        if (s->name == dir_tombstone)
+        {
+            if (grave == NULL)
+            {
+                grave = s;
+            }
+        }
+        else if (strcmp(s->name, name) == 0)
+        {
+            return (s);
+        }
+    }
+}
+
+/* dir_index_lookup -- O(1) existence check */
+int dir_index_lookup(dir_index *di, char *name)
+{
+    dir_slot *s;
+    int found;
+
+    pthread_rwlock_rdlock(&di->lock);
+    s = dir_index_find(di, name);
+    found = s->name != NULL && s->name != dir_tombstone;
+    pthread_rwlock_unlock(&di->lock);
+
+    return (found);
+}
+
+/* dir_index_put -- add name if it's new. Write lock held. */
+void dir_index_put(dir_index *di, char *name)
+{
+    dir_slot *s;
+
+    s = dir_index_find(di, name);
+    if (s->name == NULL || s->name == dir_tombstone)
+    {
+        if (s->name == NULL)
+        {
+            di->used++;
+        }
+        if ((s->name = strdup(name)) == NULL)
+        {
+            fprintf(stderr, "strdup() failed in line %d\n", __LINE__);
+            exit(EXIT_FAILURE);
+        }
+        di->count++;
+        di->names_changed = 1;
+    }
+
+    // keep probe chains short: grow at 70% including tombstones
+    if (di->used * 10 >= di->cap * 7)
+    {
+        dir_index_grow(di);
+    }
+}
+
+void dir_index_remove(dir_index *di, char *name)
+{
+    dir_slot *s = dir_index_find(di, name);
+
+    if (s->name != NULL && s->name != dir_tombstone)
+    {
+        free(s->name);
+        s->name = dir_tombstone;
+        di->count--;
+        di->names_changed = 1;
+    }
+}
+
+void dir_index_grow(dir_index *di)
+{
+    dir_slot *old = di->slots, *s;
+    size_t old_cap = di->cap, i;
+
+    // only double when live entries, not tombstones, filled the table
+    if (di->count * 2 >= di->cap)
+    {
+        di->cap *= 2;
+    }
+    if ((di->slots = calloc(di->cap, sizeof(dir_slot))) == NULL)
+    {
+        fprintf(stderr, "calloc() failed in line %d\n", __LINE__);
+        exit(EXIT_FAILURE);
+    }
+    di->used = di->count;
+    for (i = 0; i < old_cap; i++)
+    {
+        if (old[i].name != NULL && old[i].name != dir_tombstone)
+        {
+            s = dir_index_find(di, old[i].name);
+            *s = old[i];
+        }
+    }
+    free(old);
+}
+
+/* dir_index_serialize -- rebuild the index reply: every name followed by
+ * a newline, then one more newline, as the index command always sent. */
+void dir_index_serialize(dir_index *di)
+{
+    cache_entry *ce, *old;
+    size_t i, len = 1;
+
+    pthread_rwlock_wrlock(&di->lock);
+    for (i = 0; i < di->cap; i++)
+    {
+        if (di->slots[i].name != NULL && di->slots[i].name != dir_tombstone)
+        {
+            len += strlen(di->slots[i].name) + 1;
+        }
+    }
+    if ((ce = calloc(1, sizeof(cache_entry))) == NULL || 
+        (ce->data = malloc(len)) == NULL)
+    {
+        fprintf(stderr, "malloc() failed in line %d\n", __LINE__);
+        exit(EXIT_FAILURE);
+    }
+    ce->fd = -1;
+    for (i = 0; i < di->cap; i++)
+    {
+        if (di->slots[i].name != NULL && di->slots[i].name != dir_tombstone)
+        {
+            len = strlen(di->slots[i].name);
+            memcpy(ce->data + ce->size, di->slots[i].name, len);
+            ce->data[ce->size + len] = '\n';
+            ce->size += len + 1;
+        }
+    }
+    ce->data[ce->size++] = '\n';
+    atomic_init(&ce->refs, 1);
+
+    old = di->reply;
+    di->reply = ce;
+    di->names_changed = 0;
+    pthread_rwlock_unlock(&di->lock);
+
+    if (old != NULL)
+    {
+        cache_release(old);
+    }
+}
+
+/* dir_index_reply -- the current index reply, pinned for the caller */
+cache_entry *dir_index_reply(dir_index *di)
+{
+    cache_entry *ce;
+
+    pthread_rwlock_rdlock(&di->lock);
+    ce = di->reply;
+    atomic_fetch_add(&ce->refs, 1);
+    pthread_rwlock_unlock(&di->lock);
+
+    return (ce);
+}
+
+/* dir_index_free -- all of di, for a root that is gone; index replies in
+ * flight keep theirs */
+void dir_index_free(dir_index *di)
+{
+    size_t i;
+
+    for (i = 0; i < di->cap; i++)
+    {
+        if (di->slots[i].name != dir_tombstone)
+        {
+            free(di->slots[i].name);
+        }
+    }
+    free(di->slots);
+    if (di->reply != NULL)
+    {
+        cache_release(di->reply);
+    }
+    pthread_rwlock_destroy(&di->lock);
+}
+
+/* the roots can't change while the lock is held, nor their indexes */
+void roots_prefork()
+{
+    int i;
+
+    pthread_rwlock_rdlock(&roots_lock);
+    for (i = 0; i < serve_roots->n; i++)
+    {
+        pthread_rwlock_wrlock(&serve_roots->roots[i].dir.lock);
+    }
+}
+
+void roots_postfork()
+{
+    int i;
+
+    for (i = 0; i < serve_roots->n; i++)
+    {
+        pthread_rwlock_unlock(&serve_roots->roots[i].dir.lock);
+    }
+    pthread_rwlock_unlock(&roots_lock);
+}
+
+// a rwlock only unlocks for the tid that locked it, the child's is new
+void roots_postfork_child()
+{
+    int i;
+
+    for (i = 0; i < serve_roots->n; i++)
+    {
+        pthread_rwlock_init(&serve_roots->roots[i].dir.lock, NULL);
+    }
+    pthread_rwlock_init(&roots_lock, NULL);
+}
+
+/* roots_load -- the roots the file at path lists, a line each:
+ *  name directory [cache=BYTES] [rate=REQ/S] [bytes=BYTES/S] [log=FILE]
+ * '#' starts a comment. cache defaults to --cache-bytes, no rate or bytes
+ * to no limit, no log to log.log. No path: the cwd, under "". Returns
+ * them opened, indexed and watched, or NULL after saying what's wrong. */
+root_set *roots_load(char *path)
+{
+    root_set *rs;
+    serve_root *r;
+    FILE *fp;
+    char line[BUFSIZ], *tok[8], *save, *err = NULL;
+    int ntok, lineno = 0, i;
+
+    if ((rs = calloc(1, sizeof(root_set))) == NULL)
+    {
+        fprintf(stderr, "calloc() failed in line %d\n", __LINE__);
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < ROOT_MAX; i++)
+    {
+        rs->roots[i].dirfd = rs->roots[i].wd = -1;
+        rs->roots[i].cache_bytes = root_cache_bytes;
+    }
+    if (path == NULL)
+    {
+        rs->roots[rs->n++].path = strdup(".");
+    }
+    else if ((fp = fopen(path, "r")) == NULL)
+    {
+        perror(path);
+        free(rs);
+        return (NULL);
+    }
+    while (path != NULL && err == NULL && fgets(line, sizeof line, fp) != NULL)
+    {
+        lineno++;
+        line[strcspn(line, "#\n")] = '\0';
+        for (ntok = 0, tok[0] = strtok_r(line, " \t", &save); 
+            tok[ntok] != NULL && ntok < 7; 
+            tok[++ntok] = strtok_r(NULL, " \t", &save))
+            ;
+        if (ntok == 0)
+        {
+            continue;
+        }
+        r = &rs->roots[rs->n];
+        if (ntok < 2 || tok[ntok] != NULL)
+        {
+            err = "want a name, a directory and options";
+        }
+        else if (rs->n == ROOT_MAX)
+        {
+            err = "too many roots";
+        }
+        else if (strlen(tok[0]) >= ROOT_NAME_MAX || strchr(tok[0], '/'))
+        {
+            err = "bad name";
+        }
+        for (i = 0; err == NULL && i < rs->n; i++)
+        {
+            if (strcmp(rs->roots[i].name, tok[0]) == 0)
+            {
+                err = "name used twice";
+            }
+        }
+        for (i = 2; err == NULL && i < ntok; i++)
+        {
+            if (strncmp(tok[i], "cache=", 6) == 0)
+            {
+                r->cache_bytes = strtoull(tok[i] + 6, NULL, 10);
+            }
+            else if (strncmp(tok[i], "rate=", 5) == 0)
+            {
+                r->req_rate = atof(tok[i] + 5);
+            }
+            else if (strncmp(tok[i], "bytes=", 6) == 0)
+            {
+                r->byte_rate = atof(tok[i] + 6);
+            }
+            else if (strncmp(tok[i], "log=", 4) == 0 && tok[i][4] != '\0')
+            {
+                free(r->log_path);
+                r->log_path = strdup(tok[i] + 4);
+            }
+            else
+            {
+                err = "unknown option";
+            }
+        }
+        if (err == NULL)
+        {
+            strcpy(r->name, tok[0]);
+            r->path = strdup(tok[1]);
+            rs->n++;
+        }
+    }
+    if (path != NULL)
+    {
+        fclose(fp);
+        if (err == NULL && rs->n == 0)
+        {
+            err = "no roots";
+        }
+    }
+    if (err != NULL)
+    {
+        fprintf(stderr, "%s:%d: %s\n", path, lineno, err);
+        if (rs->n < ROOT_MAX)
+        {
+            free(rs->roots[rs->n].log_path); // the line that was wrong
+        }
+        roots_free(rs);
+        return (NULL);
+    }
+    for (i = 0; i < rs->n; i++)
+    {
+        if (root_open(&rs->roots[i]) == -1)
+        {
+            roots_unwatch(rs, serve_roots);
+            roots_free(rs);
+            return (NULL);
+        }
+    }
+
+    return (rs);
+}
+
+/* root_open -- open r's directory, index it, watch it and give it its
+ * cache, limits and log */
+int root_open(serve_root *r)
+{
+    if (r->path == NULL || (r->dirfd = open(r->path, O_RDONLY | O_DIRECTORY |
+        O_CLOEXEC)) == -1)
+    {
+        perror(r->path);
+        return (-1);
+    }
+    if ((r->wd = inotify_add_watch(watch_fd, r->path, WATCH_MASK)) == -1)
+    {
+        perror("inotify_add_watch");
+        return (-1);
+    }
+    r->dir.dirfd = r->dirfd;
+    dir_index_build(&r->dir);
+    cache_init(&r->cache, cache_allowed ? r->cache_bytes : 0, 
+        root_cache_fds, root_cache_maps);
+    rate_init(&r->rates, r->req_rate, r->byte_rate);
+    r->log = r->log_path != NULL ? root_logger(r->log_path) : NULL;
+
+    return (0);
+}
+
+/* roots_free -- what roots_load() made; the inotify watches are left to
+ * the caller, a new set may have the same ones */
+void roots_free(root_set *rs)
+{
+    serve_root *r;
+    int i;
+
+    for (i = 0; i < rs->n; i++)
+    {
+        r = &rs->roots[i];
+        if (r->dir.slots != NULL)
+        {
+            dir_index_free(&r->dir);
+        }
+        cache_clear(&r->cache);
+        if (r->rates.slots != NULL)
+        {
+            munmap(r->rates.slots, RATE_SLOTS * sizeof(rate_slot));
+        }
+        if (r->dirfd != -1)
+        {
+            close(r->dirfd);
+        }
+        free(r->path);
+        free(r->log_path);
+    }
+    free(rs);
+}
+
+/* roots_reload -- SIGHUP: build the roots from the config again and swap
+ * them in. Requests being parsed finish with the old ones, which are
+ * freed once they have; replies under way keep the cache entries they
+ * pinned, and a config that doesn't load leaves the old roots serving. */
+void roots_reload()
+{
+    root_set *rs, *old;
+
+    if ((rs = roots_load(config_path)) == NULL)
+    {
+        fprintf(stderr, "server: roots not reloaded\n");
+        return;
+    }
+    pthread_rwlock_wrlock(&roots_lock);
+    old = atomic_exchange(&serve_roots, rs);
+    pthread_rwlock_unlock(&roots_lock);
+
+    roots_unwatch(old, rs);
+    roots_synchronize();
+    roots_free(old);
+    fprintf(stderr, "server: %d roots\n", rs->n);
+}
+
+/* roots_unwatch -- drop the inotify watches of gone that kept (NULL for
+ * none) doesn't have; the same directory always gets the same watch */
+void roots_unwatch(root_set *gone, root_set *kept)
+{
+    int i, k, keep;
+
+    for (i = 0; i < gone->n; i++)
+    {
+        keep = gone->roots[i].wd == -1 || gone->roots[i].wd == cwd_wd;
+        for (k = 0; kept != NULL && k < kept->n; k++)
+        {
+            keep |= kept->roots[k].wd == gone->roots[i].wd;
+        }
+        if (!keep)
+        {
+            inotify_rm_watch(watch_fd, gone->roots[i].wd);
+        }
+    }
+}
+
+/* roots_get -- serve_roots, good until roots_put(). The thread only
+ * announces, in its own root_readers slot, the generation it starts
+ * from; a reload waits for that before it frees what it swapped out.
+ * Calls nest, only the outermost announces. */
+root_set *roots_get()
+{
+    if (reader_slot == -1 && 
+        (reader_slot = atomic_fetch_add(&nroot_readers, 1)) >= ROOT_READERS)
+    {
+        fprintf(stderr, "server: more than %d threads\n", ROOT_READERS);
+        exit(EXIT_FAILURE);
+    }
+    if (reader_depth++ == 0)
+    {
+        atomic_store(&root_readers[reader_slot].gen, 
+            atomic_load(&roots_gen));
+    }
+
+    return (atomic_load(&serve_roots));
+}
+
+void roots_put()
+{
+    if (--reader_depth == 0)
+    {
+        atomic_store(&root_readers[reader_slot].gen, 0);
+    }
+}
+
+/* roots_synchronize -- after a swap: wait until no thread can still have
+ * the roots from before it. A reader that announced an older generation
+ * may have them; one that announced this one or later loaded the pointer
+ * after the swap (all seq_cst) and is not waited for. */
+void roots_synchronize()
+{
+    unsigned long gen = atomic_fetch_add(&roots_gen, 1) + 1, g;
+    struct timespec ts = {0, 1000000};
+    int i, n = atomic_load(&nroot_readers);
+
+    for (i = 0; i < n && i < ROOT_READERS; i++)
+    {
+        while ((g = atomic_load(&root_readers[i].gen)) != 0 && g < gen)
+        {
+            nanosleep(&ts, NULL);
+        }
+    }
+}
+
+/* root_find -- the root name is in and, in *rest, the name within it:
+ * "root/file" is file in root, a plain name is in the first root. NULL
+ * for a root there is none of. Roots taken with roots_get(). */
+serve_root *root_find(root_set *rs, char *name, char **rest)
+{
+    char *slash;
+    int i;
+
+    if ((slash = strchr(name, '/')) == NULL)
+    {
+        *rest = name;
+        return (&rs->roots[0]);
+    }
+    for (i = 0; i < rs->n; i++)
+    {
+        if (strlen(rs->roots[i].name) == (size_t)(slash - name) &&
+            strncmp(rs->roots[i].name, name, slash - name) == 0)
+        {
+            *rest = slash + 1;
+            return (&rs->roots[i]);
+        }
+    }
+    return (NULL);
+}
+
+serve_root *root_named(root_set *rs, token_view *t)
+{
+    int i;
+
+    for (i = 0; i < rs->n; i++)
+    {
+        if (tok_eq(t, rs->roots[i].name))
+        {
+            return (&rs->roots[i]);
+        }
+    }
+    return (NULL);
+}
+
+/* root_logger -- the logger writing path, started by the first root that
+ * names it and kept for good, a reload may name it again. NULL (use the
+ * main log) for log.log itself, or once there are ROOT_MAX of them. */
+logger *root_logger(char *path)
+{
+    int i;
+
+    if (strcmp(path, LOG_PATH) == 0)
+    {
+        return (NULL);
+    }
+    for (i = 0; i < root_logs_used; i++)
+    {
+        if (strcmp(root_logs[i].path, path) == 0)
+        {
+            return (&root_logs[i]);
+        }
+    }
+    if (root_logs_used == ROOT_MAX)
+    {
+        fprintf(stderr, "%s: too many logs, using %s\n", path, LOG_PATH);
+        return (NULL);
+    }
+    if ((path = strdup(path)) == NULL)
+    {
+        fprintf(stderr, "malloc() failed in line %d\n", __LINE__);
+        exit(EXIT_FAILURE);
+    }
+    logger_init(&root_logs[root_logs_used], path, root_log_max, 0);
+
+    return (&root_logs[root_logs_used++]);
+}
+
+void dir_index_event(dir_index *di, struct inotify_event *ev)
+{
+    pthread_rwlock_wrlock(&di->lock);
+    if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+    {
+        dir_index_remove(di, ev->name);
+    }
+    else
+    {
+        dir_index_put(di, ev->name); // created or moved in, or a no-op
+    }
+    pthread_rwlock_unlock(&di->lock);
+}
+
+void *parse_input(request *req, arena *mem, file_info *finfo)
+{
+    int fd = -1, rv, i, n, found; 
+    off_t total_read = 0;
+    char message[100];
+    char *output, *name;
+    cache_entry *ce;
+    off_t range_off = 0, range_len = 0;
+    size_t size;
+    enum reply_status status;
+    batch *b;
+    file_id id;
+    uint64_t etag = 0;
+    int ranged = 0, conditional = 0, sized = 0, pinned = 0, range_tok = 2;
+    serve_root *root;
+    
+    output = arena_alloc(mem, OUTPUT_MAX);
+    *output = '\0'; *message = '\0';
+    file_out_init(&finfo->fout);
+    finfo->status = ST_OK;
+    finfo->cmd = CMD_OTHER;
+    finfo->deferred = 0;
+    finfo->hashed = 0;
+    finfo->text_reply = 0;
+    finfo->root = NULL;
+    // the pool runs a deferred request again from the top, lookups too
+    finfo->cache_hits = finfo->cache_misses = 0;
+    if (req->ntok < 2)
+    {
+        finfo->status = ST_BAD_REQUEST;
+        return (output);
+    }
+    
+    if (tok_eq(&req->tok[1], "index"))
+    {
+        finfo->cmd = CMD_INDEX;
+        root = req->ntok > 2 ? root_named(finfo->roots, &req->tok[2]) :
+            &finfo->roots->roots[0];
+        if ((finfo->root = root) == NULL)
+        {
+            log_append("index NOT_FOUND\n", finfo);
+            finfo->status = ST_NOT_FOUND;
+            return (output);
+        }
+        // prebuilt by the watcher, this costs no syscalls at all
+        ce = dir_index_reply(&root->dir);
+        file_out_from_cache(&finfo->fout, ce);
+        total_read = ce->size;
+        if (!rate_admit(&root->rates, finfo->client_ip_addr, ce->size))
+        {
+            file_out_close(&finfo->fout);
+            log_append("index BUSY\n", finfo);
+            finfo->status = ST_BUSY;
+            return (output);
+        }
+        strcat(message, "index ");
+        sprintf(message + strlen(message), "%lu\n", total_read);
+        log_append(message, finfo);
+    }
+    else if (tok_eq(&req->tok[1], "server") || tok_eq(&req->tok[1], "client"))
+    {
+        sprintf(message, "%.*s NOT_ALLOWED\n", (int)req->tok[1].len, 
+            req->tok[1].p);
+        log_append(message, finfo);
+        finfo->status = ST_NOT_ALLOWED;
+    }
+    else if (tok_eq(&req->tok[1], "stats"))
+    {
+        finfo->cmd = CMD_STATS;
+        ce = stats_render(&server_stats);
+        file_out_from_cache(&finfo->fout, ce);
+        strcat(output, " ");
+        sprintf(message, "stats %lu\n", (unsigned long)ce->size);
+        log_append(message, finfo);
+    }
+    else if (tok_eq(&req->tok[1], "log"))
+    {
+        finfo->cmd = CMD_LOG;
+        if (finfo->may_defer)
+        {
+            finfo->deferred = 1; // the open and the line count may block
+            return (output);
+        }
+        if ((fd = open(LOG_PATH, O_RDONLY)) == -1 || 
+            (rv = log_range(&log_lines, fd, req, &finfo->fout)) == -1)
+        {
+            log_append("log 0\n", finfo);
+            finfo->status = ST_NOT_READABLE;
+        }
+        else if (rv == 0)
+        {
+            log_append("BAD_RANGE\n", finfo);
+            finfo->status = ST_BAD_REQUEST;
+        }
+        else
+        {
+            // like a file body: straight from the page cache
+            finfo->fout.fd = fd;
+            fd = -1;
+            if (!finfo->fout.follow)
+            {
+                strcat(output, " ");
+            }
+            sprintf(message, "log %lu%s\n", 
+                (unsigned long)finfo->fout.remaining, 
+                finfo->fout.follow ? " follow" : "");
+            log_append(message, finfo);
+        }
+        if (fd != -1)
+        {
+            close(fd);
+        }
+    } 
+    else if (tok_eq(&req->tok[1], "get"))
+    {
+        finfo->cmd = CMD_GET;
+        // every name needs its part, or the client can't split the reply
+        if ((n = req->ntok - 2) < 1 || req->more)
+        {
+            log_append("get BAD_REQUEST\n", finfo);
+            finfo->status = ST_BAD_REQUEST;
+            return (output);
+        }
+        if ((b = calloc(1, sizeof(batch) + n * sizeof(batch_part))) == NULL)
+        {
+            fprintf(stderr, "calloc() failed in line %d\n", __LINE__);
+            exit(EXIT_FAILURE);
+        }
+        b->nparts = n;
+        for (i = 0; i < n; i++)
+        {
+            file_out_init(&b->parts[i].fo);
+        }
+        finfo->fout.batch = b; // closing fout releases all the parts
+        for (i = 0, found = 0; i < n; i++)
+        {
+            if ((name = arena_strndup(mem, req->tok[i + 2].p, 
+                req->tok[i + 2].len)) == NULL)
+            {
+                b->parts[i].status = ST_NOT_FOUND;
+            }
+            else
+            {
+                b->parts[i].status = file_open(name, &b->parts[i].fo, finfo,
+                    NULL);
+                b->parts[i].root = finfo->root;
+            }
+            if (finfo->deferred)
+            {
+                // all of it on the pool then, it opens them again
+                file_out_close(&finfo->fout);
+                return (output);
+            }
+        }
+        for (i = 0, found = 0; i < n; i++)
+        {
+            root = b->parts[i].root;
+            if (b->parts[i].status == ST_OK && !rate_admit(&root->rates, 
+                finfo->client_ip_addr, b->parts[i].fo.remaining))
+            {
+                file_out_close(&b->parts[i].fo);
+                b->parts[i].status = ST_BUSY;
+            }
+            found += b->parts[i].status == ST_OK;
+            b->total += BATCH_PART_LEN + b->parts[i].fo.remaining;
+            // one root's log if that's where all the names are
+            if (root != b->parts[0].root)
+            {
+                finfo->root = NULL;
+            }
+        }
+        sprintf(message, "get %d/%d %lu\n", found, n, 
+            (unsigned long)b->total);
+        log_append(message, finfo);
+    }
+    else 
+    {
+        finfo->cmd = CMD_FILE;
+        // "file if-none-match HASH" is NOT_MODIFIED while the file still
+        // hashes to HASH, "file offset [length]" asks for just that range,
+        // "file size" for the size (and the hash, if asked for) instead of
+        // the body, what a client needs to split a download
+        if (req->ntok > 2 && tok_eq(&req->tok[2], "if-none-match"))
+        {
+            if (req->ntok != 4 || !tok_to_hash(&req->tok[3], &etag))
+            {
+                log_append("BAD_HASH\n", finfo);
+                finfo->status = ST_BAD_REQUEST;
+                return (output);
+            }
+            conditional = 1;
+        }
+        else if (req->ntok == 3 && tok_eq(&req->tok[2], "size"))
+        {
+            sized = 1;
+        }
+        else
+        {
+            // "file if-match HASH offset [length]" is that range only while
+            // the file still hashes to HASH, CHANGED once it doesn't: the
+            // pieces of a split download all come from one version
+            if (req->ntok > 2 && tok_eq(&req->tok[2], "if-match"))
+            {
+                if (req->ntok < 5 || !tok_to_hash(&req->tok[3], &etag))
+                {
+                    log_append("BAD_HASH\n", finfo);
+                    finfo->status = ST_BAD_REQUEST;
+                    return (output);
+                }
+                pinned = 1;
+                range_tok = 4;
+            }
+            if ((req->ntok > range_tok && 
+                !tok_to_off(&req->tok[range_tok], &range_off)) ||
+                (req->ntok > range_tok + 1 && 
+                !tok_to_off(&req->tok[range_tok + 1], &range_len)))
+            {
+                log_append("BAD_RANGE\n", finfo);
+                finfo->status = ST_BAD_REQUEST;
+                return (output);
+            }
+            ranged = req->ntok > range_tok;
+        }
+        if ((name = arena_strndup(mem, req->tok[1].p, req->tok[1].len)) 
+            == NULL)
+        {
+            log_append("NOT_FOUND\n", finfo);
+            finfo->status = ST_NOT_FOUND;
+            return (output);
+        }
+        if ((status = file_open(name, &finfo->fout, finfo, &id)) != ST_OK)
+        {
+            sprintf(message, "%s\n", status_names[status]);
+            log_append(message, finfo);
+            finfo->status = status;
+            return (output);
+        }
+        if (finfo->deferred)
+        {
+            return (output);
+        }
+        if (finfo->fout.fd != -1 || finfo->fout.ce != NULL)
+        {
+            if ((!ranged && (finfo->want_hash || conditional)) || pinned)
+            {
+                rv = content_hash(&finfo->fout, &id, &finfo->hash, 
+                    !finfo->may_defer);
+                if (rv == 0)
+                {
+                    // a whole file to read first, the pool opens it again
+                    file_out_close(&finfo->fout);
+                    finfo->deferred = 1;
+                    return (output);
+                }
+                finfo->hashed = rv == 1;
+                if (finfo->hashed && conditional && finfo->hash == etag)
+                {
+                    file_out_close(&finfo->fout);
+                    finfo->hashed = 0;
+                    status = rate_admit(&finfo->root->rates, 
+                        finfo->client_ip_addr, 0) ? ST_NOT_MODIFIED : ST_BUSY;
+                    sprintf(message, "%s\n", status_names[status]);
+                    log_append(message, finfo);
+                    finfo->status = status;
+                    return (output);
+                }
+                if (pinned)
+                {
+                    finfo->hashed = 0; // a range never carries the hash
+                    if (rv != 1 || finfo->hash != etag)
+                    {
+                        file_out_close(&finfo->fout);
+                        status = rate_admit(&finfo->root->rates, 
+                            finfo->client_ip_addr, 0) ? ST_CHANGED : ST_BUSY;
+                        sprintf(message, "%s\n", status_names[status]);
+                        log_append(message, finfo);
+                        finfo->status = status;
+                        return (output);
+                    }
+                }
+            }
+            if (sized)
+            {
+                // the reply is a line of text in output, no file body
+                sprintf(output, "%lu", (unsigned long)finfo->fout.remaining);
+                if (finfo->hashed)
+                {
+                    sprintf(output + strlen(output), " %016llx", 
+                        (unsigned long long)finfo->hash);
+                }
+                strcat(output, "\n");
+                file_out_close(&finfo->fout);
+                finfo->hashed = 0; // it's in the body, not the header
+                finfo->text_reply = 1;
+            }
+            if (ranged)
+            {
+                // sendfile() and the cache both honour fout.off
+                size = finfo->fout.remaining;
+                if ((size_t)range_off > size)
+                {
+                    range_off = size;
+                }
+                finfo->fout.off = range_off;
+                finfo->fout.remaining = size - range_off;
+                if (range_len > 0 && (size_t)range_len < size - range_off)
+                {
+                    finfo->fout.remaining = range_len;
+                }
+            }
+            if (!rate_admit(&finfo->root->rates, finfo->client_ip_addr, 
+                finfo->fout.remaining))
+            {
+                file_out_close(&finfo->fout);
+                finfo->hashed = 0;
+                log_append("BUSY\n", finfo);
+                finfo->status = ST_BUSY;
+                return (output);
+            }
+            total_read = sized ? strlen(output) : finfo->fout.remaining;
+            strcat(output, " ");
+            
+            if (total_read < 1000)
+            {
+                sprintf(message, "%lu", total_read);
+            }
+            else 
+            {
+                strcat(message, "bigfile ");
+                sprintf(message + strlen(message), "%lu", total_read);
+            }
+            if (ranged)
+            {
+                sprintf(message + strlen(message), " range %lld-%lld",
+                    (long long)range_off, (long long)(range_off + total_read));
+            }
+            if (sized)
+            {
+                strcat(message, " size");
+            }
+            strcat(message, "\n");
+            log_append(message, finfo);
+        }
+    } 
+    return (output);
+}
+
+/* file_open -- point fo at name's body: a cache entry, or a fresh fd that
+ * then goes into the cache if it takes it. With finfo->may_defer set it
+ * stops short of anything that may block and sets finfo->deferred. */
+enum reply_status file_open(char *name, file_out *fo, file_info *finfo,
+    file_id *id)
+{
+    int fd;
+    struct stat st;
+    char reject[] = ")(*&^%$#@?!`~-+0123456789/";
+    cache_entry *ce;
+    unsigned long gen = 0;
+    serve_root *root;
+
+    if ((root = finfo->root = root_find(finfo->roots, name, &name)) == NULL)
+    {
+        return (ST_NOT_FOUND);
+    }
+    if ((ce = cache_lookup(&root->cache, name, &gen)) != NULL)
+    {
+        // a name only gets cached after it passed the checks below
+        finfo->cache_hits++;
+        file_out_from_cache(fo, ce);
+        if (id != NULL)
+        {
+            *id = ce->id;
+        }
+        return (ST_OK);
+    }
+    finfo->cache_misses += root->cache.enabled;
+    if (!dir_index_lookup(&root->dir, name))
+    {
+        return (ST_NOT_FOUND);
+    }
+    if ((strcspn(name, reject) != strlen(name)) || (name[0] == '.'))
+    {
+        return (ST_BAD_FILENAME);
+    }
+    if (finfo->may_defer)
+    {
+        // a cold open, stat and read, the pool looks it up again
+        finfo->deferred = 1;
+        return (ST_OK);
+    }
+
+    if ((fd = open_beneath(root->dirfd, name)) == -1)
+    {
+        // a symlink, in or out of the root, isn't served
+        return (errno == ELOOP || errno == EXDEV ? ST_NOT_ALLOWED : 
+            ST_NOT_READABLE);
+    }
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return (ST_NOT_READABLE);
+    }
+    if (id != NULL)
+    {
+        file_id_of(id, &st);
+    }
+    if ((ce = cache_insert(&root->cache, name, fd, &st, gen)) != NULL)
+    {
+        file_out_from_cache(fo, ce);
+        close(fd);
+    }
+    else
+    {
+        // hand the fd to the sender, the body is never copied
+        fo->fd = fd;
+        fo->remaining = st.st_size;
+    }
+
+    return (ST_OK);
+}
+
+/* open_beneath -- open name for reading below dirfd and nowhere else: no
+ * symlinks, no "..". Kernels without openat2() get O_NOFOLLOW, which is as
+ * good for the one path component file_open() lets through. */
+int open_beneath(int dirfd, char *name)
+{
+    struct open_how how;
+    int fd;
+
+    memset(&how, 0, sizeof how);
+    how.flags = O_RDONLY;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+    if ((fd = syscall(SYS_openat2, dirfd, name, &how, sizeof how)) == -1 && 
+        errno == ENOSYS)
+    {
+        fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW);
+    }
+
+    return (fd);
+}
+
+/* tokenize -- split buf on spaces into views, in place and without
+ * copying. Like the original strtok() loop the first word (the client's
+ * argv[0]) is skipped, so tok[0] is "ip:port" and tok[1] the command. */
+int tokenize(char *buf, size_t len, request *req, file_info *finfo)
+{
+    char *p = buf, *end = buf + len, *colon;
+    int skip = 1;
+    size_t room, n;
+
+    req->ntok = 0;
+    while (p < end && req->ntok < MAX_TOKENS)
+    {
+        while (p < end && *p == ' ')
+        {
+            p++;
+        }
+        if (p == end || *p == '\0')
+        {
+            break;
+        }
+        req->tok[req->ntok].p = p;
+        while (p < end && *p != ' ' && *p != '\0')
+        {
+            p++;
+        }
+        req->tok[req->ntok].len = p - req->tok[req->ntok].p;
+        if (skip)
+        {
+            skip = 0;
+            continue;
+        }
+        req->ntok++;
+    }
+    while (p < end && *p == ' ')
+    {
+        p++;
+    }
+    req->more = p < end && *p != '\0';
+
+    // the log shows the port the client asked for after its address;
+    // only its digits, the rest is whatever the client sent. It is kept
+    // apart: the address is what rates are charged to, and the request
+    // text is the client's to vary
+    if (req->ntok > 0 && 
+        (colon = memchr(req->tok[0].p, ':', req->tok[0].len)) != NULL)
+    {
+        room = sizeof(finfo->client_port) - 1;
+        len = req->tok[0].p + req->tok[0].len - colon;
+        for (n = 1; n < len && colon[n] >= '0' && colon[n] <= '9'; n++);
+        n = n < room ? n : room;
+        memcpy(finfo->client_port, colon, n);
+        finfo->client_port[n] = '\0';
+    }
+
+    return (req->ntok);
+}
+
+int tok_eq(token_view *t, char *s)
+{
+    return (t->len == strlen(s) && memcmp(t->p, s, t->len) == 0);
+}
+
+/* tok_to_hash -- parse a token of 1 to 16 hex digits; 0 if it isn't one */
+int tok_to_hash(token_view *t, uint64_t *out)
+{
+    size_t i;
+    uint64_t v = 0;
+    int d;
+
+    if (t->len == 0 || t->len > 16)
+    {
+        return (0);
+    }
+    for (i = 0; i < t->len; i++)
+    {
+        if (t->p[i] >= '0' && t->p[i] <= '9')
+        {
+            d = t->p[i] - '0';
+        }
+        else if ((t->p[i] | 0x20) >= 'a' && (t->p[i] | 0x20) <= 'f')
+        {
+            d = (t->p[i] | 0x20) - 'a' + 10;
+        }
+        else
+        {
+            return (0);
+        }
+        v = v << 4 | d;
+    }
+    *out = v;
+
+    return (1);
+}
+
+/* tok_to_off -- parse a token of decimal digits; 0 if it isn't one */
+int tok_to_off(token_view *t, off_t *out)
+{
+    size_t i;
+    off_t v = 0;
+
+    if (t->len == 0 || t->len > 18)
+    {
+        return (0);
+    }
+    for (i = 0; i < t->len; i++)
+    {
+        if (t->p[i] < '0' || t->p[i] > '9')
+        {
+            return (0);
+        }
+        v = v * 10 + (t->p[i] - '0');
+    }
+    *out = v;
+
+    return (1);
+}
+
+void arena_init(arena *a, char *base, size_t size)
+{
+    a->base = base;
+    a->size = size;
+    a->used = 0;
+}
+
+void arena_reset(arena *a)
+{
+    a->used = 0;
+}
+
+/* arena_alloc -- bump allocate n bytes, NULL when the arena is spent */
+void *arena_alloc(arena *a, size_t n)
+{
+    void *p;
+
+    n = (n + 7) & ~(size_t)7;
+    if (n > a->size - a->used)
+    {
+        return (NULL);
+    }
+    p = a->base + a->used;
+    a->used += n;
+
+    return (p);
+}
+
+char *arena_strndup(arena *a, char *s, size_t len)
+{
+    char *p;
+
+    if ((p = arena_alloc(a, len + 1)) != NULL)
+    {
+        memcpy(p, s, len);
+        p[len] = '\0';
+    }
+    return (p);
+}
+
+void log_append(char* message, file_info *finfo)
+{
+    char line[LOG_RECORD_MAX];
+    int hr, min, sec, dd, mm, yy, len; 
+    time_t now;
+    struct tm local;
+
+    time(&now);
+    localtime_r(&now, &local);
+    
+    hr = local.tm_hour;
+    min = local.tm_min;
+    sec = local.tm_sec;
+    dd = local.tm_mday;
+    mm = local.tm_mon + 1;
+    yy = local.tm_year + 1900;
+    
+    if ((len = snprintf(line, sizeof line, 
+            "[%04d-%02d-%02d %02d:%02d:%02d] %s%s %s", 
+            yy, mm, dd, hr, min, sec, finfo->client_ip_addr, 
+            finfo->client_port, message)) < 0)
+    {
+        fprintf(stderr, "sprintf() failed in line %d\n", __LINE__);
+        exit(EXIT_FAILURE);
+    }
+    if (len >= (int)sizeof line)
+    {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+
+    logger_push(finfo->root != NULL && finfo->root->log != NULL ? 
+        finfo->root->log : &access_log, line, len);
+}
+
+void logger_init(logger *lg, char *path, off_t max_bytes, int binary)
+{
+    size_t i;
+
+    memset(lg, 0, sizeof(logger));
+    if ((lg->slots = calloc(LOG_SLOTS, sizeof(log_slot))) == NULL)
+    {
+        fprintf(stderr, "calloc() failed in line %d\n", __LINE__);
+        exit(EXIT_FAILURE);
+    }
+    lg->mask = LOG_SLOTS - 1;
+    for (i = 0; i < LOG_SLOTS; i++)
+    {
+        atomic_init(&lg->slots[i].seq, i);
+    }
+    atomic_init(&lg->tail, 0);
+    atomic_init(&lg->dropped, 0);
+    lg->max_bytes = max_bytes;
+    lg->path = path;
+    lg->binary = binary;
+    lg->owner = getpid();
+
+    if ((lg->fd = logger_open(lg)) < 0)
+    {
+        fprintf(stderr, "open() failed in line %d\n", __LINE__);
         exit(EXIT_FAILURE);
     }
-    if ((write(fd, finfo.client_ip_addr, strlen(*request))) < 0)
+    if ((lg->wakefd = eventfd(0, EFD_NONBLOCK)) == -1)
+    {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+    if (pthread_create(&lg->thread, NULL, logger_main, lg) != 0)
+    {
+        fprintf(stderr, "pthread_create() failed in line %d\n", __LINE__);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* logger_push -- copy one record into the ring without taking a lock.
+ * A full ring never blocks the caller: the record is counted as dropped. */
+int logger_push(logger *lg, char *rec, size_t len)
+{
+    size_t pos, seq;
+    intptr_t dif;
+    log_slot *slot;
+    uint64_t one = 1;
+
+    pos = atomic_load_explicit(&lg->tail, memory_order_relaxed);
+    while (1)
+    {
+        slot = &lg->slots[pos & lg->mask];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&lg->tail, &pos, 
+                    pos + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (dif < 0)
+        {
+            atomic_fetch_add_explicit(&lg->dropped, 1, memory_order_relaxed);
+            return (-1);
+        }
+        else
+        {
+            pos = atomic_load_explicit(&lg->tail, memory_order_relaxed);
+        }
+    }
+
+    memcpy(slot->data, rec, len);
+    slot->len = len;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+    if (((pos + 1) & (LOG_FLUSH_RECORDS - 1)) == 0)
+    {
+        write(lg->wakefd, &one, sizeof one);
+    }
+
+    return (0);
+}
+
+/* logger_drain -- write out every record that is ready. Only one thread
+ * (the writer, or a forked child that has none) may drain at a time. */
+void logger_drain(logger *lg)
+{
+    struct iovec iov[BIN_BLOCK_RECORDS + 1];
+    log_slot *batch[BIN_BLOCK_RECORDS];
+    char note[LOG_RECORD_MAX];
+    unsigned long dropped;
+    bin_header bh;
+    uint64_t ts;
+    size_t seq;
+    int i, n, max = lg->binary ? BIN_BLOCK_RECORDS : LOG_BATCH;
+    struct iovec *rec = lg->binary ? iov + 1 : iov; // iov[0] is the header
+
+    // before writing, so a child whose parent rotated lands in the new file
+    logger_rotate(lg);
+    do {
+        for (n = 0; n < max; n++)
+        {
+            batch[n] = &lg->slots[(lg->head + n) & lg->mask];
+            seq = atomic_load_explicit(&batch[n]->seq, memory_order_acquire);
+            if (seq != lg->head + n + 1)
+            {
+                break;
+            }
+            rec[n].iov_base = batch[n]->data;
+            rec[n].iov_len = batch[n]->len;
+        }
+        // each batch is a block, its header has the time span for logq
+        if (n > 0 && lg->binary)
+        {
+            bh.magic = BIN_BLOCK_MAGIC;
+            bh.count = n;
+            bh.t_min = UINT64_MAX;
+            bh.t_max = 0;
+            for (i = 0; i < n; i++)
+            {
+                memcpy(&ts, batch[i]->data, sizeof ts);
+                bh.t_min = ts < bh.t_min ? ts : bh.t_min;
+                bh.t_max = ts > bh.t_max ? ts : bh.t_max;
+            }
+            iov[0].iov_base = &bh;
+            iov[0].iov_len = sizeof bh;
+        }
+        if (n > 0 && writev(lg->fd, iov, n + lg->binary) == -1)
+        {
+            perror("writev");
+        }
+        for (i = 0; i < n; i++)
+        {
+            atomic_store_explicit(&batch[i]->seq, lg->head + lg->mask + 1,
+                memory_order_release);
+            lg->head++;
+        }
+    } while (n == max);
+
+    dropped = atomic_load_explicit(&lg->dropped, memory_order_relaxed);
+    if (dropped != lg->dropped_reported && !lg->binary)
+    {
+        n = snprintf(note, sizeof note, "[logger] dropped %lu records\n",
+            dropped - lg->dropped_reported);
+        write(lg->fd, note, n);
+        lg->dropped_reported = dropped;
+    }
+}
+
+void log_index_init(log_index *li)
+{
+    pthread_mutex_init(&li->lock, NULL);
+    // same rule as the directory index: no fork() while someone scans
+    pthread_atfork(log_index_prefork, log_index_postfork, 
+        log_index_postfork_child);
+    li->cap = 64;
+    if ((li->marks = malloc(li->cap * sizeof(off_t))) == NULL)
     {
-        fprintf(stderr, "write() failed in line %d\n", __LINE__);
+        fprintf(stderr, "malloc() failed in line %d\n", __LINE__);
         exit(EXIT_FAILURE);
     }
-    write(fd, " ", 1);
-    write(fd, message, strlen(message));
-    date[0] = '\0';
-    pthread_mutex_unlock(&lock);
+    li->marks[0] = 0;
+    li->nmarks = 1;
+    li->scanned = 0;
+    li->lines = 0;
+    li->ino = 0;
+    log_index_refresh(li); // what earlier runs left behind
+}
+
+/* log_index_update -- index whatever was appended to the log open on fd
+ * since the last call, or start over if fd is a new log; lock held */
+int log_index_update(log_index *li, int fd)
+{
+    char buf[LOG_SCAN_BUF];
+    struct stat st;
+    ssize_t len;
+    off_t off;
+    char *p, *q;
+
+    if (fstat(fd, &st) == -1)
+    {
+        return (-1);
+    }
+    if (st.st_ino != li->ino || st.st_size < li->scanned)
+    {
+        li->ino = st.st_ino;
+        li->nmarks = 1;
+        li->scanned = 0;
+        li->lines = 0;
+    }
+    // a line the writer is halfway through gets read again next time
+    for (off = li->scanned; off < st.st_size; off += len)
+    {
+        len = st.st_size - off < (off_t)sizeof buf ? st.st_size - off : 
+            (off_t)sizeof buf;
+        if ((len = pread(fd, buf, len, off)) <= 0)
+        {
+            break;
+        }
+        for (p = buf; (q = memchr(p, '\n', buf + len - p)) != NULL; 
+            p = q + 1)
+        {
+            li->scanned = off + (q + 1 - buf);
+            if (++li->lines % LOG_INDEX_EVERY != 0)
+            {
+                continue;
+            }
+            if (li->nmarks == li->cap)
+            {
+                li->cap *= 2;
+                if ((li->marks = realloc(li->marks, li->cap * 
+                    sizeof(off_t))) == NULL)
+                {
+                    fprintf(stderr, "realloc() failed in line %d\n", 
+                        __LINE__);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            li->marks[li->nmarks++] = li->scanned;
+        }
+    }
+
+    return (0);
+}
+
+/* log_index_refresh -- catch up with the log; the watcher calls this for
+ * every batch the writer flushes, so requests seldom have to */
+void log_index_refresh(log_index *li)
+{
+    int fd;
+
+    if ((fd = open(LOG_PATH, O_RDONLY)) == -1)
+    {
+        return;
+    }
+    pthread_mutex_lock(&li->lock);
+    log_index_update(li, fd);
+    pthread_mutex_unlock(&li->lock);
+    close(fd);
+}
+
+/* log_index_seek -- where line number line starts, or the end of what is
+ * indexed if the log is shorter; lock held */
+off_t log_index_seek(log_index *li, int fd, unsigned long line)
+{
+    unsigned long skip;
+
+    if (line >= li->lines)
+    {
+        return (li->scanned);
+    }
+    skip = line % LOG_INDEX_EVERY;
+    return (log_scan(fd, li->marks[line / LOG_INDEX_EVERY], li->scanned, 
+        &skip));
+}
+
+/* log_index_line_at -- the number of the line off is in; lock held */
+unsigned long log_index_line_at(log_index *li, int fd, off_t off)
+{
+    size_t lo = 0, hi = li->nmarks, mid;
+    unsigned long n = ULONG_MAX;
+
+    // the last mark at or before off
+    while (hi - lo > 1)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (li->marks[mid] <= off)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    log_scan(fd, li->marks[lo], off, &n);
+
+    return (lo * LOG_INDEX_EVERY + n);
+}
+
+void log_index_prefork()
+{
+    pthread_mutex_lock(&log_lines.lock);
+}
+
+void log_index_postfork()
+{
+    pthread_mutex_unlock(&log_lines.lock);
+}
+
+void log_index_postfork_child()
+{
+    pthread_mutex_init(&log_lines.lock, NULL);
+}
+
+/* log_scan -- step over up to *n lines of fd from off, not past end; 
+ * returns where it stopped and sets *n to the lines it passed */
+off_t log_scan(int fd, off_t off, off_t end, unsigned long *n)
+{
+    char buf[LOG_SCAN_BUF];
+    unsigned long seen = 0;
+    ssize_t len;
+    char *p, *q;
+
+    while (seen < *n && off < end)
+    {
+        len = end - off < (off_t)sizeof buf ? end - off : (off_t)sizeof buf;
+        if ((len = pread(fd, buf, len, off)) <= 0)
+        {
+            break;
+        }
+        for (p = buf; seen < *n && 
+            (q = memchr(p, '\n', buf + len - p)) != NULL; p = q + 1)
+        {
+            seen++;
+        }
+        off += seen < *n ? len : p - buf;
+    }
+    *n = seen;
+
+    return (off);
+}
+
+/* log_range -- the part of the log open on fd a request asks for:
+ *  log                    all of it
+ *  log offset [lines]     from a byte cursor, at most that many records
+ *  log line n [lines]     from record n, the first being 0
+ *  log tail n             the last n records
+ *  log follow [offset]    from offset (default the end) on, and then
+ *                         whatever is appended until the client leaves
+ * A byte cursor is just how much of the log the client has, so asking
+ * with it returns only the records written since. Only whole records go
+ * out. Sets fo; returns 1, 0 for a bad request or -1 if fd is unusable. */
+int log_range(log_index *li, int fd, request *req, file_out *fo)
+{
+    token_view *arg = &req->tok[2];
+    int nargs = req->ntok - 2, rv = 1, limited = 0;
+    off_t start = 0, end, n = 0, lines = 0;
+    unsigned long first = 0;
+
+    pthread_mutex_lock(&li->lock);
+    if (log_index_update(li, fd) == -1)
+    {
+        pthread_mutex_unlock(&li->lock);
+        return (-1);
+    }
+    end = li->scanned;
+    if (nargs > 3)
+    {
+        rv = 0;
+    }
+    else if (nargs == 0)
+    {
+        start = 0;
+    }
+    else if (tok_eq(&arg[0], "follow"))
+    {
+        start = end;
+        rv = nargs == 1 || (nargs == 2 && tok_to_off(&arg[1], &start));
+        fo->follow = 1;
+    }
+    else if (tok_eq(&arg[0], "tail"))
+    {
+        if ((rv = nargs == 2 && tok_to_off(&arg[1], &n)))
+        {
+            start = log_index_seek(li, fd, 
+                li->lines > (unsigned long)n ? li->lines - n : 0);
+        }
+    }
+    else if (tok_eq(&arg[0], "line"))
+    {
+        if ((rv = nargs >= 2 && tok_to_off(&arg[1], &n) && 
+            (nargs == 2 || tok_to_off(&arg[2], &lines))))
+        {
+            first = n;
+            start = log_index_seek(li, fd, first);
+            limited = nargs == 3;
+        }
+    }
+    else if ((rv = nargs <= 2 && tok_to_off(&arg[0], &start) && 
+        (nargs == 1 || tok_to_off(&arg[1], &lines))))
+    {
+        if (start > end)
+        {
+            start = end;
+        }
+        if ((limited = nargs == 2))
+        {
+            first = log_index_line_at(li, fd, start);
+        }
+    }
+    if (rv && limited)
+    {
+        end = log_index_seek(li, fd, first + lines);
+    }
+    pthread_mutex_unlock(&li->lock);
+
+    if (!rv)
+    {
+        fo->follow = 0;
+        return (0);
+    }
+    fo->off = start < end ? start : end;
+    fo->remaining = end - fo->off;
+
+    return (1);
+}
+
+/* log_follow -- the catch-up part is sent, now pass on what the writer
+ * appends, across rotations, until the client hangs up. Blocks, so it
+ * only runs in a forked child or a follower thread. */
+void log_follow(connection *conn)
+{
+    file_out *fo = &conn->fout;
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd[2];
+    struct stat st, cur;
+    struct timeval tv;
+    int flags;
+
+    if ((flags = fcntl(conn->fd, F_GETFL)) == -1 || 
+        fcntl(conn->fd, F_SETFL, flags & ~O_NONBLOCK) == -1)
+    {
+        perror("fcntl");
+        return;
+    }
+    if ((pfd[1].fd = inotify_init1(IN_CLOEXEC)) == -1)
+    {
+        perror("inotify_init1");
+        return;
+    }
+    inotify_add_watch(pfd[1].fd, LOG_PATH, IN_MODIFY | IN_MOVE_SELF);
+    // blocking now, but a reader that stops reading still gets cut off
+    tv.tv_sec = send_timeout;
+    tv.tv_usec = 0;
+    setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+    pfd[0].fd = conn->fd;
+    pfd[0].events = POLLRDHUP; // not POLLIN, more requests are ignored
+    pfd[1].events = POLLIN;
+    while (fstat(fo->fd, &st) == 0)
+    {
+        while (fo->off < st.st_size && 
+            sendfile(conn->fd, fo->fd, &fo->off, st.st_size - fo->off) > 0);
+        if (fo->off < st.st_size)
+        {
+            break; // the client is gone
+        }
+        // rotated: the old file is finished once it's all sent
+        if (stat(LOG_PATH, &cur) == 0 && cur.st_ino != st.st_ino)
+        {
+            close(fo->fd);
+            if ((fo->fd = open(LOG_PATH, O_RDONLY)) == -1)
+            {
+                break;
+            }
+            fo->off = 0;
+            inotify_add_watch(pfd[1].fd, LOG_PATH, IN_MODIFY | IN_MOVE_SELF);
+            continue;
+        }
+        if (poll(pfd, 2, LOG_FOLLOW_MS) == -1 && errno != EINTR)
+        {
+            break;
+        }
+        if (pfd[0].revents != 0)
+        {
+            break;
+        }
+        if (pfd[1].revents & POLLIN)
+        {
+            read(pfd[1].fd, buf, sizeof buf);
+        }
+    }
+    close(pfd[1].fd);
+}
+
+/* logger_rotate -- move lg's file to path.1 once it's past max_bytes and
+ * start a new one. Only the owner does; a forked child shares the file
+ * with it and, if the owner already rotated, just reopens path. */
+void logger_rotate(logger *lg)
+{
+    char rotated[PATH_MAX];
+    struct stat st, cur;
+    int fd;
 
+    if (lg->max_bytes == 0 || fstat(lg->fd, &st) == -1)
+    {
+        return;
+    }
+    if (getpid() != lg->owner)
+    {
+        if (stat(lg->path, &cur) == -1 || 
+            (cur.st_dev == st.st_dev && cur.st_ino == st.st_ino))
+        {
+            return;
+        }
+    }
+    else
+    {
+        if (st.st_size < lg->max_bytes)
+        {
+            return;
+        }
+        if (lg->binary)
+        {
+            binlog_seal(lg->fd);
+        }
+        snprintf(rotated, sizeof rotated, "%s.1", lg->path);
+        if (rename(lg->path, rotated) == -1)
+        {
+            perror("rename");
+            return;
+        }
+    }
+    if ((fd = logger_open(lg)) < 0)
+    {
+        perror("open");
+        return;
+    }
+    dup2(fd, lg->fd); // swap in place so lg->fd never dangles
     close(fd);
 }
 
+/* logger_discard -- forget every queued record without writing it */
+void logger_discard(logger *lg)
+{
+    size_t tail = atomic_load_explicit(&lg->tail, memory_order_relaxed);
+
+    for (; lg->head != tail; lg->head++)
+    {
+        atomic_store_explicit(&lg->slots[lg->head & lg->mask].seq, 
+            lg->head + lg->mask + 1, memory_order_relaxed);
+    }
+    lg->dropped_reported = atomic_load_explicit(&lg->dropped, 
+        memory_order_relaxed);
+}
+
+/* logger_postfork_child -- a child's rings start out holding the records
+ * the parent queued, which the parent's writers still drain */
+void logger_postfork_child()
+{
+    int n;
+
+    logger_discard(&access_log);
+    for (n = 0; n < root_logs_used; n++)
+    {
+        logger_discard(&root_logs[n]);
+    }
+    if (use_binlog)
+    {
+        logger_discard(&bin_log);
+    }
+}
+
+/* logger_open -- open (or create) lg's file for appending; a new binary
+ * log starts with its file header */
+int logger_open(logger *lg)
+{
+    bin_file_header fh = {BIN_FILE_MAGIC, BIN_VERSION, sizeof(bin_record), 0};
+    struct stat st;
+    int fd;
+
+    // binlog_seal() reads the block headers back through the same fd
+    if ((fd = open(lg->path, (lg->binary ? O_RDWR : O_WRONLY) | O_APPEND | 
+        O_CREAT, 0644)) < 0)
+    {
+        return (-1);
+    }
+    if (lg->binary && fstat(fd, &st) == 0 && st.st_size == 0 && 
+        write(fd, &fh, sizeof fh) != sizeof fh)
+    {
+        perror("write");
+    }
+
+    return (fd);
+}
+
+/* binlog_add -- queue the binary record of the request just parsed */
+void binlog_add(connection *conn, file_info *finfo, uint64_t parse_ns)
+{
+    bin_record rec;
+    struct timespec now;
+    struct in_addr v4;
+
+    memset(&rec, 0, sizeof rec);
+    clock_gettime(CLOCK_REALTIME, &now);
+    rec.ts = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    rec.bytes = file_out_total(&conn->fout);
+    if (inet_pton(AF_INET, conn->client_ip_addr, &v4) == 1)
+    {
+        rec.addr[10] = rec.addr[11] = 0xff;
+        memcpy(rec.addr + 12, &v4, 4);
+    }
+    else
+    {
+        inet_pton(AF_INET6, conn->client_ip_addr, rec.addr);
+    }
+    rec.parse_us = parse_ns / 1000;
+    rec.cmd = finfo->cmd;
+    rec.status = finfo->status;
+    rec.proto = conn->proto;
+    logger_push(&bin_log, (char *)&rec, sizeof rec);
+}
+
+/* binlog_seal -- append the index of its blocks to a binary log nobody
+ * writes to any more, found by walking the block headers */
+void binlog_seal(int fd)
+{
+    bin_header bh, ih = {BIN_INDEX_MAGIC, 0, UINT64_MAX, 0};
+    bin_index_entry *idx = NULL;
+    bin_trailer tr;
+    struct iovec iov[3];
+    struct stat st;
+    off_t off = sizeof(bin_file_header);
+    size_t cap = 0;
+
+    if (fstat(fd, &st) == -1)
+    {
+        return;
+    }
+    while (off + (off_t)sizeof bh <= st.st_size && 
+        pread(fd, &bh, sizeof bh, off) == sizeof bh)
+    {
+        if (bh.magic == BIN_INDEX_MAGIC)
+        {
+            // sealed once already, and then written to after all
+            off += sizeof bh + bh.count * sizeof(bin_index_entry) + 
+                sizeof tr;
+            continue;
+        }
+        if (bh.magic != BIN_BLOCK_MAGIC)
+        {
+            break;
+        }
+        if (ih.count == cap)
+        {
+            cap = cap ? cap * 2 : 256;
+            if ((idx = realloc(idx, cap * sizeof(bin_index_entry))) == NULL)
+            {
+                fprintf(stderr, "realloc() failed in line %d\n", __LINE__);
+                exit(EXIT_FAILURE);
+            }
+        }
+        idx[ih.count].off = off;
+        idx[ih.count].t_min = bh.t_min;
+        idx[ih.count].t_max = bh.t_max;
+        idx[ih.count].count = bh.count;
+        idx[ih.count].reserved = 0;
+        ih.count++;
+        ih.t_min = bh.t_min < ih.t_min ? bh.t_min : ih.t_min;
+        ih.t_max = bh.t_max > ih.t_max ? bh.t_max : ih.t_max;
+        off += sizeof bh + (off_t)bh.count * sizeof(bin_record);
+    }
+    tr.index_off = st.st_size;
+    tr.nblocks = ih.count;
+    tr.magic = BIN_INDEX_MAGIC;
+    iov[0].iov_base = &ih;
+    iov[0].iov_len = sizeof ih;
+    iov[1].iov_base = idx;
+    iov[1].iov_len = ih.count * sizeof(bin_index_entry);
+    iov[2].iov_base = &tr;
+    iov[2].iov_len = sizeof tr;
+    if (writev(fd, iov, 3) == -1)
+    {
+        perror("writev");
+    }
+    free(idx);
+}
+
+void *logger_main(void *arg)
+{
+    logger *lg = arg;
+    struct pollfd pfd;
+    uint64_t count;
+
+    pfd.fd = lg->wakefd;
+    pfd.events = POLLIN;
+    while (1)
+    {
+        if (poll(&pfd, 1, LOG_FLUSH_MS) > 0)
+        {
+            read(lg->wakefd, &count, sizeof count);
+        }
+        logger_drain(lg);
+    }
+
+    return (NULL);
+}
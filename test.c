@@ -5,9 +5,23 @@
 #include <string.h>
 #include <sys/wait.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 
+#ifndef IP_PORT
 #define IP_PORT "129.65.128.80:4440"
+#endif
 #define BUFSIZE 1024
+#define TEST_PORT "4445" /* the tests below start their own ./server here */
+#define TEST_IP_PORT "127.0.0.1:" TEST_PORT
+#define FRAME_REQ_LEN 12 /* framed protocol, see server.c */
+#define FRAME_RESP_LEN 20
+#define RANGE_FILE_SIZE (3 << 20) /* more than one pipe's worth */
 
 /* content vector -- containts the content and the size of provided vector */
 struct contv {
@@ -21,6 +35,13 @@ void read_from_stdout(struct contv*, int*);
 void read_from_curr_dir(struct contv*);
 void err_display(char*, int);
 void dup_execvp(int*, char**);
+pid_t start_server(char**);
+int port_free();
+void stop_server(pid_t);
+int raw_request(char*, int, char*, int);
+void write_file(char*, char*, int);
+int put_frame(char*, uint32_t, char*);
+int frame_reply(char*, uint32_t*, int*, char**);
 
 /***********************************
  * test01 -- test an empty command.*
@@ -106,12 +127,253 @@ void test02_index()
 
 } */
 
+/*************************************************************
+ * test03 -- the tokenizer: runs of spaces, no command, more *
+ * words than a request may have.                            *
+ *************************************************************/
+void test03_tokenize()
+{
+    char *argv[] = {"./server", "--epoll", TEST_PORT, NULL};
+    char buf[BUFSIZE], req[BUFSIZE];
+    int i;
+    pid_t pid;
+
+    write_file("tokens", "tokens\n", 7);
+    pid = start_server(argv);
+
+    /* test03 test cases; a legacy reply ends with one extra byte */
+    assert(raw_request("client " TEST_IP_PORT " tokens", -1, buf, 
+        BUFSIZE) == 8);
+    assert(memcmp(buf, "tokens\n ", 8) == 0);
+    assert(raw_request("client   " TEST_IP_PORT "    tokens   ", -1, buf, 
+        BUFSIZE) == 8);
+    assert(memcmp(buf, "tokens\n ", 8) == 0);
+    assert(raw_request("client", -1, buf, BUFSIZE) == 0);
+    assert(raw_request("client " TEST_IP_PORT, -1, buf, BUFSIZE) == 0);
+    strcpy(req, "client " TEST_IP_PORT " get");
+    for (i = 0; i < 100; i++)
+    {
+        strcat(req, " tokens");
+    }
+    assert(raw_request(req, -1, buf, BUFSIZE) == 0);
+
+    stop_server(pid);
+    unlink("tokens");
+}
+
+/****************************************************************
+ * test04 -- framing: pipelined requests answered in order on one *
+ * connection, a bad request doesn't end it, a frame cut short    *
+ * gets no reply.                                                 *
+ ****************************************************************/
+void test04_framing()
+{
+    char *argv[] = {"./server", "--epoll", TEST_PORT, NULL};
+    char buf[BUFSIZE], req[BUFSIZE], *body = NULL, *p = buf;
+    uint32_t id;
+    int len, status, n;
+    pid_t pid;
+
+    write_file("framed", "framed\n", 7);
+    pid = start_server(argv);
+
+    len = put_frame(req, 7, "client " TEST_IP_PORT " framed");
+    len += put_frame(req + len, 8, "client " TEST_IP_PORT);
+    len += put_frame(req + len, 9, "client " TEST_IP_PORT " framed 2");
+    n = raw_request(req, len, buf, BUFSIZE);
+
+    /* test04 test cases */
+    assert((len = frame_reply(p, &id, &status, &body)) == 7);
+    assert(id == 7 && status == 0 && memcmp(body, "framed\n", 7) == 0);
+    p = body + len;
+    assert(frame_reply(p, &id, &status, &body) == 0);
+    assert(id == 8 && status == 5); /* BAD_REQUEST */
+    p = body;
+    assert((len = frame_reply(p, &id, &status, &body)) == 5);
+    assert(id == 9 && status == 0 && memcmp(body, "amed\n", 5) == 0);
+    assert(body + len == buf + n);
+
+    len = put_frame(req, 1, "client " TEST_IP_PORT " framed");
+    assert(raw_request(req, len - 3, buf, BUFSIZE) == 0);
+
+    stop_server(pid);
+    unlink("framed");
+}
+
+/*****************************************************************
+ * test05 -- byte ranges: unaligned starts, a length past the end, *
+ * an offset past it, length 0 for the rest, in every server mode. *
+ *****************************************************************/
+void test05_ranges()
+{
+    char *argv[][7] = { /* from the cache, then from the file */
+        {"./server", TEST_PORT, NULL},
+        {"./server", "--epoll", TEST_PORT, NULL},
+        {"./server", "--epoll", "--cache-bytes", "0", TEST_PORT, NULL},
+        {"./server", "--uring", TEST_PORT, NULL},
+        {"./server", "--uring", "--cache-bytes", "0", TEST_PORT, NULL},
+        {"./server", "--workers", "2", "--cache-bytes", "0", TEST_PORT, 
+            NULL}};
+    long ranges[][3] = { /* offset, length asked for, length expected */
+        {0, 0, RANGE_FILE_SIZE}, {1, 0, RANGE_FILE_SIZE - 1}, 
+        {4095, 3, 3}, {1000, 2 << 20, 2 << 20}, 
+        {4097, RANGE_FILE_SIZE, RANGE_FILE_SIZE - 4097},
+        {RANGE_FILE_SIZE, 0, 0}, {RANGE_FILE_SIZE + 10, 5, 0}};
+    char *data, *buf, *body = NULL, req[BUFSIZE], payload[BUFSIZE];
+    uint32_t id;
+    int i, m, status, len;
+    pid_t pid;
+
+    if ((data = malloc(RANGE_FILE_SIZE)) == NULL || 
+        (buf = malloc(RANGE_FILE_SIZE + BUFSIZE)) == NULL)
+    {
+        err_display("malloc()", __LINE__);
+    }
+    for (i = 0; i < RANGE_FILE_SIZE; i++)
+    {
+        data[i] = i * 7 % 251;
+    }
+    write_file("ranges", data, RANGE_FILE_SIZE);
+
+    for (m = 0; m < (int)(sizeof argv / sizeof *argv); m++)
+    {
+        pid = start_server(argv[m]);
+
+        /* test05 test cases */
+        for (i = 0; i < (int)(sizeof ranges / sizeof *ranges); i++)
+        {
+            sprintf(payload, "client " TEST_IP_PORT " ranges %ld %ld", 
+                ranges[i][0], ranges[i][1]);
+            len = put_frame(req, i, payload);
+            assert(raw_request(req, len, buf, RANGE_FILE_SIZE + BUFSIZE) ==
+                FRAME_RESP_LEN + ranges[i][2]);
+            assert(frame_reply(buf, &id, &status, &body) == ranges[i][2]);
+            assert(id == (uint32_t)i && status == 0);
+            assert(memcmp(body, data + ranges[i][0], ranges[i][2]) == 0);
+        }
+        len = put_frame(req, 0, "client " TEST_IP_PORT " ranges x");
+        assert(raw_request(req, len, buf, BUFSIZE) == FRAME_RESP_LEN);
+        assert(frame_reply(buf, &id, &status, &body) == 0 && status == 5);
+
+        stop_server(pid);
+    }
+    unlink("ranges");
+    free(data);
+    free(buf);
+}
+
+/* roots_setup -- a --config file for test06 and test07 and its roots */
+void roots_setup()
+{
+    char *conf = "main .\nlim limroot rate=2\ndocs docsroot\n";
+
+    mkdir("limroot", 0755);
+    mkdir("docsroot", 0755);
+    write_file("roots.test", conf, strlen(conf));
+    write_file("limroot/gamma", "gamma\n", 6);
+    write_file("docsroot/alpha", "alpha\n", 6);
+    symlink("/etc/hostname", "docsroot/link");
+    symlink("alpha", "docsroot/inlink");
+}
+
+void roots_cleanup()
+{
+    unlink("limroot/gamma");
+    unlink("docsroot/alpha");
+    unlink("docsroot/link");
+    unlink("docsroot/inlink");
+    rmdir("limroot");
+    rmdir("docsroot");
+    unlink("roots.test");
+}
+
+/****************************************************************
+ * test06 -- a root's rate= limit: kept by the client's address, *
+ * so a different port in each request doesn't get around it.   *
+ ****************************************************************/
+void test06_root_rate()
+{
+    char *argv[][6] = {
+        {"./server", "--config", "roots.test", TEST_PORT, NULL},
+        {"./server", "--epoll", "--config", "roots.test", TEST_PORT, NULL}};
+    char buf[BUFSIZE], req[BUFSIZE], payload[BUFSIZE], *p, *body = NULL;
+    uint32_t id;
+    int i, m, len, status;
+    pid_t pid;
+
+    roots_setup();
+    for (m = 0; m < (int)(sizeof argv / sizeof *argv); m++)
+    {
+        pid = start_server(argv[m]);
+        for (i = len = 0; i < 4; i++)
+        {
+            sprintf(payload, "client 127.0.0.1:%d lim/gamma", 5000 + i);
+            len += put_frame(req + len, i, payload);
+        }
+        raw_request(req, len, buf, BUFSIZE);
+
+        /* test06 test cases: rate=2 lets 2 through at once, not more */
+        for (i = 0, p = buf; i < 4; i++, p = body + len)
+        {
+            assert((len = frame_reply(p, &id, &status, &body)) >= 0);
+            assert(id == (uint32_t)i && status == (i < 2 ? 0 : 6));
+        }
+
+        stop_server(pid);
+    }
+    roots_cleanup();
+}
+
+/*****************************************************************
+ * test07 -- root containment: no symlinks, in or out of a root, *
+ * and no path that climbs out of one.                           *
+ *****************************************************************/
+void test07_root_containment()
+{
+    char *argv[] = {"./server", "--epoll", "--config", "roots.test", 
+        TEST_PORT, NULL};
+    char *names[] = {"docs/alpha", "docs/link", "docs/inlink", 
+        "docs/../roots.test", "../etc/passwd", "/etc/passwd", "docs/", NULL};
+    int expect[] = {0, 3, 3, 1, 1, 1, 1}; /* OK, NOT_ALLOWED, NOT_FOUND */
+    char buf[BUFSIZE], req[BUFSIZE], payload[BUFSIZE], *body = NULL;
+    uint32_t id;
+    int i, len, status;
+    pid_t pid;
+
+    roots_setup();
+    pid = start_server(argv);
+
+    /* test07 test cases */
+    for (i = 0; names[i] != NULL; i++)
+    {
+        sprintf(payload, "client " TEST_IP_PORT " %s", names[i]);
+        len = put_frame(req, i, payload);
+        raw_request(req, len, buf, BUFSIZE);
+        len = frame_reply(buf, &id, &status, &body);
+        assert(status == expect[i]);
+        assert(status != 0 || memcmp(body, "alpha\n", len) == 0);
+    }
+
+    stop_server(pid);
+    roots_cleanup();
+}
+
 int main()
 {
     test01_empty_input();
     printf("test01 passed successfully\n"); 
     test02_index();
     printf("test02 passed successfully\n");  
+    test03_tokenize();
+    printf("test03 passed successfully\n");
+    test04_framing();
+    printf("test04 passed successfully\n");
+    test05_ranges();
+    printf("test05 passed successfully\n");
+    test06_root_rate();
+    printf("test06 passed successfully\n");
+    test07_root_containment();
+    printf("test07 passed successfully\n");
 
     return (0);
 }
@@ -220,6 +482,158 @@ void dup_execvp(int *fd, char **argv)
     err_display("execl()", __LINE__);
 }
 
+/* start_server -- run ./server with argv in the background, quietly, and
+ * give it a moment to bind */
+pid_t start_server(char **argv)
+{
+    pid_t pid;
+    int fd, i;
+
+    /* an --uring server's port is let go of a moment after it exits */
+    for (i = 0; i < 100 && !port_free(); i++)
+    {
+        usleep(20000);
+    }
+    if ((pid = fork()) == -1)
+    {
+        err_display("fork()", __LINE__);
+    }
+    if (pid == 0)
+    {
+        if ((fd = open("/dev/null", O_WRONLY)) != -1)
+        {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+        }
+        execvp("./server", argv);
+        err_display("execvp()", __LINE__);
+    }
+    usleep(300000);
+
+    return (pid);
+}
+
+/* port_free -- 1 if a server could bind TEST_PORT now */
+int port_free()
+{
+    struct addrinfo hints, *ai;
+    int sockfd, yes = 1, rv;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(NULL, TEST_PORT, &hints, &ai) != 0 ||
+        (sockfd = socket(ai->ai_family, ai->ai_socktype, 0)) == -1)
+    {
+        err_display("socket()", __LINE__);
+    }
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+    rv = bind(sockfd, ai->ai_addr, ai->ai_addrlen) == 0;
+    close(sockfd);
+    freeaddrinfo(ai);
+
+    return (rv);
+}
+
+void stop_server(pid_t pid)
+{
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+/* raw_request -- send len bytes of req (all of it if len is -1) to the
+ * server on TEST_PORT as they are, then read what comes back until it
+ * closes, at most size bytes into buf. Returns how many. */
+int raw_request(char *req, int len, char *buf, int size)
+{
+    struct addrinfo hints, *ai;
+    int sockfd, n, total_read = 0;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo("127.0.0.1", TEST_PORT, &hints, &ai) != 0)
+    {
+        err_display("getaddrinfo()", __LINE__);
+    }
+    if ((sockfd = socket(ai->ai_family, ai->ai_socktype, 0)) == -1 ||
+        connect(sockfd, ai->ai_addr, ai->ai_addrlen) == -1)
+    {
+        err_display("connect()", __LINE__);
+    }
+    freeaddrinfo(ai);
+
+    if (len == -1)
+    {
+        len = strlen(req);
+    }
+    if (write(sockfd, req, len) != len)
+    {
+        err_display("write()", __LINE__);
+    }
+    shutdown(sockfd, SHUT_WR); /* no more requests */
+    while (total_read < size && 
+        (n = read(sockfd, buf + total_read, size - total_read)) > 0)
+    {
+        total_read += n;
+    }
+    close(sockfd);
+
+    return (total_read);
+}
+
+void write_file(char *name, char *data, int len)
+{
+    int fd;
+
+    if ((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 ||
+        write(fd, data, len) != len)
+    {
+        err_display("write_file()", __LINE__);
+    }
+    close(fd);
+}
+
+/* put_frame -- a framed request for payload at buf; returns its size */
+int put_frame(char *buf, uint32_t id, char *payload)
+{
+    uint32_t magic = htonl(0x54435051);
+    uint16_t flags = 0, len = htons(strlen(payload));
+
+    id = htonl(id);
+    memcpy(buf, &magic, 4);
+    memcpy(buf + 4, &id, 4);
+    memcpy(buf + 8, &flags, 2);
+    memcpy(buf + 10, &len, 2);
+    memcpy(buf + FRAME_REQ_LEN, payload, strlen(payload));
+
+    return (FRAME_REQ_LEN + strlen(payload));
+}
+
+/* frame_reply -- take apart the reply header at buf; its body follows it.
+ * Returns the body's length, -1 if buf holds no reply. */
+int frame_reply(char *buf, uint32_t *id, int *status, char **body)
+{
+    uint32_t magic, hi, lo;
+    uint16_t st;
+
+    memcpy(&magic, buf, 4);
+    if (ntohl(magic) != 0x54435052)
+    {
+        return (-1);
+    }
+    memcpy(id, buf + 4, 4);
+    *id = ntohl(*id);
+    memcpy(&st, buf + 8, 2);
+    *status = ntohs(st);
+    memcpy(&hi, buf + 12, 4);
+    memcpy(&lo, buf + 16, 4);
+    *body = buf + FRAME_RESP_LEN;
+
+    return (ntohl(hi) != 0 ? -1 : (int)ntohl(lo));
+}
+
 void err_display(char *str, int err_line)
 {
     fprintf(stderr, "%s failed in err_line %d\n", str, err_line);